@@ -0,0 +1,334 @@
+/*
+* Microbenchmarks for expr2, built with -Dbenchmarks=true and run with
+* `meson test --benchmark`.
+*
+* The translation unit is included so that its internals are reachable.
+*/
+
+#include "exprfilter.cpp"
+#include "ExecutableMemory.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+void registerVersionFunc(VSPublicFunction) {}
+
+namespace {
+
+template<typename F>
+double nanosecondsPerCall(F &&f) {
+    using clock = std::chrono::steady_clock;
+    volatile float sink = 0;
+    long iterations = 1;
+    for (;;) {
+        auto start = clock::now();
+        for (long i = 0; i < iterations; i++)
+            sink = sink + f(static_cast<int>(i));
+        double elapsed = std::chrono::duration<double, std::nano>(clock::now() - start).count();
+        if (elapsed > 2e8)
+            return elapsed / iterations;
+        iterations *= 4;
+    }
+}
+
+// A 1920x1080 float clip, just enough of the API to compile expressions for
+// it, and frames to run them on.
+struct BenchClip {
+    VSAPI api {};
+    VSVideoInfo vi {};
+    const VSVideoInfo *vis[1] = { &vi };
+    // Aligned like those allocated by VapourSynth.
+    std::unique_ptr<float[], decltype(&vsh::vsh_aligned_free)> src, dst;
+
+    BenchClip() : src(nullptr, vsh::vsh_aligned_free), dst(nullptr, vsh::vsh_aligned_free) {
+        api.getVideoFormatName = [](const VSVideoFormat *f, char *buf) noexcept {
+            snprintf(buf, 32, "F%d_%d", f->sampleType, f->bitsPerSample);
+            return 1;
+        };
+        vi.format.colorFamily = cfGray;
+        vi.format.sampleType = stFloat;
+        vi.format.bitsPerSample = 32;
+        vi.format.bytesPerSample = 4;
+        vi.format.numPlanes = 1;
+        vi.width = 1920;
+        vi.height = 1080;
+        size_t pixels = static_cast<size_t>(vi.width) * vi.height;
+        src.reset(vsh::vsh_aligned_malloc<float>(pixels * 4, 64));
+        dst.reset(vsh::vsh_aligned_malloc<float>(pixels * 4, 64));
+        for (size_t i = 0; i < pixels; i++)
+            src[i] = static_cast<float>(i % 1000) * 0.01f;
+    }
+
+    double nanosecondsPerPixel(const Compiled &c) {
+        auto proc = reinterpret_cast<ExprData::ProcessProc>(const_cast<void *>(c.routine->getEntry()));
+        void *ptrs[] = { dst.get(), src.get() };
+        int strides[] = { vi.width * 4, vi.width * 4 };
+        float consts[8] = {};
+        double perFrame = nanosecondsPerCall([&](int) {
+            proc(ptrs, strides, consts, vi.width, vi.height, 0, vi.height);
+            return dst[0];
+        });
+        return perFrame / (vi.width * vi.height);
+    }
+};
+
+// expr plus a constant that no earlier call used, so that it is compiled
+// instead of found in the in-memory cache.
+std::string uncached(const char *expr) {
+    static int n = 0;
+    return std::string(expr) + " " + std::to_string(n++) + " +";
+}
+
+// Resident set size of the process, or 0 where it cannot be queried.
+size_t residentBytes() {
+    size_t pages = 0, resident = 0;
+#ifdef __linux__
+    std::ifstream f("/proc/self/statm");
+    if (!(f >> pages >> resident))
+        resident = 0;
+#endif
+    return resident * rr::memoryPageSize();
+}
+
+// Compares interpret() with Bytecode on the kind of expressions used with
+// Select and PropExpr, and with an Expr routine processing a single pixel,
+// which is what compiling these expressions with the JIT would cost per call.
+void benchInterpreter() {
+    const char *exprs[] = {
+        "x.A",
+        "x.A y.B + 2 /",
+        "x.A y.B - abs x.C 0.5 * > x.A y.B ?",
+        "x.A a! y.B b! a@ b@ max a@ b@ min - a@ b@ + 1 + / round",
+        "x.A y.B x.C N argmin4",
+        "x.A y.B x.C x.D y.A y.C sort6 drop2 + + + 4 / x.A y.B - dup * sqrt + N 3 % 1 = *",
+    };
+    const float values[] = { 1.5f, 7.0f, 3.25f, 12.0f, 0.75f, 9.0f };
+
+    BenchClip clip;
+    VSVideoInfo pixel = clip.vi;
+    pixel.width = pixel.height = 1;
+    const VSVideoInfo *inputs[] = { &pixel, &pixel };
+
+    printf("%-80s %12s %12s %12s\n", "interpreter (ns per evaluation)", "interpret", "bytecode", "jit");
+    for (const char *expr: exprs) {
+        std::vector<ExprOp> ops;
+        for (const auto &tok: tokenize(expr))
+            ops.push_back(decodeToken(tok, true));
+        std::map<std::pair<int, std::string>, int> index;
+        auto slot = [&index](int clip, const std::string &name) {
+            return index.emplace(std::make_pair(clip, name), static_cast<int>(index.size())).first->second;
+        };
+        Bytecode bytecode(ops, slot);
+
+        double interpreted = nanosecondsPerCall([&](int n) {
+            return interpret(ops, n, 1920, 1080, -1, -1,
+                             [](const ExprOp &op, int y, int x) -> float { return 0.0f; },
+                             [&](int clip, const std::string &name) -> float { return values[index.at({ clip, name })]; });
+        });
+        double compiled = nanosecondsPerCall([&](int n) { return bytecode.run(n, 1920, 1080, -1, -1, values); });
+
+        double jit = 0;
+        try {
+            Compiled c = Compiler<8>(expr, &pixel, inputs, &clip.api, 2).compile();
+            auto proc = reinterpret_cast<ExprData::ProcessProc>(const_cast<void *>(c.routine->getEntry()));
+            union { int i; float f; } consts[8] = {};
+            for (size_t i = 0; i < c.propAccess.size(); i++)
+                consts[i + 1].f = values[slot(c.propAccess[i].clip, c.propAccess[i].name)];
+            alignas(64) float result[16];
+            void *ptrs[] = { result, nullptr, nullptr };
+            int strides[] = { 0, 0, 0 };
+            jit = nanosecondsPerCall([&](int n) {
+                consts[0].i = n;
+                proc(ptrs, strides, &consts[0].f, 1, 1, 0, 1);
+                return result[0];
+            });
+        } catch (std::runtime_error &) {
+            // argmin and the like are not supported by Expr.
+        }
+        if (jit > 0)
+            printf("%-80s %12.1f %12.1f %12.1f\n", expr, interpreted, compiled, jit);
+        else
+            printf("%-80s %12.1f %12.1f %12s\n", expr, interpreted, compiled, "-");
+    }
+}
+
+// Creation latency and memory footprint of JIT routines, both compiled from
+// expressions and loaded from already compiled objects as the disk cache does.
+void benchRoutines() {
+    using clock = std::chrono::steady_clock;
+    constexpr int compiled = 64, loaded = 512;
+
+    BenchClip clip;
+
+    std::vector<Compiled> kernels;
+    size_t rss = residentBytes();
+    auto start = clock::now();
+    for (int i = 0; i < compiled; i++)
+        kernels.push_back(Compiler<8>("x " + std::to_string(i) + " + 0.5 *", &clip.vi, clip.vis, &clip.api, 1).compile());
+    double elapsed = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+    printf("%-40s %10.3f ms %10.1f KiB\n", "compile routine", elapsed / compiled,
+           (residentBytes() - rss) / 1024.0 / compiled);
+
+    std::string object;
+    {
+        rr::Module mod;
+        rr::ModuleFunction<rr::Float(rr::Float, rr::Float)> f(mod, "entry");
+        {
+            rr::Float x = f.Arg<0>(), y = f.Arg<1>();
+            rr::Return(x * y + 0.5f);
+        }
+        mod.acquire("entry", rr::Config::Edit::None, &object);
+    }
+
+    std::vector<std::shared_ptr<rr::Routine>> routines;
+    rss = residentBytes();
+    start = clock::now();
+    for (int i = 0; i < loaded; i++)
+        routines.push_back(rr::Nucleus::loadRoutine("bench", "entry", object));
+    elapsed = std::chrono::duration<double, std::micro>(clock::now() - start).count();
+    printf("%-40s %10.1f us %10.1f KiB\n", "load routine from object", elapsed / loaded,
+           (residentBytes() - rss) / 1024.0 / loaded);
+    for (const auto &routine: routines)
+        if (!routine || !routine->getEntry())
+            fprintf(stderr, "failed to load routine\n");
+    routines.clear();
+#ifdef __GLIBC__
+    malloc_trim(0);
+#endif
+    printf("%-40s %13s %10.1f KiB\n", "after releasing loaded routines", "",
+           (static_cast<double>(residentBytes()) - rss) / 1024.0);
+}
+
+// Compile latency and throughput of kernels that call math helpers, with the
+// helpers called in the shared runtime or inlined (AKARIN_EXPR_INLINE_MATH).
+void benchHelpers() {
+    using clock = std::chrono::steady_clock;
+    const char *exprs[] = {
+        "x 2 *",
+        "x sin",
+        "x 0.01 * exp x 1 + log +",
+        "x sin x cos * x 0.5 pow +",
+    };
+    BenchClip clip;
+
+    printf("%-40s %12s %12s %12s\n", "math helpers", "mode", "compile ms", "ns/pixel");
+    for (const char *expr: exprs) {
+        for (const char *inlined: { "0", "1" }) {
+            setenv("AKARIN_EXPR_INLINE_MATH", inlined, 1);
+            constexpr int variants = 8;
+            std::vector<Compiled> kernels;
+            auto start = clock::now();
+            for (int i = 0; i < variants; i++)
+                kernels.push_back(Compiler<8>(uncached(expr), &clip.vi, clip.vis, &clip.api, 1).compile());
+            double compile = std::chrono::duration<double, std::milli>(clock::now() - start).count() / variants;
+            printf("%-40s %12s %12.3f %12.3f\n", expr, *inlined == '1' ? "inline" : "shared", compile,
+                   clip.nanosecondsPerPixel(kernels[0]));
+        }
+    }
+    unsetenv("AKARIN_EXPR_INLINE_MATH");
+}
+
+// Expressions typical of real scripts: a level adjustment, a gamma curve,
+// blurs, a median, an edge mask and a polynomial.
+const char *const corpus[] = {
+    "x 0.5 * 0.25 +",
+    "x 16 - 219 / 0 max 1 min 2.4 pow",
+    "x[-1,0] x[1,0] + x[0,-1] + x[0,1] + 4 /",
+    "x x[-1,-1] x[0,-1] x[1,-1] x[-1,0] x[1,0] x[-1,1] x[0,1] x[1,1] sort9 drop4 swap4 drop4",
+    "x[-1,-1] x[1,-1] - x[-1,1] + x[1,1] - abs x[-1,-1] x[-1,1] - x[1,-1] + x[1,1] - abs max x 0.8 * +",
+    "x 0.01 * a! a@ 3 pow 0.2 * a@ a@ * 0.5 * - a@ 2 * + 1 + a@ 0.5 - abs sqrt *",
+};
+
+// Compile latency and throughput of the two tiers of tiered compilation
+// (AKARIN_EXPR_TIERED).
+void benchTiers() {
+    using clock = std::chrono::steady_clock;
+    BenchClip clip;
+
+    printf("%-60s %10s %12s %12s\n", "tiered compilation", "tier", "compile ms", "ns/pixel");
+    for (const char *expr: corpus) {
+        for (bool baseline: { false, true }) {
+            constexpr int variants = 8;
+            std::vector<Compiled> kernels;
+            auto start = clock::now();
+            for (int i = 0; i < variants; i++)
+                kernels.push_back(Compiler<8>({ uncached(expr) }, &clip.vi, clip.vis, &clip.api, 1,
+                                              0, 0, 0, 1, {}, -1, baseline).compile());
+            double compile = std::chrono::duration<double, std::milli>(clock::now() - start).count() / variants;
+            printf("%-60.60s %10s %12.3f %12.3f\n", expr, baseline ? "baseline" : "optimized", compile,
+                   clip.nanosecondsPerPixel(kernels[0]));
+        }
+    }
+}
+
+// Compile latency and throughput with the passes set up by initExpr() and
+// with LLVM's standard O3 pipeline (AKARIN_EXPR_STANDARD_PIPELINE).
+void benchPipelines() {
+    using clock = std::chrono::steady_clock;
+    BenchClip clip;
+
+    printf("%-60s %10s %12s %12s\n", "optimization pipeline", "pipeline", "compile ms", "ns/pixel");
+    for (const char *expr: corpus) {
+        for (const char *standard: { "0", "1" }) {
+            setenv("AKARIN_EXPR_STANDARD_PIPELINE", standard, 1);
+            constexpr int variants = 8;
+            std::vector<Compiled> kernels;
+            auto start = clock::now();
+            for (int i = 0; i < variants; i++)
+                kernels.push_back(Compiler<8>(uncached(expr), &clip.vi, clip.vis, &clip.api, 1).compile());
+            double compile = std::chrono::duration<double, std::milli>(clock::now() - start).count() / variants;
+            printf("%-60.60s %10s %12.3f %12.3f\n", expr, *standard == '1' ? "standard" : "passes", compile,
+                   clip.nanosecondsPerPixel(kernels[0]));
+        }
+    }
+    unsetenv("AKARIN_EXPR_STANDARD_PIPELINE");
+}
+
+// Compile latency and throughput of machine generated kernels above the
+// default AKARIN_EXPR_IR_BUDGET, compiled within the budget and unlimited.
+void benchLargeKernels() {
+    using clock = std::chrono::steady_clock;
+    // Box blurs of (2 * radius + 1)^2 pixels, over the budget and over four
+    // times the budget.
+    auto box = [](int radius) {
+        std::string s;
+        for (int y = -radius; y <= radius; y++)
+            for (int x = -radius; x <= radius; x++)
+                s += "x[" + std::to_string(x) + "," + std::to_string(y) + "] ";
+        int n = (2 * radius + 1) * (2 * radius + 1);
+        for (int i = 1; i < n; i++)
+            s += "+ ";
+        return s + std::to_string(n) + " /";
+    };
+    const std::string exprs[] = { box(7), box(15) };
+    BenchClip clip;
+
+    printf("%-60s %10s %12s %12s\n", "large kernels", "budget", "compile ms", "ns/pixel");
+    for (const auto &expr: exprs) {
+        for (const char *budget: { "16384", "0" }) {
+            setenv("AKARIN_EXPR_IR_BUDGET", budget, 1);
+            auto start = clock::now();
+            Compiled kernel = Compiler<8>(uncached(expr.c_str()), &clip.vi, clip.vis, &clip.api, 1).compile();
+            double compile = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+            printf("%-60.60s %10s %12.3f %12.3f\n", expr.c_str(), budget, compile, clip.nanosecondsPerPixel(kernel));
+        }
+    }
+    unsetenv("AKARIN_EXPR_IR_BUDGET");
+}
+
+} // namespace
+
+int main() {
+    initExpr();
+    benchInterpreter();
+    benchRoutines();
+    benchHelpers();
+    benchTiers();
+    benchPipelines();
+    benchLargeKernels();
+    return 0;
+}
@@ -20,40 +20,56 @@
 #define USE_EXPR_CACHE
 
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <cmath>
 #include <cctype>
+#include <chrono>
 #include <clocale>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <condition_variable>
+#include <fstream>
 #include <functional>
+#include <future>
 #include <limits>
+#include <list>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <numbers>
 #include <numeric>
+#include <random>
 #include <regex>
 #include <set>
 #include <string>
 #include <sstream>
+#include <thread>
 #include <tuple>
 #include <unordered_map>
+#include <unordered_set>
 #include <variant>
 #include <vector>
 #include "VapourSynth4.h"
 #include "VSHelper4.h"
 #include "../plugin.h"
+#include "version.h"
 
 #include "Module.hpp"
 #include "Debug.hpp"
 
 namespace {
 
-#define LANES 8
-#define UNROLL 1
+#define LANES 8 /* default when the host has no AVX-512 */
 
 #define ALIGNMENT 32 /* VapourSynth should guarantee at least this for all data */
 
 enum class ExprOpType {
     // Terminals.
-    MEM_LOAD, MEM_LOAD_VAR,
+    MEM_LOAD, MEM_LOAD_VAR, CONVOLUTION,
     CONSTANTI, CONSTANTF, CONST_LOAD,
     VAR_LOAD, VAR_STORE,
 
@@ -85,6 +101,9 @@ enum class ExprOpType {
 
     // Extended operator for Select only.
     ARGMIN, ARGMAX, ARGSORT,
+
+    // Internal operators only produced by the optimizer.
+    NEG, FMA, MUX,
 };
 
 static const std::string clipNamePrefix { "src" };
@@ -98,6 +117,7 @@ std::vector<std::string> features = {
     "trunc", "round", "floor",
     "var@", "var!",
     "x[x,y]", "x[x,y]:m",
+    "x[conv]",
     "drop",
     "sort",
     "x[]",
@@ -132,6 +152,13 @@ enum class ComparisonType {
     NLE = 6,
 };
 
+enum class FMAType {
+    FMADD = 0,  // (b * c) + a
+    FMSUB = 1,  // (b * c) - a
+    FNMADD = 2, // -(b * c) + a
+    FNMSUB = 3, // -(b * c) - a
+};
+
 enum class LoadConstType {
     N = 0,
     X = 1,
@@ -181,6 +208,63 @@ bool operator==(const ExprOp &lhs, const ExprOp &rhs) {
 }
 bool operator!=(const ExprOp &lhs, const ExprOp &rhs) { return !(lhs == rhs); }
 
+// Number of values popped from the stack by each Expr operator.
+constexpr unsigned char numOperands[] = {
+    0, // MEM_LOAD
+    2, // MEM_LOAD_VAR
+    0, // CONVOLUTION
+    0, // CONSTANTI
+    0, // CONSTANTF
+    0, // CONST_LOAD
+    0, // VAR_LOAD
+    1, // VAR_STORE
+    2, // ADD
+    2, // SUB
+    2, // MUL
+    2, // DIV
+    2, // MOD
+    1, // SQRT
+    1, // ABS
+    2, // MAX
+    2, // MIN
+    3, // CLAMP
+    2, // CMP
+    1, // TRUNC
+    1, // ROUND
+    1, // FLOOR
+    2, // AND
+    2, // OR
+    2, // XOR
+    1, // NOT
+    2, // BITAND
+    2, // BITOR
+    2, // BITXOR
+    1, // BITNOT
+    1, // EXP
+    1, // LOG
+    2, // POW
+    1, // SIN
+    1, // COS
+    3, // TERNARY
+    0, // SORT
+    0, // DUP
+    0, // SWAP
+    0, // DROP
+    0, // ARGMIN
+    0, // ARGMAX
+    0, // ARGSORT
+    1, // NEG
+    3, // FMA
+    2, // MUX
+};
+static_assert(sizeof(numOperands) == static_cast<unsigned>(ExprOpType::MUX) + 1, "invalid table");
+
+// Whether a float constant is an integer that converts to int without
+// overflow, and is therefore generated as an integer vector.
+static bool isIntConstant(float f) {
+    return f >= -2147483648.0f && f < 2147483648.0f && f == std::trunc(f);
+}
+
 enum PlaneOp {
     poProcess, poCopy, poUndefined
 };
@@ -196,14 +280,192 @@ struct Compiled {
 
 struct ExprData {
     std::vector<VSNode *> node;
+    // How the processed planes read each clip.
+    std::vector<ClipAccess> access;
     VSVideoInfo vi;
     int plane[3];
     int numInputs;
-    Compiled compiled[3];
-    typedef void (*ProcessProc)(void *rwptrs, int *strides, float *props, int width, int height);
-    ProcessProc proc[3];
+    // Number of horizontal stripes each plane is split into.
+    int threads;
+    // Planes processed by each routine; planes of equal dimensions share one.
+    std::vector<std::vector<int>> kernels;
+    // Possibly still being compiled in the background, one per kernel.
+    std::vector<std::shared_future<Compiled>> compiled;
+    // From ThreadPool::attach().
+    std::shared_ptr<const void> owner;
+
+    // Baseline kernel standing in for an optimized one that is still being
+    // compiled, see exprCreate().
+    struct Tiered {
+        std::shared_future<Compiled> baseline;
+        // Set once the optimized kernel is ready, after which frames no
+        // longer look at the futures.
+        std::atomic<const Compiled *> current { nullptr };
+
+        explicit Tiered(std::shared_future<Compiled> baseline) : baseline(std::move(baseline)) {}
+
+        // Throws if neither kernel could be compiled.
+        const Compiled *get(const std::shared_future<Compiled> &optimized) {
+            if (const Compiled *c = current.load(std::memory_order_acquire))
+                return c;
+            if (optimized.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+                return &baseline.get();
+            const Compiled *c;
+            try {
+                c = &optimized.get();
+            } catch (std::exception &) {
+                c = &baseline.get();
+            }
+            // Concurrent frames store the same pointer. The baseline kernel
+            // may still be running and is only released with the filter.
+            current.store(c, std::memory_order_release);
+            return c;
+        }
+    };
+    // One per kernel, nullptr where the kernel is not tiered.
+    std::vector<std::unique_ptr<Tiered>> tiered;
+    // Processes rows [yStart, yEnd) of width x height planes. rwptrs and
+    // strides hold the destination and the inputs of each plane in turn.
+    typedef void (*ProcessProc)(void *rwptrs, int *strides, float *props, int width, int height, int yStart, int yEnd);
+
+    // Kernels of one generic kernel specialized for the values of the frame
+    // properties it branches on or multiplies by.
+    struct Specialized {
+        std::vector<Compiled::PropAccess> props;
+        // Compiles the kernel with the properties replaced by the given values.
+        std::function<std::shared_future<Compiled>(const std::vector<float> &)> compile;
+        std::mutex lock;
+        // Keyed by the bit patterns of the values.
+        std::map<std::vector<uint32_t>, std::shared_future<Compiled>> kernels;
+
+        // Returns nullptr while the kernel for the values is still being
+        // compiled, if it could not be compiled, or once limit kernels exist
+        // for other values.
+        const Compiled *get(const std::vector<float> &values, int limit) {
+            std::vector<uint32_t> key(values.size());
+            std::memcpy(key.data(), values.data(), values.size() * sizeof(float));
+            std::shared_future<Compiled> kernel;
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                auto it = kernels.find(key);
+                if (it == kernels.end()) {
+                    if (static_cast<int>(kernels.size()) >= limit)
+                        return nullptr;
+                    // Invalid until compile() returns, so that other frames
+                    // use the generic kernel meanwhile.
+                    kernels.emplace(key, kernel);
+                } else if (!it->second.valid()) {
+                    return nullptr;
+                } else {
+                    kernel = it->second;
+                }
+            }
+            if (!kernel.valid()) {
+                // compile() validates the expression and, without compiler
+                // threads, also generates the code, so the lock is not held.
+                try {
+                    kernel = compile(values);
+                } catch (std::exception &) {
+                    std::promise<Compiled> failed;
+                    failed.set_exception(std::current_exception());
+                    kernel = failed.get_future().share();
+                }
+                std::lock_guard<std::mutex> guard(lock);
+                kernels[key] = kernel;
+            }
+            if (kernel.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+                return nullptr;
+            try {
+                return &kernel.get();
+            } catch (std::exception &) {
+                return nullptr;
+            }
+        }
+    };
+    // Maximum number of specialized kernels per kernel, 0 if disabled.
+    int specialize;
+    std::vector<std::unique_ptr<Specialized>> specialized;
+
+    // Table standing in for a kernel whose planes only depend on the pixel
+    // values of one integer clip of up to 16 bits, or of two 8-bit clips.
+    // Tables are indexed by the value of the first clip, plus 256 times the
+    // value of the second one, and hold the results of all planes of the
+    // kernel in turn.
+    struct Lookup {
+        // Number of tables kept, and of evictions after which tables are
+        // given up if they happen on most frames.
+        static constexpr size_t capacity = 16;
+        std::vector<int> clips;
+        int inputSize;
+        size_t entries;
+        std::mutex lock;
+        struct Entry {
+            std::shared_ptr<uint8_t> table;
+            uint64_t lastUse;
+        };
+        // Keyed by the bit patterns of the frame property values.
+        std::map<std::vector<uint32_t>, Entry> tables;
+        uint64_t uses = 0, evictions = 0;
+        bool disabled = false;
+
+        // Returns nullptr once the property values change too often for
+        // tables to pay off, and the generic kernel is used instead. The
+        // table is built without the lock, so concurrent frames with new
+        // values might build the same table, but do not wait for others.
+        std::shared_ptr<uint8_t> get(const std::vector<float> &values, const std::function<std::shared_ptr<uint8_t>()> &build) {
+            std::vector<uint32_t> key(values.size());
+            std::memcpy(key.data(), values.data(), values.size() * sizeof(float));
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                if (disabled)
+                    return nullptr;
+                auto it = tables.find(key);
+                if (it != tables.end()) {
+                    it->second.lastUse = ++uses;
+                    return it->second.table;
+                }
+            }
+            auto table = build();
+            std::lock_guard<std::mutex> guard(lock);
+            ++uses;
+            auto it = tables.find(key);
+            if (it == tables.end()) {
+                if (tables.size() >= capacity) {
+                    if (++evictions >= capacity && evictions * 2 > uses) {
+                        disabled = true;
+                        tables.clear();
+                        return table;
+                    }
+                    tables.erase(std::min_element(tables.begin(), tables.end(),
+                        [](const auto &a, const auto &b) { return a.second.lastUse < b.second.lastUse; }));
+                }
+                it = tables.emplace(key, Entry{ table, 0 }).first;
+            }
+            it->second.lastUse = uses;
+            return it->second.table;
+        }
+    };
+    // One per kernel, nullptr where no table is used.
+    std::vector<std::unique_ptr<Lookup>> lookups;
+
+    ExprData() : node(), access(), vi(), plane(), numInputs(), threads(1), specialize() {}
+};
 
-    ExprData() : node(), vi(), plane(), numInputs(), proc() {}
+struct ExprStatsData {
+    std::vector<VSNode *> node;
+    std::vector<ClipAccess> access;
+    // Format the results are converted to before they are reduced.
+    VSVideoInfo vo;
+    int numInputs;
+    int plane;
+    int lanes;
+    int bins;
+    std::string prop;
+    std::shared_future<Compiled> compiled;
+    // From ThreadPool::attach().
+    std::shared_ptr<const void> owner;
+
+    ExprStatsData() : node(), access(), vo(), numInputs(), plane(), lanes(), bins() {}
 };
 
 std::vector<std::string> tokenize(const std::string &expr)
@@ -228,6 +490,90 @@ std::vector<std::string> tokenize(const std::string &expr)
     return tokens;
 }
 
+// Weights of x[conv:...], either a full kernel in row-major order starting at
+// the top left, or the horizontal and vertical taps of a separable one
+// ("h0,h1,.../v0,v1,...").
+struct ConvolutionKernel {
+    static constexpr int maxRadius = 8;
+
+    int width, height;
+    std::vector<float> h, v, full;
+
+    explicit ConvolutionKernel(const std::string &spec) : width(), height() {
+        auto parseList = [](const std::string &list) {
+            std::vector<float> taps;
+            size_t start = 0;
+            while (true) {
+                size_t end = list.find(',', start);
+                std::string item = list.substr(start, end == std::string::npos ? std::string::npos : end - start);
+                size_t pos = 0;
+                float w = NAN;
+                try {
+                    w = std::stof(item, &pos);
+                } catch (...) {
+                    pos = 0;
+                }
+                if (item.empty() || pos != item.size() || !std::isfinite(w))
+                    throw std::runtime_error("invalid convolution weight: '" + item + "'");
+                taps.push_back(w);
+                if (end == std::string::npos)
+                    return taps;
+                start = end + 1;
+            }
+        };
+        auto checkSize = [](size_t n) {
+            if (n % 2 == 0 || n > 2 * maxRadius + 1)
+                throw std::runtime_error("convolution must have an odd number of taps up to " + std::to_string(2 * maxRadius + 1));
+            return static_cast<int>(n);
+        };
+
+        size_t slash = spec.find('/');
+        if (slash != std::string::npos) {
+            h = parseList(spec.substr(0, slash));
+            v = parseList(spec.substr(slash + 1));
+            width = checkSize(h.size());
+            height = checkSize(v.size());
+        } else {
+            full = parseList(spec);
+            width = height = checkSize(static_cast<size_t>(std::lround(std::sqrt(full.size()))));
+            if (static_cast<size_t>(width * height) != full.size())
+                throw std::runtime_error("full convolution must have a square number of weights");
+        }
+    }
+
+    bool separable() const { return full.empty(); }
+    // Weight of the pixel at (dx, dy) relative to the centre.
+    float at(int dx, int dy) const {
+        int i = dx + width / 2, j = dy + height / 2;
+        return separable() ? h[i] * v[j] : full[j * width + i];
+    }
+    // Whether the weighted sum of integer pixels is an integer.
+    bool integral() const {
+        for (const auto *taps: { &h, &v, &full })
+            for (float w: *taps)
+                if (std::floor(w) != w || std::fabs(w) >= 65536.0f)
+                    return false;
+        return true;
+    }
+    // Spelling-independent form, stored as the name of the operator.
+    std::string str() const {
+        std::stringstream ss;
+        ss.precision(9);
+        auto list = [&ss](const std::vector<float> &taps) {
+            for (size_t i = 0; i < taps.size(); i++)
+                ss << (i ? "," : "") << taps[i];
+        };
+        if (separable()) {
+            list(h);
+            ss << '/';
+            list(v);
+        } else {
+            list(full);
+        }
+        return ss.str();
+    }
+};
+
 ExprOp decodeToken(const std::string &token, bool extended = false)
 {
     static const std::unordered_map<std::string, ExprOp> simple{
@@ -279,6 +625,7 @@ ExprOp decodeToken(const std::string &token, bool extended = false)
     static const std::regex clipNameRe { clipNameRePrefix + "$" };
     static const std::regex relpixelRe { clipNameRePrefix + "\\[(-?[0-9]+),(-?[0-9]+)\\](:[cm])?$" };
     static const std::regex abspixelRe { clipNameRePrefix + "\\[\\]$" };
+    static const std::regex convolutionRe { clipNameRePrefix + "\\[conv:([^\\[\\]]+)\\](:[cm])?$" };
     static const std::regex framePropRe { clipNameRePrefix + "\\.([^\\[\\]]*)$" };
     std::smatch match;
 
@@ -356,6 +703,18 @@ ExprOp decodeToken(const std::string &token, bool extended = false)
         BoundaryCondition bc = flag.size() == 0 ? BoundaryCondition::Unspecified :
             (flag[1] == 'm' ? BoundaryCondition::Mirrored : BoundaryCondition::Clamped);
         return{ ExprOpType::MEM_LOAD, extractClipId(clip), "", atoi(sx.c_str()), atoi(sy.c_str()), bc };
+    } else if (std::regex_match(token, match, convolutionRe)) {
+        ASSERT(match.size() == 4);
+        auto clip = match[1].str(), flag = match[3].str();
+        BoundaryCondition bc = flag.size() == 0 ? BoundaryCondition::Unspecified :
+            (flag[1] == 'm' ? BoundaryCondition::Mirrored : BoundaryCondition::Clamped);
+        std::string spec;
+        try {
+            spec = ConvolutionKernel(match[2].str()).str();
+        } catch (std::exception &e) {
+            throw std::runtime_error("illegal token: " + token + " (" + e.what() + ")");
+        }
+        return{ ExprOpType::CONVOLUTION, extractClipId(clip), spec, 0, 0, bc };
     } else if (std::regex_match(token, match, abspixelRe)) {
         ASSERT(match.size() == 2);
         auto clip = match[1].str();
@@ -416,44 +775,724 @@ public:
     typedef uint32_t SwizzleMask;
 };
 
-static std::unordered_map<std::string, Compiled> exprCache;
+template<>
+struct VectorTypes<16> {
+public:
+    typedef rr::Byte16 Byte;
+    typedef rr::UShort16 UShort;
+    typedef rr::Int16 Int;
+    typedef rr::Float16 Float;
+    typedef uint64_t SwizzleMask;
+};
+
+static size_t envSize(const char *name, size_t def) {
+    const char *s = std::getenv(name);
+    if (!s || !*s) return def;
+    char *end = nullptr;
+    unsigned long long v = std::strtoull(s, &end, 0);
+    return *end ? def : static_cast<size_t>(v);
+}
+
+// Whether the JIT target has the given CPU feature, e.g. "avx512f".
+static bool targetHas(const std::string &feature) {
+    std::string target = rr::Nucleus::getTargetKey();
+    return target.find("+" + feature + ",") != std::string::npos || target.find("+" + feature + ";") != std::string::npos;
+}
+
+// Vector width used when neither the lanes argument nor AKARIN_EXPR_LANES is
+// given: 16 lanes only pay off with native 512-bit registers.
+static int defaultLanes() {
+    static const int lanes = [] {
+        int env = static_cast<int>(envSize("AKARIN_EXPR_LANES", 0));
+        if (env == 8 || env == 16)
+            return env;
+        return targetHas("avx512f") ? 16 : LANES;
+    }();
+    return lanes;
+}
+
+// Code generation settings of the baseline tier of tiered kernels, see
+// exprCreate(). Variables are still promoted to registers, which is cheap and
+// matters most, but only local redundancies are removed and the machine code
+// is generated by the fast instruction selector.
+static const rr::Config::Edit &baselineConfig() {
+    static const rr::Config::Edit edit = rr::Config::Edit()
+        .set(rr::Optimization::Level::None)
+        .clearOptimizationPasses()
+        .add(rr::Optimization::Pass::Inline)
+        .add(rr::Optimization::Pass::ScalarReplAggregates)
+        .add(rr::Optimization::Pass::EarlyCSEPass);
+    return edit;
+}
+
+// Code generation settings of kernels over the instruction budget, see
+// Compiler::build(). Only the cheaper ones of the default passes run, and the
+// machine code is generated with less effort.
+static const rr::Config::Edit &reducedConfig() {
+    static const rr::Config::Edit edit = rr::Config::Edit()
+        .set(rr::Optimization::Level::Less)
+        .clearOptimizationPasses()
+        .add(rr::Optimization::Pass::Inline)
+        .add(rr::Optimization::Pass::ScalarReplAggregates)
+        .add(rr::Optimization::Pass::EarlyCSEPass)
+        .add(rr::Optimization::Pass::InstructionCombining);
+    return edit;
+}
+
+// In-memory cache of compiled routines shared by all Expr instances, keyed on
+// the canonicalized expression. It is bounded by AKARIN_EXPR_CACHE_ENTRIES
+// entries and AKARIN_EXPR_CACHE_BYTES bytes of machine code (0 means no
+// limit); once over budget, the least recently used routines that are no
+// longer held by any filter instance are released.
+class ExprCache {
+    struct Entry {
+        std::string key;
+        Compiled compiled;
+        size_t size;
+    };
+    std::mutex lock;
+    std::list<Entry> lru; // most recently used first
+    std::unordered_map<std::string, std::list<Entry>::iterator> index;
+    // A compilation in flight and the filter instances waiting for it, see
+    // cancel().
+    struct Inflight {
+        std::shared_future<Compiled> future;
+        std::vector<std::weak_ptr<const void>> owners;
+        // Whether something not tied to a filter instance waits for it.
+        bool pinned = false;
+
+        void wait(const std::shared_ptr<const void> &owner) {
+            if (owner)
+                owners.push_back(owner);
+            else
+                pinned = true;
+        }
+    };
+    std::unordered_map<std::string, Inflight> inflight;
+    size_t bytes = 0;
+    const size_t maxEntries, maxBytes;
+
+    void evict() {
+        auto it = lru.end();
+        while (it != lru.begin() && ((maxEntries && lru.size() > maxEntries) || (maxBytes && bytes > maxBytes))) {
+            --it;
+            // Only the cache itself holds the routine.
+            if (it->compiled.routine.use_count() > 1) continue;
+            bytes -= it->size;
+            index.erase(it->key);
+            it = lru.erase(it);
+        }
+    }
+
+public:
+    ExprCache() :
+        maxEntries(envSize("AKARIN_EXPR_CACHE_ENTRIES", 1024)),
+        maxBytes(envSize("AKARIN_EXPR_CACHE_BYTES", 256 << 20)) {}
+
+    bool lookup(const std::string &key, Compiled &out) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = index.find(key);
+        if (it == index.end()) return false;
+        lru.splice(lru.begin(), lru, it->second);
+        out = it->second->compiled;
+        return true;
+    }
+
+    // Returns the cached or in-flight routine for key, or registers the
+    // compilation started by start() so that concurrent requests share it.
+    // owner is the filter instance the routine is for, if any.
+    template<typename F>
+    std::shared_future<Compiled> lookupOrStart(const std::string &key, const std::shared_ptr<const void> &owner, F &&start) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (auto it = index.find(key); it != index.end()) {
+            lru.splice(lru.begin(), lru, it->second);
+            std::promise<Compiled> p;
+            p.set_value(it->second->compiled);
+            return p.get_future().share();
+        }
+        if (auto it = inflight.find(key); it != inflight.end()) {
+            it->second.wait(owner);
+            return it->second.future;
+        }
+        Inflight &entry = inflight.emplace(key, Inflight{ start() }).first->second;
+        entry.wait(owner);
+        return entry.future;
+    }
+
+    // Forgets an in-flight compilation and returns true if all the filter
+    // instances that requested it have been freed, so that it can be skipped.
+    bool cancel(const std::string &key) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = inflight.find(key);
+        if (it == inflight.end() || it->second.pinned)
+            return false;
+        for (const auto &owner: it->second.owners)
+            if (!owner.expired())
+                return false;
+        inflight.erase(it);
+        return true;
+    }
+
+    // Forgets a failed in-flight compilation.
+    void abandon(const std::string &key) {
+        std::lock_guard<std::mutex> guard(lock);
+        inflight.erase(key);
+    }
+
+    // Returns the cached entry, which might not be r if another thread has
+    // compiled the same expression concurrently.
+    Compiled insert(const std::string &key, const Compiled &r, size_t size) {
+        std::lock_guard<std::mutex> guard(lock);
+        inflight.erase(key);
+        auto it = index.find(key);
+        if (it != index.end()) {
+            lru.splice(lru.begin(), lru, it->second);
+            return it->second->compiled;
+        }
+        lru.push_front(Entry{ key, r, size });
+        index.emplace(key, lru.begin());
+        bytes += size;
+        evict();
+        return r;
+    }
+
+    // Called when filter instances are freed and their routines might have
+    // become evictable.
+    void trim() {
+        std::lock_guard<std::mutex> guard(lock);
+        evict();
+    }
+};
+
+static ExprCache exprCache;
+
+// Background workers owned by the plugin. One pool compiles Expr routines,
+// so that filter creation does not wait for LLVM; its size defaults to the
+// number of cores and can be set with AKARIN_EXPR_COMPILE_THREADS (0 compiles
+// synchronously on the calling thread). Another pool runs the stripes of
+// planes split by the Expr threads argument, sized by AKARIN_EXPR_THREADS.
+//
+// Workers are started by the first submit() and joined once the last filter
+// instance holding a handle from attach() is freed, after they have run the
+// queued tasks, so that no compilation is still inside LLVM or inserting into
+// the caches when the process exits.
+class ThreadPool {
+    struct Task {
+        std::function<void()> run;
+        // Returns true if the task is no longer needed, see purge().
+        std::function<bool()> cancel;
+    };
+    std::mutex lock;
+    std::condition_variable cond;
+    std::deque<Task> queue;
+    // Only run once queue is empty.
+    std::deque<Task> deferred;
+    std::vector<std::thread> workers;
+    // Incremented by join(), which makes the current workers exit once the
+    // queues are empty, while those started later keep running.
+    uint64_t generation = 0;
+    size_t numThreads;
+
+    explicit ThreadPool(size_t n) : numThreads(n) {}
+
+    void run(uint64_t gen) {
+        for (;;) {
+            Task task;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                cond.wait(guard, [this, gen] { return !queue.empty() || !deferred.empty() || generation != gen; });
+                if (queue.empty() && deferred.empty())
+                    return;
+                auto &from = queue.empty() ? deferred : queue;
+                task = std::move(from.front());
+                from.pop_front();
+            }
+            task.run();
+        }
+    }
+
+    // Drops the queued tasks that are no longer needed, e.g. the deferred
+    // compilations of a filter that was freed, which would otherwise wait
+    // behind all other work while holding their context.
+    void purge() {
+        std::deque<Task> tasks[2];
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            tasks[0].swap(queue);
+            tasks[1].swap(deferred);
+        }
+        // Without the lock, as cancel() might take locks held by submitters.
+        for (auto &q: tasks)
+            q.erase(std::remove_if(q.begin(), q.end(), [](const Task &t) { return t.cancel && t.cancel(); }), q.end());
+        std::lock_guard<std::mutex> guard(lock);
+        // Tasks submitted meanwhile go last.
+        queue.insert(queue.begin(), std::make_move_iterator(tasks[0].begin()), std::make_move_iterator(tasks[0].end()));
+        deferred.insert(deferred.begin(), std::make_move_iterator(tasks[1].begin()), std::make_move_iterator(tasks[1].end()));
+    }
+
+    // Waits for the current workers to finish the queued tasks and exit.
+    // Tasks submitted meanwhile start new workers instead of waiting.
+    void join() {
+        std::vector<std::thread> joined;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            generation++;
+            joined.swap(workers);
+        }
+        cond.notify_all();
+        for (auto &t: joined)
+            t.join();
+    }
+
+    struct User {
+        // Never destroyed, as filters might be freed during static destruction.
+        static std::mutex &lock() { static std::mutex *m = new std::mutex; return *m; }
+        static size_t count;
+
+        User() {
+            std::lock_guard<std::mutex> guard(lock());
+            count++;
+        }
+        // The compiler threads of the last filter are joined, so that none
+        // is left running plugin code. This is done without the lock, which
+        // would otherwise hold up filters created meanwhile until the
+        // compilation in progress is done. Stripe tasks never outlive the
+        // frame that submitted them, so those threads are left idle.
+        ~User() {
+            bool last;
+            {
+                std::lock_guard<std::mutex> guard(lock());
+                last = --count == 0;
+            }
+            if (ThreadPool *pool = compiler()) {
+                pool->purge();
+                if (last)
+                    pool->join();
+            }
+        }
+    };
+
+public:
+    // Returns nullptr if background compilation is disabled.
+    static ThreadPool *compiler() {
+        static ThreadPool *pool = [] () -> ThreadPool * {
+            size_t n = envSize("AKARIN_EXPR_COMPILE_THREADS", std::max(1u, std::thread::hardware_concurrency()));
+            return n ? new ThreadPool(n) : nullptr;
+        }();
+        return pool;
+    }
+
+    static ThreadPool *stripes() {
+        static ThreadPool *pool = new ThreadPool(std::max<size_t>(1,
+            envSize("AKARIN_EXPR_THREADS", std::max(1u, std::thread::hardware_concurrency()))));
+        return pool;
+    }
+
+    // Held by each filter instance for as long as it may submit tasks, and
+    // passed to the compilations it requests so that they are skipped once
+    // it is freed, see ExprCache::cancel().
+    static std::shared_ptr<const void> attach() { return std::make_shared<User>(); }
+
+    size_t size() const { return numThreads; }
+
+    // Deferred tasks wait for all others, including those submitted later.
+    // cancel, if any, is called when a filter instance is freed and returns
+    // true if the task can be dropped.
+    void submit(std::function<void()> task, bool defer = false, std::function<bool()> cancel = nullptr) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            (defer ? deferred : queue).push_back(Task{ std::move(task), std::move(cancel) });
+            if (workers.empty())
+                for (size_t i = 0; i < numThreads; i++)
+                    workers.emplace_back([this, gen = generation] { run(gen); });
+        }
+        cond.notify_one();
+    }
+};
+
+size_t ThreadPool::User::count = 0;
+
+// Persistent cache of compiled routines shared by all processes on a host.
+// Enabled by pointing the AKARIN_EXPR_CACHE_DIR environment variable to a
+// writable directory. Each entry is a relocatable object file prefixed with
+// the full key it was compiled for, so that hash collisions are detected.
+class DiskCache {
+    std::filesystem::path dir;
+    std::atomic<int64_t> hits { 0 }, misses { 0 };
+
+    static constexpr char magic[] = "akarin-expr-object\n";
+
+    DiskCache() {
+        const char *s = std::getenv("AKARIN_EXPR_CACHE_DIR");
+        if (!s || !*s) return;
+        std::error_code ec;
+        std::filesystem::create_directories(s, ec);
+        if (!ec || std::filesystem::is_directory(s, ec))
+            dir = s;
+    }
+
+    std::filesystem::path path(const std::string &key) const {
+        // 64-bit FNV-1a, stable across builds and platforms.
+        uint64_t h = 0xcbf29ce484222325ull;
+        for (unsigned char c: key)
+            h = (h ^ c) * 0x100000001b3ull;
+        char name[32];
+        snprintf(name, sizeof name, "%016llx.o", (unsigned long long)h);
+        return dir / name;
+    }
+
+public:
+    static DiskCache &get() {
+        static DiskCache cache;
+        return cache;
+    }
+
+    bool enabled() const { return !dir.empty(); }
+    int64_t numHits() const { return hits; }
+    int64_t numMisses() const { return misses; }
+
+    // Bumped whenever the signature of procPlane or the numbering of the
+    // operators in the canonical expression changes.
+    static constexpr int abi = 3;
+
+    static std::string fullKey(const std::string &key) {
+        return key + "|abi=" + std::to_string(abi) + "|target=" + rr::Nucleus::getTargetKey() + "|version=" VERSION;
+    }
+
+    std::shared_ptr<rr::Routine> load(const std::string &key, const char *entry, size_t &size) {
+        std::ifstream f(path(key), std::ios::binary);
+        std::string header(sizeof magic - 1, '\0'), stored, object;
+        if (f && f.read(header.data(), header.size()) && header == magic && std::getline(f, stored, '\0') && stored == key) {
+            object.assign(std::istreambuf_iterator<char>(f), std::istreambuf_iterator<char>());
+            if (auto routine = rr::Nucleus::loadRoutine("proc", entry, object)) {
+                hits++;
+                size = object.size();
+                return routine;
+            }
+        }
+        misses++;
+        return nullptr;
+    }
+
+    void store(const std::string &key, const std::string &object) {
+        if (object.empty()) return;
+        // Write to a unique temporary file and rename it into place, so that
+        // concurrent processes never observe a partially written entry.
+        auto dst = path(key);
+        auto tmp = dst;
+        tmp += "." + std::to_string(std::random_device{}()) + ".tmp";
+        {
+            std::ofstream f(tmp, std::ios::binary | std::ios::trunc);
+            f.write(magic, sizeof magic - 1);
+            f.write(key.c_str(), key.size() + 1);
+            f.write(object.data(), object.size());
+            if (!f) {
+                f.close();
+                std::error_code ec;
+                std::filesystem::remove(tmp, ec);
+                return;
+            }
+        }
+        std::error_code ec;
+        std::filesystem::rename(tmp, dst, ec);
+        if (ec)
+            std::filesystem::remove(tmp, ec);
+    }
+};
+
+// Value range analysis over a program. Integer clips are evaluated in float
+// unless opt=1, which only makes a difference when an integer result does
+// not fit in the 24-bit mantissa of a float. If the ranges derived from the
+// input formats and the constants prove that this never happens, the kernel
+// can use integer lanes and skip the conversions without changing the result.
+static bool integerEvaluationIsExact(const std::vector<ExprOp> &ops, const std::vector<VSVideoInfo> &vi, const VSVideoInfo &vo)
+{
+    constexpr double limit = 1 << 24;
+    constexpr double inf = std::numeric_limits<double>::infinity();
+    struct Range {
+        double lo, hi;
+        // Whether the value is an integer vector with and without opt=1.
+        bool isInt, isIntForced;
+    };
+    const Range unknown{ -inf, inf, false, false };
+    auto clipRange = [&](int i) -> Range {
+        const VSVideoFormat &format = vi[i].format;
+        if (format.sampleType != stInteger)
+            return unknown;
+        return { 0, std::exp2(format.bitsPerSample) - 1, true, false };
+    };
+    auto product = [](double a, double b) { return a == 0 || b == 0 ? 0 : a * b; };
+    auto dimension = [&](int size) { return size > 0 ? size : inf; };
+
+    std::vector<Range> stack;
+    std::map<std::string, Range> vars;
+    for (const auto &op: ops) {
+        size_t operands = numOperands[static_cast<size_t>(op.type)];
+        if (stack.size() < operands || ((op.type == ExprOpType::DUP || op.type == ExprOpType::SWAP) && op.imm.u >= stack.size()) ||
+            ((op.type == ExprOpType::DROP || op.type == ExprOpType::SORT) && op.imm.u > stack.size()))
+            return false;
+        auto arg = [&](size_t i) -> const Range & { return stack[stack.size() - operands + i]; };
+
+        Range r = unknown;
+        switch (op.type) {
+        case ExprOpType::DUP:
+            stack.push_back(stack[stack.size() - 1 - op.imm.u]);
+            continue;
+        case ExprOpType::SWAP:
+            std::swap(stack.back(), stack[stack.size() - 1 - op.imm.u]);
+            continue;
+        case ExprOpType::DROP:
+            stack.resize(stack.size() - op.imm.u);
+            continue;
+        case ExprOpType::SORT: {
+            if (op.imm.u == 0)
+                continue;
+            // Sorting keeps the type of its inputs only if they all agree.
+            Range hull = stack.back();
+            for (size_t i = stack.size() - op.imm.u; i < stack.size(); i++) {
+                const Range &x = stack[i];
+                if (x.isInt != hull.isInt || x.isIntForced != hull.isIntForced)
+                    return false;
+                hull.lo = std::min(hull.lo, x.lo);
+                hull.hi = std::max(hull.hi, x.hi);
+            }
+            std::fill(stack.end() - op.imm.u, stack.end(), hull);
+            continue;
+        }
+        case ExprOpType::VAR_STORE:
+            vars[op.name] = stack.back();
+            stack.pop_back();
+            continue;
+        case ExprOpType::VAR_LOAD: {
+            auto it = vars.find(op.name);
+            if (it == vars.end())
+                return false;
+            r = it->second;
+            break;
+        }
+
+        case ExprOpType::MEM_LOAD:
+        case ExprOpType::MEM_LOAD_VAR:
+            r = clipRange(op.imm.i);
+            break;
+        case ExprOpType::CONVOLUTION: {
+            ConvolutionKernel kernel(op.name);
+            Range x = clipRange(op.imm.i);
+            if (!x.isInt || !kernel.integral())
+                break;
+            // Every partial sum lies within the sum of the absolute weights.
+            double sum = 0;
+            bool negative = false;
+            for (int dy = -kernel.height / 2; dy <= kernel.height / 2; dy++) {
+                for (int dx = -kernel.width / 2; dx <= kernel.width / 2; dx++) {
+                    sum += std::fabs(kernel.at(dx, dy));
+                    negative = negative || kernel.at(dx, dy) < 0;
+                }
+            }
+            r = { negative ? -sum * x.hi : 0, sum * x.hi, true, false };
+            break;
+        }
+        case ExprOpType::CONSTANTI:
+            r = { (double)op.imm.i, (double)op.imm.i, true, true };
+            break;
+        case ExprOpType::CONSTANTF: {
+            bool integral = isIntConstant(op.imm.f);
+            r = { op.imm.f, op.imm.f, integral, integral };
+            break;
+        }
+        case ExprOpType::CONST_LOAD:
+            switch (static_cast<LoadConstType>(op.imm.i)) {
+            case LoadConstType::N: r = { 0, (double)std::numeric_limits<int>::max(), true, true }; break;
+            case LoadConstType::X: r = { 0, dimension(vo.width) - 1, true, true }; break;
+            case LoadConstType::Y: r = { 0, dimension(vo.height) - 1, true, true }; break;
+            case LoadConstType::Width: r = { 1, dimension(vo.width), true, true }; break;
+            case LoadConstType::Height: r = { 1, dimension(vo.height), true, true }; break;
+            default: break;
+            }
+            break;
+
+        case ExprOpType::ADD:
+            r = { arg(0).lo + arg(1).lo, arg(0).hi + arg(1).hi, arg(0).isInt && arg(1).isInt, arg(0).isIntForced && arg(1).isIntForced };
+            break;
+        case ExprOpType::SUB:
+            r = { arg(0).lo - arg(1).hi, arg(0).hi - arg(1).lo, arg(0).isInt && arg(1).isInt, arg(0).isIntForced && arg(1).isIntForced };
+            break;
+        case ExprOpType::MUL: {
+            double p[] = { product(arg(0).lo, arg(1).lo), product(arg(0).lo, arg(1).hi), product(arg(0).hi, arg(1).lo), product(arg(0).hi, arg(1).hi) };
+            r = { *std::min_element(p, p + 4), *std::max_element(p, p + 4), arg(0).isInt && arg(1).isInt, arg(0).isIntForced && arg(1).isIntForced };
+            break;
+        }
+        case ExprOpType::NEG:
+            r = { -arg(0).hi, -arg(0).lo, arg(0).isInt, arg(0).isIntForced };
+            break;
+        case ExprOpType::ABS: {
+            double a = std::fabs(arg(0).lo), b = std::fabs(arg(0).hi);
+            r = { arg(0).lo <= 0 && arg(0).hi >= 0 ? 0 : std::min(a, b), std::max(a, b), arg(0).isInt, false };
+            break;
+        }
+        case ExprOpType::MAX:
+            r = { std::max(arg(0).lo, arg(1).lo), std::max(arg(0).hi, arg(1).hi), arg(0).isInt && arg(1).isInt, false };
+            break;
+        case ExprOpType::MIN:
+            r = { std::min(arg(0).lo, arg(1).lo), std::min(arg(0).hi, arg(1).hi), arg(0).isInt && arg(1).isInt, false };
+            break;
+        case ExprOpType::CLAMP:
+            r = { std::max(std::min(arg(0).lo, arg(2).lo), arg(1).lo), std::max(std::min(arg(0).hi, arg(2).hi), arg(1).hi),
+                  arg(0).isInt && arg(1).isInt && arg(2).isInt, false };
+            break;
+        case ExprOpType::TERNARY:
+            r = { std::min(arg(1).lo, arg(2).lo), std::max(arg(1).hi, arg(2).hi),
+                  arg(1).isInt && arg(2).isInt, arg(1).isIntForced && arg(2).isIntForced };
+            break;
+        case ExprOpType::CMP:
+        case ExprOpType::AND:
+        case ExprOpType::OR:
+        case ExprOpType::XOR:
+        case ExprOpType::NOT:
+            r = { 0, 1, true, true };
+            break;
+        case ExprOpType::BITAND:
+        case ExprOpType::BITOR:
+        case ExprOpType::BITXOR:
+            r = { -inf, inf, true, true };
+            if (arg(0).lo >= 0 && arg(1).lo >= 0 && std::max(arg(0).hi, arg(1).hi) < limit) {
+                if (op.type == ExprOpType::BITAND)
+                    r.lo = 0, r.hi = std::min(arg(0).hi, arg(1).hi);
+                else
+                    r.lo = 0, r.hi = std::exp2(std::ceil(std::log2(std::max(arg(0).hi, arg(1).hi) + 1))) - 1;
+            }
+            break;
+        case ExprOpType::BITNOT:
+            r = { -arg(0).hi - 1, -arg(0).lo - 1, true, true };
+            break;
+        case ExprOpType::DIV:
+        case ExprOpType::MOD:
+        case ExprOpType::SQRT:
+        case ExprOpType::TRUNC:
+        case ExprOpType::ROUND:
+        case ExprOpType::FLOOR:
+        case ExprOpType::EXP:
+        case ExprOpType::LOG:
+        case ExprOpType::POW:
+        case ExprOpType::SIN:
+        case ExprOpType::COS:
+            break;
+        default:
+            return false;
+        }
+
+        // An integer that would have been a float without opt=1 must be exact in both.
+        if (r.isInt && !r.isIntForced && !(r.lo >= -limit && r.hi <= limit))
+            return false;
+        stack.resize(stack.size() - operands);
+        stack.push_back(r);
+    }
+    return true;
+}
 
 template<int lanes>
 class Compiler {
-    struct Context {
-        const std::string expr;
+    // The expression of one plane of a (possibly fused) kernel.
+    struct Program {
+        std::string expr;
         std::vector<std::string> tokens;
         std::vector<ExprOp> ops;
-        const VSVideoInfo *vo;
-        const VSVideoInfo * const *vi;
-        const VSAPI *vsapi;
+        // Subexpressions hoisted out of the pixel loop by optimize(), which
+        // store their results into variables once per call and once per row.
+        std::vector<ExprOp> frameOps, rowOps;
+    };
+
+    struct Context {
+        std::vector<Program> programs;
+        // Copied, as the context may outlive the filter creation call.
+        VSVideoInfo vo;
+        std::vector<VSVideoInfo> vi;
         int numInputs;
         int optMask;
         bool mirror;
+        // Whether the expression tree optimizer runs, see optimize().
+        bool optimize;
+        // Whether math helpers are inlined instead of called, see buildHelpers().
+        bool inlineMath;
+        // Whether LLVM's standard pipeline replaces the passes of initExpr().
+        bool standardPipeline;
+        // Number of instructions above which a kernel is optimized less, 0 if
+        // unlimited, see build().
+        size_t irBudget;
+        // Vectors processed per loop iteration, 0 until chosen by prepare().
+        int unroll;
+        // Rows processed per loop iteration.
+        int rows;
+        // Whether the results are reduced to statistics instead of being
+        // stored, see buildReduce(), and the number of histogram bins.
+        bool reduce;
+        int bins;
+        // Whether this is the cheap first tier of a tiered kernel, see
+        // baselineConfig().
+        bool baseline;
         bool cached;
+        Compiled cachedEntry;
+        std::string cacheKey;
+        std::vector<Compiled::PropAccess> pa;
+        int numVars;
         Context(
-            const std::string &expr, 
+            const std::vector<std::string> &exprs, 
             const VSVideoInfo *vo, 
             const VSVideoInfo *const *vi, 
             const VSAPI *vsapi,
             int numInputs, 
             int opt, 
-            int mirror
+            int mirror,
+            int unroll,
+            int rows,
+            const std::map<std::pair<int, std::string>, float> &fixedProps,
+            int bins,
+            bool baseline
         ):
-            expr(expr), vo(vo), vi(vi), vsapi(vsapi), numInputs(numInputs), optMask(opt), mirror(!!mirror), cached(false) {
-            auto iter = exprCache.find(key());
-            if (iter != exprCache.end()) {
-                cached = true;
-                return;
-            }
-
-            tokens = tokenize(expr);
-            for (const auto &tok: tokens) {
-                auto op = decodeToken(tok);
-                if (op.bc == BoundaryCondition::Unspecified)
-                    op.bc = mirror ? BoundaryCondition::Mirrored : BoundaryCondition::Clamped;
-                ops.push_back(op);
+            vo(*vo), numInputs(numInputs), optMask(opt), mirror(!!mirror),
+            optimize(envSize("AKARIN_EXPR_OPTIMIZE", 1) != 0), inlineMath(envSize("AKARIN_EXPR_INLINE_MATH", 0) != 0),
+            standardPipeline(envSize("AKARIN_EXPR_STANDARD_PIPELINE", 0) != 0),
+            irBudget(envSize("AKARIN_EXPR_IR_BUDGET", 16384)),
+            unroll(unroll), rows(rows),
+            reduce(bins >= 0), bins(std::max(bins, 0)), baseline(baseline), cached(false), numVars(0) {
+            for (int i = 0; i < numInputs; i++)
+                this->vi.push_back(*vi[i]);
+            std::stringstream ss;
+            ss << "lanes=" << lanes << "|n=" << numInputs << "|opt=" << optMask << "|mirror=" << this->mirror << "|optimize=" << optimize << "|inline=" << inlineMath << "|standard=" << standardPipeline << "|budget=" << irBudget << "|unroll=" << unroll << "|rows=" << rows << "|bins=" << bins << "|baseline=" << baseline;
+            for (const auto &expr: exprs) {
+                Program prog;
+                prog.expr = expr;
+                prog.tokens = tokenize(expr);
+                for (const auto &tok: prog.tokens) {
+                    auto op = decodeToken(tok);
+                    if (op.bc == BoundaryCondition::Unspecified)
+                        op.bc = mirror ? BoundaryCondition::Mirrored : BoundaryCondition::Clamped;
+                    constexpr int last = static_cast<int>(LoadConstType::LAST);
+                    if (op.type == ExprOpType::CONST_LOAD && op.imm.i >= last) {
+                        auto it = fixedProps.find({ op.imm.i - last, op.name });
+                        if (it != fixedProps.end())
+                            op = ExprOp(ExprOpType::CONSTANTF, it->second);
+                    }
+                    prog.ops.push_back(op);
+                }
+                ss << "|expr=" << canonicalize(prog.ops);
+                programs.push_back(std::move(prog));
             }
+            // Integer evaluation does not change the results when it is
+            // picked here, so it does not depend on AKARIN_EXPR_OPTIMIZE. The
+            // decision is part of the key instead of the dimensions it may
+            // depend on, so that kernels are shared across clip sizes.
+            if (forceFloat() && std::all_of(programs.begin(), programs.end(),
+                    [this](const Program &prog) { return integerEvaluationIsExact(prog.ops, this->vi, this->vo); }))
+                optMask |= flagUseInteger;
+            ss << "|int=" << !forceFloat();
+            ss << "|vo=" << videoInfoKey(vo, vsapi);
+            for (int i = 0; i < numInputs; i++)
+                ss << "|vi" << i << "=" << videoInfoKey(vi[i], vsapi);
+            cacheKey = ss.str();
+#ifdef USE_EXPR_CACHE
+            cached = exprCache.lookup(key(), cachedEntry);
+#endif
         }
         enum {
             flagUseInteger = 1<<0,
@@ -463,15 +1502,27 @@ class Compiler {
             vsapi->getVideoFormatName(&vi->format, name.data());
             return std::string(name.data()) + ";";
         }
-        std::string key() const {
+        // Spelling-independent form of the decoded expression: whitespace,
+        // number formatting, clip aliases and variable names do not matter.
+        static std::string canonicalize(const std::vector<ExprOp> &ops) {
+            std::map<std::string, int> vars;
             std::stringstream ss;
-            ss << "n=" << numInputs << "|opt=" << optMask << "|mirror=" << mirror
-                << "|expr=" << expr << "|vo=" << videoInfoKey(vo, vsapi);
-            for (int i = 0; i < numInputs; i++)
-                ss << "|vi" << i << "=" << videoInfoKey(vi[i], vsapi);
+            ss << std::hex;
+            for (const auto &op: ops) {
+                ss << static_cast<int>(op.type) << ':' << op.imm.u;
+                if (op.type == ExprOpType::VAR_LOAD || op.type == ExprOpType::VAR_STORE)
+                    ss << ':' << vars.emplace(op.name, (int)vars.size()).first->second;
+                else if (op.type == ExprOpType::CONST_LOAD)
+                    ss << ':' << op.name.size() << ':' << op.name;
+                else if (op.type == ExprOpType::MEM_LOAD)
+                    ss << ':' << op.x << ',' << op.y << ',' << static_cast<int>(op.bc);
+                else if (op.type == ExprOpType::CONVOLUTION)
+                    ss << ':' << op.name << ',' << static_cast<int>(op.bc);
+                ss << ' ';
+            }
             return ss.str();
         }
-        Compiled getCached() { return exprCache[key()]; }
+        const std::string &key() const { return cacheKey; }
 
         bool forceFloat() const { return !(optMask & flagUseInteger); }
     } ctx;
@@ -483,6 +1534,11 @@ class Compiler {
     using IntV = typename Types::Int;
     using FloatV = typename Types::Float;
 
+    // Full vectors are only known to be aligned up to what VapourSynth guarantees.
+    static constexpr int alignment(size_t size) { return std::min(static_cast<int>(lanes * size), ALIGNMENT); }
+
+    // Math functions too large to expand at each use. Only those used by the
+    // programs are emitted, see buildHelpers().
     struct Helper {
         using ftype = rr::ModuleFunction<FloatV(FloatV)>;
         using ftype2 = rr::ModuleFunction<FloatV(FloatV, FloatV)>;
@@ -491,9 +1547,18 @@ class Compiler {
         std::unique_ptr<ftype> Sin;
         std::unique_ptr<ftype> Cos;
         std::unique_ptr<ftype2> Pow;
+
+        enum Use {
+            useExp = 1 << 0, useLog = 1 << 1, useSin = 1 << 2, useCos = 1 << 3, usePow = 1 << 4,
+            useAll = (1 << 5) - 1,
+        };
+        // Declare calls the copies in the library built by buildRuntime(),
+        // Define builds that library, Inline defines them in the kernel's
+        // module to be inlined.
+        enum Mode { Declare, Define, Inline };
     };
-    rr::RValue<FloatV> Exp_(rr::RValue<FloatV>);
-    rr::RValue<FloatV> SinCos_(rr::RValue<FloatV>, bool issin);
+    static rr::RValue<FloatV> Exp_(rr::RValue<FloatV>);
+    static rr::RValue<FloatV> SinCos_(rr::RValue<FloatV>, bool issin);
     rr::RValue<FloatV> FP16To32(rr::RValue<UShortV>);
     rr::RValue<UShortV> FP32To16(rr::RValue<FloatV>);
 
@@ -528,6 +1593,8 @@ class Compiler {
     struct State {
         std::vector<pointer> wptrs;
         std::vector<rr::Int> strides;
+        // Index of the destination of the current plane in wptrs and strides.
+        int base;
         rr::Pointer<rr::Float> consts;
         rr::Int width;
         rr::Int height;
@@ -535,12 +1602,48 @@ class Compiler {
 
         rr::Int y;
         rr::Int x;
+        // Whether every pixel accessed by the vector being built lies within
+        // its plane, so that boundary conditions can be skipped.
+        bool interior;
+        // Position of the vector being built within the current block, in
+        // rows and vectors.
+        int row, column;
+        // Source vectors already loaded for the current block, keyed on the
+        // index in wptrs, the position of the first pixel relative to the block in
+        // pixels and rows, and the boundary condition.
+        std::map<std::tuple<int, int, int, int>, Value> loads;
 
         std::vector<Value> variables;
+        // Histogram of a reducing kernel.
+        rr::Pointer<rr::Int> histogram;
     };
 
-    Helper buildHelpers(rr::Module &mod);
-    void buildOneIter(const Helper &helpers, State &state);
+    // Bit patterns of infinities, as float vector constants must be finite.
+    static constexpr int infinity = 0x7f800000;
+    static constexpr int negativeInfinity = static_cast<int>(0xff800000u);
+
+    // Per-lane statistics of the results in one row of a reducing kernel.
+    // Only the integer or the float members are used, depending on the
+    // output format.
+    struct Reduction {
+        IntV isum, imin, imax;
+        FloatV fsum, fmin, fmax;
+        IntV count;
+    };
+
+    unsigned usedHelpers() const;
+    static Helper buildHelpers(rr::Module &mod, unsigned used, typename Helper::Mode mode);
+    static void buildRuntime();
+    void buildOps(const Helper &helpers, State &state, const std::vector<ExprOp> &ops, std::vector<Value> &stack);
+    Value buildConvolution(State &state, const ExprOp &op);
+    Value buildOneIter(const Helper &helpers, State &state, const Program &prog);
+    IntV buildRound(Value res);
+    void buildStore(State &state, Value res);
+    void buildReduce(State &state, Value res, Reduction &acc);
+    void optimize(Program &prog);
+    int chooseUnroll() const;
+    void prepare();
+    Compiled build();
 
 public:
     Compiler(
@@ -550,10 +1653,39 @@ public:
         const VSAPI *vsapi,
         int numInputs, 
         int opt = 0, 
-        int mirror = 0
-    ) : ctx(expr, vo, vi, vsapi, numInputs, opt, mirror) {}
+        int mirror = 0,
+        int unroll = 0,
+        int rows = 1
+    ) : ctx({ expr }, vo, vi, vsapi, numInputs, opt, mirror, unroll, rows, {}, -1, false) {}
+    // Fuses the expressions of several planes of equal dimensions into one
+    // routine that processes all of them in a single pass. Frame properties
+    // in fixedProps, keyed by clip and name, are replaced by their values.
+    // With non-negative bins, the results are reduced to per-row statistics
+    // and a histogram with that many bins instead, see buildReduce(). A
+    // baseline routine is generated quickly but runs slower.
+    Compiler(
+        const std::vector<std::string> &exprs,
+        const VSVideoInfo *vo, 
+        const VSVideoInfo * const *vi, 
+        const VSAPI *vsapi,
+        int numInputs, 
+        int opt = 0, 
+        int mirror = 0,
+        int unroll = 0,
+        int rows = 1,
+        const std::map<std::pair<int, std::string>, float> &fixedProps = {},
+        int bins = -1,
+        bool baseline = false
+    ) : ctx(exprs, vo, vi, vsapi, numInputs, opt, mirror, unroll, rows, fixedProps, bins, baseline) {}
 
     Compiled compile();
+    // Validates the expression and schedules code generation on the compiler
+    // thread pool. Errors in the expression are still thrown from here.
+    // Deferred compilations only start once no other one is waiting. owner
+    // is the handle from ThreadPool::attach() of the filter instance the
+    // routine is for; compilations are skipped once all their owners are
+    // freed.
+    std::shared_future<Compiled> compileAsync(const std::shared_ptr<const void> &owner = nullptr, bool defer = false) &&;
 };
 
 template<int lanes>
@@ -757,7 +1889,11 @@ static VType relativeAccessAdjust(rr::Int &x, rr::Int &alignedx, rr::Int &width,
 
 typedef std::vector<std::pair<int, int>> SortingNetwork;
 static const SortingNetwork &buildSortNet(int n) {
+    // Shared by concurrent compilations; std::map never moves its elements,
+    // so the returned reference stays valid after the lock is released.
+    static std::mutex lock;
     static std::map<int, SortingNetwork> built;
+    std::lock_guard<std::mutex> guard(lock);
     auto it = built.find(n);
     if (it != built.end()) return it->second;
 
@@ -782,73 +1918,1693 @@ static const SortingNetwork &buildSortNet(int n) {
     return sn;
 }
 
-template<int lanes>
-void Compiler<lanes>::buildOneIter(const Helper &helpers, State &state)
-{
-    constexpr unsigned char numOperands[] = {
-        0, // MEM_LOAD
-        2, // MEM_LOAD_VAR
-        0, // CONSTANTI
-        0, // CONSTANTF
-        0, // CONST_LOAD
-        0, // VAR_LOAD
-        1, // VAR_STORE
-        2, // ADD
-        2, // SUB
-        2, // MUL
-        2, // DIV
-        2, // MOD
-        1, // SQRT
-        1, // ABS
-        2, // MAX
-        2, // MIN
-        3, // CLAMP
-        2, // CMP
-        1, // TRUNC
-        1, // ROUND
-        1, // FLOOR
-        2, // AND
-        2, // OR
-        2, // XOR
-        1, // NOT
-        2, // BITAND
-        2, // BITOR
-        2, // BITXOR
-        1, // BITNOT
-        1, // EXP
-        1, // LOG
-        2, // POW
-        1, // SIN
-        1, // COS
-        3, // TERNARY
-        0, // SORT
-        0, // DUP
-        0, // SWAP
-        0, // DROP
-    };
-    static_assert(sizeof(numOperands) == static_cast<unsigned>(ExprOpType::LAST) + 1, "invalid table");
+// Expression tree optimizer, ported from the legacy Expr implementation in
+// expr/exprfilter.cpp. A validated program is converted from postfix into a
+// tree, with stack manipulation, variables and sorting networks resolved,
+// rewritten, and converted back to postfix, where values used more than once
+// are kept in variables. Unlike the legacy implementation, the rewrites track
+// whether each value is computed with integer or float vectors (mirroring
+// buildOneIter), and only apply rewrites that can change integer overflow or
+// rounding behavior to float values.
+struct ExpressionTreeNode {
+    ExpressionTreeNode *parent;
+    ExpressionTreeNode *left;
+    ExpressionTreeNode *right;
+    ExprOp op;
+    int valueNum;
+    bool isFloat;
+
+    explicit ExpressionTreeNode(ExprOp op) : parent(), left(), right(), op(op), valueNum(-1), isFloat() {}
+
+    void setLeft(ExpressionTreeNode *node)
+    {
+        if (left)
+            left->parent = nullptr;
 
-    using namespace rr;
-    std::vector<Value> stack;
+        left = node;
 
-    for (size_t i = 0; i < ctx.ops.size(); i++) {
-        const std::string &tok = ctx.tokens[i];
-        const ExprOp &op = ctx.ops[i];
+        if (left)
+            left->parent = this;
+    }
 
-        // Check validity.
-        if (op.type == ExprOpType::MEM_LOAD && op.imm.i >= ctx.numInputs)
-            throw std::runtime_error("reference to undefined clip: " + tok);
-        if ((op.type == ExprOpType::DUP || op.type == ExprOpType::SWAP) && op.imm.u >= stack.size())
-            throw std::runtime_error("insufficient values on stack: " + tok);
-        if ((op.type == ExprOpType::DROP || op.type == ExprOpType::SORT) && op.imm.u > stack.size())
-            throw std::runtime_error("insufficient values on stack: " + tok);
-        if (stack.size() < numOperands[static_cast<size_t>(op.type)])
-            throw std::runtime_error("insufficient values on stack: " + tok);
+    void setRight(ExpressionTreeNode *node)
+    {
+        if (right)
+            right->parent = nullptr;
 
-#define OUT(x) stack.push_back(x)
-        switch (op.type) {
-        case ExprOpType::DUP:
-            stack.push_back(stack[stack.size() - 1 - op.imm.u]);
+        right = node;
+
+        if (right)
+            right->parent = this;
+    }
+
+    template <class T>
+    void preorder(T visitor)
+    {
+        if (visitor(*this))
+            return;
+
+        if (left)
+            left->preorder(visitor);
+        if (right)
+            right->preorder(visitor);
+    }
+
+    template <class T>
+    void postorder(T visitor)
+    {
+        if (left)
+            left->postorder(visitor);
+        if (right)
+            right->postorder(visitor);
+        visitor(*this);
+    }
+};
+
+class ExpressionTree {
+    std::vector<std::unique_ptr<ExpressionTreeNode>> nodes;
+    ExpressionTreeNode *root;
+public:
+    // Needed to tell integer values from float ones.
+    bool forceFloat;
+    std::vector<bool> floatClips;
+
+    ExpressionTree() : root(), forceFloat(true) {}
+
+    ExpressionTreeNode *getRoot() { return root; }
+    const ExpressionTreeNode *getRoot() const { return root; }
+
+    void setRoot(ExpressionTreeNode *node) { root = node; }
+
+    size_t size() const { return nodes.size(); }
+
+    ExpressionTreeNode *makeNode(ExprOp data)
+    {
+        nodes.push_back(std::unique_ptr<ExpressionTreeNode>(new ExpressionTreeNode(data)));
+        return nodes.back().get();
+    }
+
+    ExpressionTreeNode *clone(const ExpressionTreeNode *node)
+    {
+        if (!node)
+            return nullptr;
+
+        ExpressionTreeNode *newnode = makeNode(node->op);
+        newnode->valueNum = node->valueNum;
+        newnode->isFloat = node->isFloat;
+        newnode->setLeft(clone(node->left));
+        newnode->setRight(clone(node->right));
+        return newnode;
+    }
+};
+
+bool isConstant(const ExpressionTreeNode &node)
+{
+    return node.op.type == ExprOpType::CONSTANTI || node.op.type == ExprOpType::CONSTANTF;
+}
+
+float constantValue(const ExpressionTreeNode &node)
+{
+    return node.op.type == ExprOpType::CONSTANTI ? static_cast<float>(node.op.imm.i) : node.op.imm.f;
+}
+
+bool isConstant(const ExpressionTreeNode &node, float val)
+{
+    return isConstant(node) && constantValue(node) == val;
+}
+
+bool isConstantExpr(const ExpressionTreeNode &node)
+{
+    switch (node.op.type) {
+    case ExprOpType::MEM_LOAD:
+    case ExprOpType::MEM_LOAD_VAR:
+    case ExprOpType::CONVOLUTION:
+    case ExprOpType::CONST_LOAD:
+        return false;
+    case ExprOpType::CONSTANTI:
+    case ExprOpType::CONSTANTF:
+        return true;
+    default:
+        return (!node.left || isConstantExpr(*node.left)) && (!node.right || isConstantExpr(*node.right));
+    }
+}
+
+bool isOpCode(const ExpressionTreeNode &node, std::initializer_list<ExprOpType> types)
+{
+    for (ExprOpType type : types) {
+        if (node.op.type == type)
+            return true;
+    }
+    return false;
+}
+
+bool isInteger(float x)
+{
+    return std::floor(x) == x;
+}
+
+// buildOneIter turns integral float constants into integers.
+bool isIntegerConstant(float x)
+{
+    return isInteger(x) && x >= -2147483648.0f && x < 2147483648.0f;
+}
+
+ExprOp makeConstant(float x)
+{
+    return { ExprOpType::CONSTANTF, x };
+}
+
+// Constant values are evaluated with the same integer/float semantics as
+// the generated code.
+struct ConstantValue {
+    bool isFloat;
+    int32_t i;
+    float f;
+
+    ConstantValue(int32_t i) : isFloat(false), i(i), f() {}
+    ConstantValue(float f) : isFloat(true), i(), f(f) {}
+
+    float toFloat() const { return isFloat ? f : static_cast<float>(i); }
+    int32_t toInt() const { return isFloat ? static_cast<int32_t>(std::nearbyint(f)) : i; }
+    bool truthy() const { return isFloat ? f > 0.0f : i > 0; }
+
+    ExprOp toOp() const { return isFloat ? ExprOp{ ExprOpType::CONSTANTF, f } : ExprOp{ ExprOpType::CONSTANTI, i }; }
+};
+
+ConstantValue evalConstantExpr(const ExpressionTree &tree, const ExpressionTreeNode &node)
+{
+    auto wrap = [](uint32_t x) { return static_cast<int32_t>(x); };
+    auto eval = [&](const ExpressionTreeNode *n) { return evalConstantExpr(tree, *n); };
+
+    switch (node.op.type) {
+    case ExprOpType::CONSTANTI: return node.op.imm.i;
+    case ExprOpType::CONSTANTF:
+        if (isIntegerConstant(node.op.imm.f))
+            return static_cast<int32_t>(node.op.imm.f);
+        return node.op.imm.f;
+    default: break;
+    }
+
+    const ConstantValue l = eval(node.left);
+    const bool unary = !node.right;
+    const bool mux = node.right && node.right->op.type == ExprOpType::MUX;
+    const ConstantValue r = unary ? l : mux ? eval(node.right->left) : eval(node.right);
+    const ConstantValue r2 = mux ? eval(node.right->right) : r;
+    const bool anyFloat = l.isFloat || (!unary && r.isFloat) || (mux && r2.isFloat);
+
+    switch (node.op.type) {
+    case ExprOpType::ADD: return anyFloat ? ConstantValue(l.toFloat() + r.toFloat()) : ConstantValue(wrap(uint32_t(l.i) + uint32_t(r.i)));
+    case ExprOpType::SUB: return anyFloat ? ConstantValue(l.toFloat() - r.toFloat()) : ConstantValue(wrap(uint32_t(l.i) - uint32_t(r.i)));
+    case ExprOpType::MUL: return anyFloat ? ConstantValue(l.toFloat() * r.toFloat()) : ConstantValue(wrap(uint32_t(l.i) * uint32_t(r.i)));
+    case ExprOpType::NEG: return l.isFloat ? ConstantValue(-l.f) : ConstantValue(wrap(0u - uint32_t(l.i)));
+    case ExprOpType::DIV: return l.toFloat() / r.toFloat();
+    case ExprOpType::MOD: return std::fmod(l.toFloat(), r.toFloat());
+    case ExprOpType::SQRT: return std::sqrt(std::max(l.toFloat(), 0.0f));
+    case ExprOpType::ABS:
+        if (anyFloat || tree.forceFloat) return std::fabs(l.toFloat());
+        return wrap(l.i < 0 ? 0u - uint32_t(l.i) : uint32_t(l.i));
+    case ExprOpType::MAX:
+        if (anyFloat || tree.forceFloat) return std::max(l.toFloat(), r.toFloat());
+        return std::max(l.i, r.i);
+    case ExprOpType::MIN:
+        if (anyFloat || tree.forceFloat) return std::min(l.toFloat(), r.toFloat());
+        return std::min(l.i, r.i);
+    case ExprOpType::CLAMP:
+        if (anyFloat || tree.forceFloat) return std::max(std::min(l.toFloat(), r2.toFloat()), r.toFloat());
+        return std::max(std::min(l.i, r2.i), r.i);
+    case ExprOpType::CMP: {
+        bool x = false;
+        if (anyFloat) {
+            float a = l.toFloat(), b = r.toFloat();
+            switch (static_cast<ComparisonType>(node.op.imm.u)) {
+            case ComparisonType::EQ: x = a == b; break;
+            case ComparisonType::LT: x = a < b; break;
+            case ComparisonType::LE: x = a <= b; break;
+            case ComparisonType::NEQ: x = a != b; break;
+            case ComparisonType::NLT: x = a >= b; break;
+            case ComparisonType::NLE: x = a > b; break;
+            }
+        } else {
+            switch (static_cast<ComparisonType>(node.op.imm.u)) {
+            case ComparisonType::EQ: x = l.i == r.i; break;
+            case ComparisonType::LT: x = l.i < r.i; break;
+            case ComparisonType::LE: x = l.i <= r.i; break;
+            case ComparisonType::NEQ: x = l.i != r.i; break;
+            case ComparisonType::NLT: x = l.i >= r.i; break;
+            case ComparisonType::NLE: x = l.i > r.i; break;
+            }
+        }
+        return static_cast<int32_t>(x);
+    }
+    case ExprOpType::AND: return static_cast<int32_t>(l.truthy() && r.truthy());
+    case ExprOpType::OR: return static_cast<int32_t>(l.truthy() || r.truthy());
+    case ExprOpType::XOR: return static_cast<int32_t>(l.truthy() != r.truthy());
+    case ExprOpType::NOT: return static_cast<int32_t>(!l.truthy());
+    case ExprOpType::BITAND: return l.toInt() & r.toInt();
+    case ExprOpType::BITOR: return l.toInt() | r.toInt();
+    case ExprOpType::BITXOR: return l.toInt() ^ r.toInt();
+    case ExprOpType::BITNOT: return ~l.toInt();
+    case ExprOpType::TRUNC: return std::trunc(l.toFloat());
+    case ExprOpType::ROUND: return std::nearbyint(l.toFloat());
+    case ExprOpType::FLOOR: return std::floor(l.toFloat());
+    case ExprOpType::EXP: return std::exp(l.toFloat());
+    case ExprOpType::LOG: return std::log(l.toFloat());
+    case ExprOpType::POW: return std::pow(l.toFloat(), r.toFloat());
+    case ExprOpType::SIN: return std::sin(l.toFloat());
+    case ExprOpType::COS: return std::cos(l.toFloat());
+    case ExprOpType::TERNARY:
+        if (r.isFloat || r2.isFloat)
+            return l.truthy() ? r.toFloat() : r2.toFloat();
+        return l.truthy() ? r.i : r2.i;
+    case ExprOpType::FMA: {
+        float a = l.toFloat(), b = r.toFloat(), c = r2.toFloat();
+        switch (static_cast<FMAType>(node.op.imm.u)) {
+        case FMAType::FMADD: return b * c + a;
+        case FMAType::FMSUB: return b * c - a;
+        case FMAType::FNMADD: return -(b * c) + a;
+        case FMAType::FNMSUB: return -(b * c) - a;
+        }
+        return NAN;
+    }
+    default: return NAN;
+    }
+}
+
+// Mirrors the choice between integer and float vectors in buildOneIter.
+bool isFloatNode(const ExpressionTree &tree, const ExpressionTreeNode &node)
+{
+    auto l = [&] { return node.left->isFloat; };
+    auto r = [&] { return node.right->isFloat; };
+
+    switch (node.op.type) {
+    case ExprOpType::MEM_LOAD:
+    case ExprOpType::MEM_LOAD_VAR:
+        return tree.forceFloat || tree.floatClips[node.op.imm.i];
+    case ExprOpType::CONVOLUTION:
+        return tree.forceFloat || tree.floatClips[node.op.imm.i] || !ConvolutionKernel(node.op.name).integral();
+    case ExprOpType::CONSTANTI:
+        return false;
+    case ExprOpType::CONSTANTF:
+        return !isIntegerConstant(node.op.imm.f);
+    case ExprOpType::CONST_LOAD:
+        return node.op.imm.i >= static_cast<int>(LoadConstType::LAST);
+    case ExprOpType::ADD:
+    case ExprOpType::SUB:
+    case ExprOpType::MUL:
+    case ExprOpType::MUX:
+        return l() || r();
+    case ExprOpType::NEG:
+        return l();
+    case ExprOpType::ABS:
+        return tree.forceFloat || l();
+    case ExprOpType::MAX:
+    case ExprOpType::MIN:
+    case ExprOpType::CLAMP:
+        return tree.forceFloat || l() || r();
+    case ExprOpType::CMP:
+    case ExprOpType::AND:
+    case ExprOpType::OR:
+    case ExprOpType::XOR:
+    case ExprOpType::NOT:
+    case ExprOpType::BITAND:
+    case ExprOpType::BITOR:
+    case ExprOpType::BITXOR:
+    case ExprOpType::BITNOT:
+        return false;
+    case ExprOpType::TERNARY:
+        return r();
+    default:
+        return true;
+    }
+}
+
+void replaceNode(ExpressionTreeNode &node, const ExpressionTreeNode &replacement)
+{
+    node.op = replacement.op;
+    node.setLeft(replacement.left);
+    node.setRight(replacement.right);
+}
+
+void swapNodeContents(ExpressionTreeNode &lhs, ExpressionTreeNode &rhs)
+{
+    std::swap(lhs.op, rhs.op);
+    std::swap(lhs.left, rhs.left);
+    std::swap(lhs.right, rhs.right);
+    std::swap(lhs.valueNum, rhs.valueNum);
+    std::swap(lhs.isFloat, rhs.isFloat);
+    for (ExpressionTreeNode *node : { &lhs, &rhs }) {
+        if (node->left)
+            node->left->parent = node;
+        if (node->right)
+            node->right->parent = node;
+    }
+}
+
+// Also infers whether each value is an integer or a float.
+void applyValueNumbering(ExpressionTree &tree)
+{
+    typedef std::tuple<int, uint32_t, std::string, int, int, int, int, int> Key;
+    std::map<Key, int> numbered;
+
+    tree.getRoot()->postorder([&](ExpressionTreeNode &node)
+    {
+        node.isFloat = isFloatNode(tree, node);
+        Key key { static_cast<int>(node.op.type), node.op.imm.u, node.op.name, node.op.x, node.op.y, static_cast<int>(node.op.bc),
+                  node.left ? node.left->valueNum : -1, node.right ? node.right->valueNum : -1 };
+        node.valueNum = numbered.emplace(key, static_cast<int>(numbered.size())).first->second;
+    });
+}
+
+ExpressionTreeNode *emitIntegerPow(ExpressionTree &tree, const ExpressionTreeNode &node, int exponent)
+{
+    if (exponent == 1)
+        return tree.clone(&node);
+
+    ExpressionTreeNode *mulNode = tree.makeNode({ ExprOpType::MUL });
+    mulNode->setLeft(emitIntegerPow(tree, node, (exponent + 1) / 2));
+    mulNode->setRight(emitIntegerPow(tree, node, exponent - (exponent + 1) / 2));
+    return mulNode;
+}
+
+typedef std::unordered_map<int, const ExpressionTreeNode *> ValueIndex;
+
+class ExponentMap {
+    struct CanonicalCompare {
+        const ValueIndex &index;
+
+        bool operator()(const std::pair<int, float> &lhs, const std::pair<int, float> &rhs) const
+        {
+            // Order equivalent terms by exponent.
+            if (lhs.first == rhs.first)
+                return lhs.second < rhs.second;
+
+            const ExpressionTreeNode *lhsNode = index.at(lhs.first);
+            const ExpressionTreeNode *rhsNode = index.at(rhs.first);
+
+            // Ordering: complex values, memory, constants
+            int lhsCategory = isConstant(*lhsNode) ? 2 : lhsNode->op.type == ExprOpType::MEM_LOAD ? 1 : 0;
+            int rhsCategory = isConstant(*rhsNode) ? 2 : rhsNode->op.type == ExprOpType::MEM_LOAD ? 1 : 0;
+
+            if (lhsCategory != rhsCategory)
+                return lhsCategory < rhsCategory;
+
+            // Ordering criteria for each category:
+            //
+            // constants: order by value
+            // memory: order by clip and offset
+            // other: order by value number (unstable)
+            if (lhsCategory == 2)
+                return constantValue(*lhsNode) < constantValue(*rhsNode);
+            else if (lhsCategory == 1)
+                return std::make_tuple(lhsNode->op.imm.i, lhsNode->op.y, lhsNode->op.x, lhsNode->op.bc) <
+                       std::make_tuple(rhsNode->op.imm.i, rhsNode->op.y, rhsNode->op.x, rhsNode->op.bc);
+            else
+                return lhs.first < rhs.first;
+        };
+    };
+
+    // e.g. 3 * v0^2 * v1^3
+    // map = { 0: 2, 1: 3 }, coeff = 3
+    std::map<int, float> map; // key = valueNum, value = exponent
+    std::vector<int> origSequence;
+    float coeff;
+
+    // Integer multiplications wrap around, so they are kept as they are.
+    static bool isExpandable(const ExpressionTreeNode &value)
+    {
+        return (value.op.type == ExprOpType::POW && isConstant(*value.right)) ||
+            (value.op.type == ExprOpType::MUL && value.isFloat) || value.op.type == ExprOpType::DIV;
+    }
+
+    bool expandOrigSequence(ValueIndex &index)
+    {
+        bool changed = false;
+
+        for (size_t i = 0; i < origSequence.size(); ++i) {
+            const ExpressionTreeNode *value = index.at(origSequence[i]);
+
+            if (!isExpandable(*value))
+                continue;
+
+            if (value->op.type == ExprOpType::POW) {
+                origSequence[i] = value->left->valueNum;
+                changed = true;
+            } else {
+                origSequence[i] = value->left->valueNum;
+                origSequence.insert(origSequence.begin() + i + 1, value->right->valueNum);
+                changed = true;
+            }
+        }
+
+        return changed;
+    }
+
+    bool expandOnePass(ValueIndex &index)
+    {
+        bool changed = false;
+
+        for (auto it = map.begin(); it != map.end();) {
+            const ExpressionTreeNode *value = index.at(it->first);
+
+            if (!isExpandable(*value)) {
+                ++it;
+                continue;
+            }
+
+            index[value->left->valueNum] = value->left;
+            if (value->op.type == ExprOpType::POW) {
+                map[value->left->valueNum] += it->second * constantValue(*value->right);
+            } else {
+                index[value->right->valueNum] = value->right;
+                map[value->left->valueNum] += it->second;
+                map[value->right->valueNum] += value->op.type == ExprOpType::DIV ? -it->second : it->second;
+            }
+
+            it = map.erase(it);
+            changed = true;
+        }
+
+        return changed;
+    }
+
+    void combineConstants(const ValueIndex &index)
+    {
+        for (auto it = map.begin(); it != map.end();) {
+            const ExpressionTreeNode *node = index.at(it->first);
+            if (isConstant(*node)) {
+                coeff *= std::pow(constantValue(*node), it->second);
+                it = map.erase(it);
+                continue;
+            }
+            ++it;
+        }
+    }
+public:
+    ExponentMap() : coeff(1.0f) {}
+
+    void addTerm(int valueNum, float exp)
+    {
+        map[valueNum] += exp;
+        origSequence.push_back(valueNum);
+    }
+
+    void addCoeff(float val) { coeff += val; }
+
+    void mulCoeff(float val) { coeff *= val; }
+
+    float getCoeff() const { return coeff; }
+
+    bool isScalar() const { return map.empty(); }
+
+    size_t numTerms() const { return map.size() + 1; }
+
+    bool isSameTerm(const ExponentMap &other) const
+    {
+        return map == other.map;
+    }
+
+    void expand(ValueIndex &index)
+    {
+        while (expandOnePass(index)) {
+            // ...
+        }
+        combineConstants(index);
+
+        while (expandOrigSequence(index)) {
+            // ...
+        }
+    }
+
+    bool isCanonical(const ValueIndex &index) const
+    {
+        std::vector<std::pair<int, float>> tmp;
+        for (int x : origSequence) {
+            tmp.push_back({ x, 1.0f });
+        }
+        return std::is_sorted(tmp.begin(), tmp.end(), CanonicalCompare{ index });
+    }
+
+    ExpressionTreeNode *emit(ExpressionTree &tree, const ValueIndex &index) const
+    {
+        std::vector<std::pair<int, float>> flat(map.begin(), map.end());
+        std::sort(flat.begin(), flat.end(), CanonicalCompare{ index });
+
+        ExpressionTreeNode *node = nullptr;
+
+        for (auto &term : flat) {
+            ExpressionTreeNode *powNode = tree.makeNode(ExprOpType::POW);
+            powNode->setLeft(tree.clone(index.at(term.first)));
+            powNode->setRight(tree.makeNode(makeConstant(term.second)));
+
+            if (node) {
+                ExpressionTreeNode *mulNode = tree.makeNode(ExprOpType::MUL);
+                mulNode->setLeft(node);
+                mulNode->setRight(powNode);
+                node = mulNode;
+            } else {
+                node = powNode;
+            }
+        }
+
+        if (node) {
+            ExpressionTreeNode *mulNode = tree.makeNode(ExprOpType::MUL);
+            mulNode->setLeft(node);
+            mulNode->setRight(tree.makeNode(makeConstant(coeff)));
+            node = mulNode;
+        } else {
+            node = tree.makeNode(makeConstant(coeff));
+        }
+
+        return node;
+    }
+
+    bool canonicalOrder(const ExponentMap &other, const ValueIndex &index) const
+    {
+        // Convert map to flat array, as canonical order is different from value numbering.
+        std::vector<std::pair<int, float>> lhsFlat(map.begin(), map.end());
+        std::vector<std::pair<int, float>> rhsFlat(other.map.begin(), other.map.end());
+
+        CanonicalCompare pred{ index };
+        std::sort(lhsFlat.begin(), lhsFlat.end(), pred);
+        std::sort(rhsFlat.begin(), rhsFlat.end(), pred);
+        return std::lexicographical_compare(lhsFlat.begin(), lhsFlat.end(), rhsFlat.begin(), rhsFlat.end(), pred);
+    }
+};
+
+class AdditiveSequence {
+    std::vector<ExponentMap> terms;
+    float scalarTerm;
+public:
+    AdditiveSequence() : scalarTerm() {}
+
+    void addTerm(int valueNum, int sign)
+    {
+        ExponentMap map;
+        map.addTerm(valueNum, 1.0f);
+        map.mulCoeff(static_cast<float>(sign));
+        terms.push_back(std::move(map));
+    }
+
+    size_t numTerms() const { return terms.size() + 1; }
+
+    void expand(ValueIndex &index)
+    {
+        for (auto &term : terms) {
+            term.expand(index);
+        }
+
+        for (auto it = terms.begin(); it != terms.end();) {
+            if (it->isScalar()) {
+                scalarTerm += it->getCoeff();
+                it = terms.erase(it);
+                continue;
+            }
+
+            ++it;
+        }
+
+        for (auto it1 = terms.begin(); it1 != terms.end();) {
+            for (auto it2 = it1 + 1; it2 != terms.end(); ++it2) {
+                if (it1->isSameTerm(*it2)) {
+                    it1->addCoeff(it2->getCoeff());
+                    it2->mulCoeff(0.0f);
+                }
+            }
+
+            if (it1->getCoeff() == 0.0f) {
+                it1 = terms.erase(it1);
+                continue;
+            }
+
+            ++it1;
+        }
+    }
+
+    bool canonicalize(const ValueIndex &index)
+    {
+        auto pred = [&](const ExponentMap &lhs, const ExponentMap &rhs)
+        {
+            return lhs.canonicalOrder(rhs, index);
+        };
+
+        if (std::is_sorted(terms.begin(), terms.end(), pred))
+            return true;
+
+        std::sort(terms.begin(), terms.end(), pred);
+        return false;
+    }
+
+    ExpressionTreeNode *emit(ExpressionTree &tree, const ValueIndex &index) const
+    {
+        ExpressionTreeNode *head = nullptr;
+
+        for (const auto &term : terms) {
+            ExpressionTreeNode *node = term.emit(tree, index);
+
+            if (head) {
+                ExpressionTreeNode *addNode = tree.makeNode(ExprOpType::ADD);
+                addNode->setLeft(head);
+                addNode->setRight(node);
+                head = addNode;
+            } else {
+                head = node;
+            }
+        }
+
+        if (head) {
+            ExpressionTreeNode *addNode = tree.makeNode(scalarTerm < 0 ? ExprOpType::SUB : ExprOpType::ADD);
+            addNode->setLeft(head);
+            addNode->setRight(tree.makeNode(makeConstant(std::fabs(scalarTerm))));
+            head = addNode;
+        } else {
+            head = tree.makeNode(makeConstant(scalarTerm));
+        }
+
+        return head;
+    }
+};
+
+// Additive and multiplicative chains are only reassociated if all their
+// operations are done in floating point.
+bool isFloatChain(ExpressionTreeNode &node, std::initializer_list<ExprOpType> types)
+{
+    bool ok = true;
+    node.preorder([&](ExpressionTreeNode &node)
+    {
+        if (!isOpCode(node, types))
+            return true;
+        ok = ok && node.isFloat;
+        return !ok;
+    });
+    return ok;
+}
+
+bool analyzeAdditiveExpression(ExpressionTree &tree, ExpressionTreeNode &node)
+{
+    size_t origNumTerms = 0;
+    AdditiveSequence expr;
+    ValueIndex index;
+
+    if (!isFloatChain(node, { ExprOpType::ADD, ExprOpType::SUB }))
+        return false;
+
+    node.preorder([&](ExpressionTreeNode &node)
+    {
+        if (isOpCode(node, { ExprOpType::ADD, ExprOpType::SUB }))
+            return false;
+
+        // Deduce net sign of term.
+        const ExpressionTreeNode *parent = node.parent;
+        const ExpressionTreeNode *cur = &node;
+        int polarity = 1;
+
+        while (parent && isOpCode(*parent, { ExprOpType::ADD, ExprOpType::SUB })) {
+            if (parent->op.type == ExprOpType::SUB && cur == parent->right)
+                polarity = -polarity;
+
+            cur = parent;
+            parent = parent->parent;
+        }
+
+        ++origNumTerms;
+        expr.addTerm(node.valueNum, polarity);
+        index[node.valueNum] = &node;
+        return true;
+    });
+
+    expr.expand(index);
+    bool canonical = expr.canonicalize(index);
+
+    if (expr.numTerms() < origNumTerms || !canonical) {
+        ExpressionTreeNode *seq = expr.emit(tree, index);
+        replaceNode(node, *seq);
+        return true;
+    }
+
+    return false;
+}
+
+bool analyzeMultiplicativeExpression(ExpressionTree &tree, ExpressionTreeNode &node)
+{
+    ValueIndex index;
+
+    ExponentMap expr;
+    size_t origNumTerms = 0;
+    size_t numDivs = 0;
+
+    if (!isFloatChain(node, { ExprOpType::MUL, ExprOpType::DIV }))
+        return false;
+
+    node.preorder([&](ExpressionTreeNode &node)
+    {
+        if (node.op.type == ExprOpType::DIV)
+            ++numDivs;
+
+        if (isOpCode(node, { ExprOpType::MUL, ExprOpType::DIV }))
+            return false;
+
+        // Deduce net sign of term.
+        const ExpressionTreeNode *parent = node.parent;
+        const ExpressionTreeNode *cur = &node;
+        int polarity = 1;
+
+        while (parent && isOpCode(*parent, { ExprOpType::MUL, ExprOpType::DIV })) {
+            if (parent->op.type == ExprOpType::DIV && cur == parent->right)
+                polarity = -polarity;
+
+            cur = parent;
+            parent = parent->parent;
+        }
+
+        expr.addTerm(node.valueNum, static_cast<float>(polarity));
+        index[node.valueNum] = &node;
+        ++origNumTerms;
+        return true;
+    });
+
+    expr.expand(index);
+
+    if (expr.numTerms() < origNumTerms || !expr.isCanonical(index) || numDivs) {
+        ExpressionTreeNode *seq = expr.emit(tree, index);
+        replaceNode(node, *seq);
+        return true;
+    }
+
+    return false;
+}
+
+bool applyAlgebraicOptimizations(ExpressionTree &tree)
+{
+    bool changed = false;
+
+    applyValueNumbering(tree);
+
+    tree.getRoot()->preorder([&](ExpressionTreeNode &node)
+    {
+        if (isOpCode(node, { ExprOpType::ADD, ExprOpType::SUB }) && (!node.parent || !isOpCode(*node.parent, { ExprOpType::ADD, ExprOpType::SUB }))) {
+            changed = changed || analyzeAdditiveExpression(tree, node);
+            return changed;
+        }
+
+        if (isOpCode(node, { ExprOpType::MUL, ExprOpType::DIV }) && (!node.parent || !isOpCode(*node.parent, { ExprOpType::MUL, ExprOpType::DIV }))) {
+            changed = changed || analyzeMultiplicativeExpression(tree, node);
+            return changed;
+        }
+
+        return false;
+    });
+
+    return changed;
+}
+
+bool applyComparisonOptimizations(ExpressionTree &tree)
+{
+    bool changed = false;
+
+    applyValueNumbering(tree);
+
+    tree.getRoot()->preorder([&](ExpressionTreeNode &node)
+    {
+        // Eliminate constant conditions.
+        if (node.op.type == ExprOpType::CMP && node.left->valueNum == node.right->valueNum) {
+            ComparisonType type = static_cast<ComparisonType>(node.op.imm.u);
+            if (type == ComparisonType::EQ || type == ComparisonType::LE || type == ComparisonType::NLT)
+                replaceNode(node, ExpressionTreeNode{ { ExprOpType::CONSTANTI, 1 } });
+            else
+                replaceNode(node, ExpressionTreeNode{ { ExprOpType::CONSTANTI, 0 } });
+
+            changed = true;
+            return changed;
+        }
+
+        // Eliminate identical branches.
+        if (node.op.type == ExprOpType::TERNARY && node.right->left->valueNum == node.right->right->valueNum) {
+            replaceNode(node, *node.right->left);
+            changed = true;
+            return changed;
+        }
+
+        // MIN/MAX detection.
+        if (node.op.type == ExprOpType::TERNARY && node.left->op.type == ExprOpType::CMP) {
+            ComparisonType type = static_cast<ComparisonType>(node.left->op.imm.u);
+            int cmpTerms[2] = { node.left->left->valueNum, node.left->right->valueNum };
+            int muxTerms[2] = { node.right->left->valueNum, node.right->right->valueNum };
+
+            bool isSameTerms = (cmpTerms[0] == muxTerms[0] && cmpTerms[1] == muxTerms[1]) || (cmpTerms[0] == muxTerms[1] && cmpTerms[1] == muxTerms[0]);
+            bool isLessOrGreater = type == ComparisonType::LT || type == ComparisonType::LE || type == ComparisonType::NLE || type == ComparisonType::NLT;
+
+            if (isSameTerms && isLessOrGreater) {
+                // a < b ? a : b --> min(a, b)     a > b ? b : a --> min(a, b)
+                // a > b ? a : b --> max(a, b)     a < b ? b : a --> max(a, b)
+                bool min = (type == ComparisonType::LT || type == ComparisonType::LE) ? cmpTerms[0] == muxTerms[0] : cmpTerms[0] != muxTerms[0];
+                ExpressionTreeNode *a = node.left->left;
+                ExpressionTreeNode *b = node.left->right;
+
+                replaceNode(node, ExpressionTreeNode{ min ? ExprOpType::MIN : ExprOpType::MAX });
+                node.setLeft(a);
+                node.setRight(b);
+
+                changed = true;
+                return changed;
+            }
+        }
+
+        // CMP to SUB conversion. It has lower priority than other comparison transformations.
+        // Integer subtraction could overflow, so this is only done for floats.
+        if (node.op.type == ExprOpType::CMP && node.parent && isOpCode(*node.parent, { ExprOpType::AND, ExprOpType::OR, ExprOpType::XOR, ExprOpType::TERNARY }) &&
+            node.left->isFloat && node.right->isFloat) {
+            ComparisonType type = static_cast<ComparisonType>(node.op.imm.u);
+
+            // a < b --> b - a    a > b --> a - b
+            if (type == ComparisonType::LT || type == ComparisonType::NLE) {
+                if (type == ComparisonType::LT)
+                    std::swap(node.left, node.right);
+
+                node.op = ExprOpType::SUB;
+                changed = true;
+                return changed;
+            }
+        }
+
+        return false;
+    });
+
+    return changed;
+}
+
+bool applyLocalOptimizations(ExpressionTree &tree)
+{
+    bool changed = false;
+
+    tree.getRoot()->postorder([&](ExpressionTreeNode &node)
+    {
+        if (node.op.type == ExprOpType::MUX)
+            return;
+
+        // Constant folding.
+        if (!isConstant(node) && isConstantExpr(node)) {
+            replaceNode(node, ExpressionTreeNode{ evalConstantExpr(tree, node).toOp() });
+            changed = true;
+        }
+
+        // Move constants to right-hand side to simplify identities.
+        if (isOpCode(node, { ExprOpType::ADD, ExprOpType::MUL }) && isConstant(*node.left) && !isConstant(*node.right)) {
+            std::swap(node.left, node.right);
+            changed = true;
+        }
+
+        // x * 0 = 0    0 / x = 0
+        if ((node.op.type == ExprOpType::MUL && isConstant(*node.right, 0.0f)) || (node.op.type == ExprOpType::DIV && isConstant(*node.left, 0.0f))) {
+            replaceNode(node, ExpressionTreeNode{ { ExprOpType::CONSTANTI, 0 } });
+            changed = true;
+        }
+
+        // The legacy sqrt(x) = x ** 0.5 canonicalization is not done, as
+        // sqrt clamps negative values to 0.
+
+        // log(exp(x)) = x    exp(log(x)) = x
+        if ((node.op.type == ExprOpType::LOG && node.left->op.type == ExprOpType::EXP) || (node.op.type == ExprOpType::EXP && node.left->op.type == ExprOpType::LOG)) {
+            replaceNode(node, *node.left->left);
+            changed = true;
+        }
+
+        // x ** 0 = 1
+        if (node.op.type == ExprOpType::POW && isConstant(*node.right, 0.0f)) {
+            replaceNode(node, ExpressionTreeNode{ { ExprOpType::CONSTANTI, 1 } });
+            changed = true;
+        }
+
+        // (a ** b) ** c = a ** (b * c), for integer c
+        if (node.op.type == ExprOpType::POW && node.left->op.type == ExprOpType::POW && isConstant(*node.right) && isInteger(constantValue(*node.right))) {
+            ExpressionTreeNode *a = node.left->left;
+            ExpressionTreeNode *b = node.left->right;
+            ExpressionTreeNode *c = node.right;
+            replaceNode(*node.left, *a);
+            node.setRight(tree.makeNode(ExprOpType::MUL));
+            node.right->setLeft(b);
+            node.right->setRight(c);
+            changed = true;
+        }
+
+        // 0 ? x : y = y    1 ? x : y = x
+        if (node.op.type == ExprOpType::TERNARY && isConstant(*node.left)) {
+            ExpressionTreeNode *replacement = constantValue(*node.left) > 0.0f ? node.right->left : node.right->right;
+            replaceNode(node, *replacement);
+            changed = true;
+        }
+
+        // a <= b ? x : y --> a > b ? y : x    a >= b ? x : y --> a < b ? y : x
+        if (node.op.type == ExprOpType::TERNARY && node.left->op.type == ExprOpType::CMP) {
+            ComparisonType type = static_cast<ComparisonType>(node.left->op.imm.u);
+
+            if (type == ComparisonType::LE || type == ComparisonType::NLT) {
+                node.left->op.imm.u = static_cast<unsigned>(type == ComparisonType::LE ? ComparisonType::NLE : ComparisonType::LT);
+                std::swap(node.right->left, node.right->right);
+                changed = true;
+            }
+        }
+
+        // !a ? b : c --> a ? c : b
+        if (node.op.type == ExprOpType::TERNARY && node.left->op.type == ExprOpType::NOT) {
+            replaceNode(*node.left, *node.left->left);
+            std::swap(node.right->left, node.right->right);
+            changed = true;
+        }
+
+        // !(a < b) --> a >= b
+        if (node.op.type == ExprOpType::NOT && node.left->op.type == ExprOpType::CMP) {
+            switch (static_cast<ComparisonType>(node.left->op.imm.u)) {
+            case ComparisonType::EQ: node.left->op.imm.u = static_cast<unsigned>(ComparisonType::NEQ); break;
+            case ComparisonType::LT: node.left->op.imm.u = static_cast<unsigned>(ComparisonType::NLT); break;
+            case ComparisonType::LE: node.left->op.imm.u = static_cast<unsigned>(ComparisonType::NLE); break;
+            case ComparisonType::NEQ: node.left->op.imm.u = static_cast<unsigned>(ComparisonType::EQ); break;
+            case ComparisonType::NLT: node.left->op.imm.u = static_cast<unsigned>(ComparisonType::LT); break;
+            case ComparisonType::NLE: node.left->op.imm.u = static_cast<unsigned>(ComparisonType::LE); break;
+            }
+            replaceNode(node, *node.left);
+            changed = true;
+        }
+    });
+
+    return changed;
+}
+
+bool applyAlgebraicCleanup(ExpressionTree &tree)
+{
+    bool changed = false;
+
+    // Prune extra terms introduced by the algebraic analysis. These need to run in a later pass to prevent cycles.
+    tree.getRoot()->postorder([&](ExpressionTreeNode &node)
+    {
+        // x + 0 = x    x - 0 = x
+        if (isOpCode(node, { ExprOpType::ADD, ExprOpType::SUB }) && isConstant(*node.right, 0.0f)) {
+            replaceNode(node, *node.left);
+            changed = true;
+        }
+
+        // x * 1 = x    x / 1 = x
+        if (isOpCode(node, { ExprOpType::MUL, ExprOpType::DIV }) && isConstant(*node.right, 1.0f)) {
+            replaceNode(node, *node.left);
+            changed = true;
+        }
+
+        // x ** 1 = x
+        if (node.op.type == ExprOpType::POW && isConstant(*node.right, 1.0f)) {
+            replaceNode(node, *node.left);
+            changed = true;
+        }
+    });
+
+    return changed;
+}
+
+// The types of a rewritten subtree are stale until the next value numbering,
+// so these passes rewrite each node at most once, and leave the ancestors of
+// rewritten nodes to the next iteration.
+bool applyStrengthReduction(ExpressionTree &tree)
+{
+    bool changed = false;
+
+    std::unordered_set<const ExpressionTreeNode *> modified;
+    auto rewritten = [&](const ExpressionTreeNode &node) { modified.insert(&node); changed = true; };
+
+    applyValueNumbering(tree);
+
+    tree.getRoot()->postorder([&](ExpressionTreeNode &node)
+    {
+        if ((node.left && modified.count(node.left)) || (node.right && modified.count(node.right)))
+            return void(modified.insert(&node));
+        if (node.op.type == ExprOpType::MUX)
+            return;
+
+        // 0 - x = -x
+        if (node.op.type == ExprOpType::SUB && isConstant(*node.left, 0.0f)) {
+            ExpressionTreeNode *tmp = node.right;
+            replaceNode(node, ExpressionTreeNode{ { ExprOpType::NEG } });
+            node.setLeft(tmp);
+            return rewritten(node);
+        }
+
+        // x * -1 = -x    x / -1 = -x
+        if (isOpCode(node, { ExprOpType::MUL, ExprOpType::DIV }) && isConstant(*node.right, -1.0f)) {
+            ExpressionTreeNode *tmp = node.left;
+            replaceNode(node, ExpressionTreeNode{ { ExprOpType::NEG } });
+            node.setLeft(tmp);
+            return rewritten(node);
+        }
+
+        // a + -b = a - b    a - -b = a + b
+        if (isOpCode(node, { ExprOpType::ADD, ExprOpType::SUB }) && node.right->op.type == ExprOpType::NEG) {
+            node.op = node.op.type == ExprOpType::ADD ? ExprOpType::SUB : ExprOpType::ADD;
+            replaceNode(*node.right, *node.right->left);
+            return rewritten(node);
+        }
+
+        // -a + b = b - a
+        if (node.op.type == ExprOpType::ADD && node.left->op.type == ExprOpType::NEG) {
+            node.op = ExprOpType::SUB;
+            replaceNode(*node.left, *node.left->left);
+            std::swap(node.left, node.right);
+            return rewritten(node);
+        }
+
+        // -(a - b) = b - a
+        if (node.op.type == ExprOpType::NEG && node.left->op.type == ExprOpType::SUB) {
+            replaceNode(node, *node.left);
+            std::swap(node.left, node.right);
+            return rewritten(node);
+        }
+
+        // x * 2 = x + x
+        if (node.op.type == ExprOpType::MUL && isConstant(*node.right, 2.0f) && (!node.parent || node.parent->op.type != ExprOpType::ADD)) {
+            ExpressionTreeNode *replacement = tree.clone(node.left);
+            node.op = ExprOpType::ADD;
+            replaceNode(*node.right, *replacement);
+            return rewritten(node);
+        }
+
+        // x / y = x * (1 / y)
+        if (node.op.type == ExprOpType::DIV && isConstant(*node.right)) {
+            node.op = ExprOpType::MUL;
+            node.right->op = makeConstant(1.0f / constantValue(*node.right));
+            return rewritten(node);
+        }
+
+        // (1 / x) * y = y / x
+        if (node.op.type == ExprOpType::MUL && node.left->op.type == ExprOpType::DIV && isConstant(*node.left->left, 1.0f)) {
+            node.op = ExprOpType::DIV;
+            replaceNode(*node.left, *node.left->right);
+            std::swap(node.left, node.right);
+            return rewritten(node);
+        }
+
+        // x * (1 / y) = x / y
+        if (node.op.type == ExprOpType::MUL && node.right->op.type == ExprOpType::DIV && isConstant(*node.right->left, 1.0f)) {
+            node.op = ExprOpType::DIV;
+            replaceNode(*node.right, *node.right->right);
+            return rewritten(node);
+        }
+
+        // (a / b) * c = (a * c) / b
+        if (node.op.type == ExprOpType::MUL && node.left->op.type == ExprOpType::DIV && node.right->isFloat) {
+            node.op = ExprOpType::DIV;
+            node.left->op = ExprOpType::MUL;
+            swapNodeContents(*node.left->right, *node.right);
+            return rewritten(node);
+        }
+
+        // a * (b / c) = (a * b) / c
+        if (node.op.type == ExprOpType::MUL && node.right->op.type == ExprOpType::DIV && node.left->isFloat) {
+            node.op = ExprOpType::DIV;
+            node.right->op = ExprOpType::MUL;
+            std::swap(node.left, node.right); // (b * c) / a
+            swapNodeContents(*node.left->left, *node.left->right); // (c * b) / a
+            swapNodeContents(*node.left->left, *node.right); // (a * b) / c
+            return rewritten(node);
+        }
+
+        // a / (b / c) = (a * c) / b
+        if (node.op.type == ExprOpType::DIV && node.right->op.type == ExprOpType::DIV && node.left->isFloat) {
+            node.right->op = ExprOpType::MUL; // a / (b * c)
+            std::swap(node.left, node.right); // (b * c) / a
+            swapNodeContents(*node.left->left, *node.right); // (a * c) / b
+            return rewritten(node);
+        }
+
+        // (a / b) / c = a / (b * c)
+        if (node.op.type == ExprOpType::DIV && node.left->op.type == ExprOpType::DIV && node.right->isFloat) {
+            node.left->op = ExprOpType::MUL; // (a * b) / c
+            std::swap(node.left, node.right); // c / (a * b)
+            swapNodeContents(*node.left, *node.right->left); // a / (c * b)
+            swapNodeContents(*node.right->left, *node.right->right); // a / (b * c)
+            return rewritten(node);
+        }
+
+        // The remaining rewrites replace pow by integer multiplication when
+        // the base is an integer, which could overflow.
+        if (node.op.type != ExprOpType::POW || !isConstant(*node.right) || !node.left->isFloat)
+            return;
+        const float exponent = constantValue(*node.right);
+
+        // x ** (n / 2) = sqrt(x ** n)
+        if (!isInteger(exponent) && isInteger(exponent * 2.0f)) {
+            ExpressionTreeNode *dup = tree.clone(&node);
+            replaceNode(node, ExpressionTreeNode{ ExprOpType::SQRT });
+            node.setLeft(dup);
+            node.left->right->op = makeConstant(exponent * 2.0f);
+            return rewritten(node);
+        }
+
+        // x ** -N = 1 / (x ** N)
+        else if (isInteger(exponent) && exponent < 0) {
+            ExpressionTreeNode *dup = tree.clone(&node);
+            replaceNode(node, ExpressionTreeNode{ ExprOpType::DIV });
+            node.setLeft(tree.makeNode({ ExprOpType::CONSTANTI, 1 }));
+            node.setRight(dup);
+            node.right->right->op = makeConstant(-exponent);
+            return rewritten(node);
+        }
+
+        // x ** N = x * x * x * ...
+        else if (isInteger(exponent) && exponent > 0 && exponent <= 64) {
+            ExpressionTreeNode *replacement = emitIntegerPow(tree, *node.left, static_cast<int>(exponent));
+            replaceNode(node, *replacement);
+            return rewritten(node);
+        }
+    });
+
+    return changed;
+}
+
+bool applyOpFusion(ExpressionTree &tree)
+{
+    std::unordered_map<int, size_t> refCount;
+    std::unordered_set<const ExpressionTreeNode *> modified;
+    bool changed = false;
+    auto rewritten = [&](const ExpressionTreeNode &node) { modified.insert(&node); changed = true; };
+
+    applyValueNumbering(tree);
+
+    tree.getRoot()->postorder([&](ExpressionTreeNode &node)
+    {
+        if (node.op.type == ExprOpType::MUX)
+            return;
+
+        refCount[node.valueNum]++;
+    });
+
+    tree.getRoot()->postorder([&](ExpressionTreeNode &node)
+    {
+        if ((node.left && modified.count(node.left)) || (node.right && modified.count(node.right)))
+            return void(modified.insert(&node));
+        if (node.op.type == ExprOpType::MUX || !node.isFloat)
+            return;
+
+        auto canElide = [&](ExpressionTreeNode &candidate)
+        {
+            return candidate.isFloat && (refCount[node.valueNum] > 1 || refCount[candidate.valueNum] <= 1);
+        };
+
+        // a + (b * c)    (b * c) + a    a - (b * c)    (b * c) - a
+        if (node.op.type == ExprOpType::ADD && node.right->op.type == ExprOpType::MUL && canElide(*node.right)) {
+            node.right->op = ExprOpType::MUX;
+            node.op = { ExprOpType::FMA, static_cast<unsigned>(FMAType::FMADD) };
+            return rewritten(node);
+        }
+        if (node.op.type == ExprOpType::ADD && node.left->op.type == ExprOpType::MUL && canElide(*node.left)) {
+            std::swap(node.left, node.right);
+            node.right->op = ExprOpType::MUX;
+            node.op = { ExprOpType::FMA, static_cast<unsigned>(FMAType::FMADD) };
+            return rewritten(node);
+        }
+        if (node.op.type == ExprOpType::SUB && node.right->op.type == ExprOpType::MUL && canElide(*node.right)) {
+            node.right->op = ExprOpType::MUX;
+            node.op = { ExprOpType::FMA, static_cast<unsigned>(FMAType::FNMADD) };
+            return rewritten(node);
+        }
+        if (node.op.type == ExprOpType::SUB && node.left->op.type == ExprOpType::MUL && canElide(*node.left)) {
+            std::swap(node.left, node.right);
+            node.right->op = ExprOpType::MUX;
+            node.op = { ExprOpType::FMA, static_cast<unsigned>(FMAType::FMSUB) };
+            return rewritten(node);
+        }
+
+        // (a + b) * c = (a * c) + b * c
+        if (node.op.type == ExprOpType::MUL && isOpCode(*node.left, { ExprOpType::ADD, ExprOpType::SUB }) &&
+            isConstant(*node.right) && isConstant(*node.left->right) && canElide(*node.left))
+        {
+            std::swap(node.op, node.left->op);
+            swapNodeContents(*node.right, *node.left->right);
+            node.right->op = makeConstant(constantValue(*node.right) * constantValue(*node.left->right));
+            return rewritten(node);
+        }
+
+        // Negative FMA.
+        if (node.op.type == ExprOpType::NEG && node.left->op.type == ExprOpType::FMA && canElide(*node.left)) {
+            replaceNode(node, *node.left);
+
+            switch (static_cast<FMAType>(node.op.imm.u)) {
+            case FMAType::FMADD: node.op.imm.u = static_cast<unsigned>(FMAType::FNMSUB); break;
+            case FMAType::FMSUB: node.op.imm.u = static_cast<unsigned>(FMAType::FNMADD); break;
+            case FMAType::FNMADD: node.op.imm.u = static_cast<unsigned>(FMAType::FMSUB); break;
+            case FMAType::FNMSUB: node.op.imm.u = static_cast<unsigned>(FMAType::FMADD); break;
+            }
+
+            return rewritten(node);
+        }
+    });
+
+    return changed;
+}
+
+// Converts a validated program into a tree. Returns nullptr if duplicated
+// values would make the tree unreasonably large.
+ExpressionTreeNode *buildExpressionTree(ExpressionTree &tree, const std::vector<ExprOp> &ops)
+{
+    constexpr size_t maxNodes = 1 << 16;
+    std::vector<ExpressionTreeNode *> stack;
+    std::map<int, ExpressionTreeNode *> vars;
+
+    auto pop = [&]() {
+        ExpressionTreeNode *node = stack.back();
+        stack.pop_back();
+        return node;
+    };
+
+    for (const auto &op: ops) {
+        if (tree.size() > maxNodes)
+            return nullptr;
+
+        switch (op.type) {
+        case ExprOpType::DUP:
+            stack.push_back(tree.clone(stack[stack.size() - 1 - op.imm.u]));
+            break;
+        case ExprOpType::SWAP:
+            std::swap(stack[stack.size() - 1], stack[stack.size() - 1 - op.imm.u]);
+            break;
+        case ExprOpType::DROP:
+            stack.resize(stack.size() - op.imm.u);
+            break;
+        case ExprOpType::SORT: {
+            auto at = [&stack](int i) -> ExpressionTreeNode *& { return stack.at(stack.size() - 1 - i); };
+            for (auto cmp: buildSortNet(op.imm.u)) {
+                ExpressionTreeNode *a = at(cmp.first), *b = at(cmp.second);
+                ExpressionTreeNode *min = tree.makeNode(ExprOpType::MIN), *max = tree.makeNode(ExprOpType::MAX);
+                min->setLeft(a);
+                min->setRight(b);
+                max->setLeft(tree.clone(a));
+                max->setRight(tree.clone(b));
+                at(cmp.first) = min;
+                at(cmp.second) = max;
+            }
+            break;
+        }
+        case ExprOpType::VAR_STORE:
+            vars[op.imm.i] = pop();
+            break;
+        case ExprOpType::VAR_LOAD:
+            stack.push_back(tree.clone(vars.at(op.imm.i)));
+            break;
+        case ExprOpType::TERNARY:
+        case ExprOpType::CLAMP: {
+            ExpressionTreeNode *mux = tree.makeNode(ExprOpType::MUX);
+            mux->setRight(pop());
+            mux->setLeft(pop());
+            ExpressionTreeNode *node = tree.makeNode(op);
+            node->setLeft(pop());
+            node->setRight(mux);
+            stack.push_back(node);
+            break;
+        }
+        default: {
+            ExpressionTreeNode *node = tree.makeNode(op);
+            if (numOperands[static_cast<size_t>(op.type)] == 2)
+                node->setRight(pop());
+            if (numOperands[static_cast<size_t>(op.type)] >= 1)
+                node->setLeft(pop());
+            stack.push_back(node);
+            break;
+        }
+        }
+    }
+
+    return stack.back();
+}
+
+// Runs the legacy optimization pipeline. Returns false if the program was
+// too large to be converted into a tree.
+bool optimizeExpressionTree(ExpressionTree &tree, const std::vector<ExprOp> &ops)
+{
+    ExpressionTreeNode *root = buildExpressionTree(tree, ops);
+    if (!root)
+        return false;
+    tree.setRoot(root);
+
+    // Guard against rewrites undoing each other.
+    constexpr int maxIterations = 256;
+    for (int i = 0; i < maxIterations && (applyLocalOptimizations(tree) || applyAlgebraicOptimizations(tree) || applyComparisonOptimizations(tree)); i++) {
+        // ...
+    }
+
+    for (int i = 0; i < maxIterations && (applyAlgebraicCleanup(tree) || applyStrengthReduction(tree) || applyOpFusion(tree)); i++) {
+        // ...
+    }
+
+    applyValueNumbering(tree);
+    return true;
+}
+
+// How often a value changes within one call of the routine.
+enum class Variance {
+    Frame = 0, // constants, N, width, height and frame properties
+    Row = 1,   // depends on Y
+    Pixel = 2,
+    LAST = 3,
+};
+
+Variance leafVariance(const ExpressionTreeNode &node)
+{
+    switch (node.op.type) {
+    case ExprOpType::MEM_LOAD:
+    case ExprOpType::CONVOLUTION:
+        return Variance::Pixel;
+    case ExprOpType::CONST_LOAD:
+        if (node.op.imm.i == static_cast<int>(LoadConstType::X))
+            return Variance::Pixel;
+        if (node.op.imm.i == static_cast<int>(LoadConstType::Y))
+            return Variance::Row;
+        return Variance::Frame;
+    default:
+        return Variance::Frame;
+    }
+}
+
+// Converts the tree back into postfix form, as one program per Variance.
+// Each value that is not a leaf is computed in the program of its variance
+// and passed to later ones in a variable, so that the pixel loop only
+// computes what changes per pixel. Values used more than once are likewise
+// computed once and kept in variables. New variables are numbered from
+// firstVar.
+std::array<std::vector<ExprOp>, static_cast<size_t>(Variance::LAST)> emitExpressionTree(ExpressionTree &tree, int &firstVar)
+{
+    std::array<std::vector<ExprOp>, static_cast<size_t>(Variance::LAST)> ops;
+    std::unordered_map<int, size_t> refCount;
+    std::unordered_map<int, Variance> variance;
+    std::unordered_map<int, int> vars;
+
+    tree.getRoot()->postorder([&](ExpressionTreeNode &node)
+    {
+        refCount[node.valueNum]++;
+        Variance v = node.left ? Variance::Frame : leafVariance(node);
+        if (node.left)
+            v = std::max(v, variance.at(node.left->valueNum));
+        if (node.right)
+            v = std::max(v, variance.at(node.right->valueNum));
+        variance[node.valueNum] = v;
+    });
+
+    auto store = [&](std::vector<ExprOp> &out, int valueNum) {
+        int id = firstVar++;
+        vars[valueNum] = id;
+        out.push_back({ ExprOpType::VAR_STORE, id, "$" + std::to_string(id) });
+    };
+    auto load = [](std::vector<ExprOp> &out, int id) {
+        out.push_back({ ExprOpType::VAR_LOAD, id, "$" + std::to_string(id) });
+    };
+
+    // Both leave the value on the stack of the program of the given variance.
+    std::function<void(const ExpressionTreeNode &, Variance)> emit;
+    auto compute = [&](const ExpressionTreeNode &node, Variance level) {
+        if (node.left)
+            emit(*node.left, level);
+        if (node.right)
+            emit(*node.right, level);
+        if (node.op.type != ExprOpType::MUX)
+            ops[static_cast<size_t>(level)].push_back(node.op);
+    };
+    emit = [&](const ExpressionTreeNode &node, Variance level) {
+        std::vector<ExprOp> &out = ops[static_cast<size_t>(level)];
+        auto it = vars.find(node.valueNum);
+        if (it != vars.end())
+            return load(out, it->second);
+
+        const Variance v = variance.at(node.valueNum);
+        if (v < level && node.left && node.op.type != ExprOpType::MUX) {
+            compute(node, v);
+            store(ops[static_cast<size_t>(v)], node.valueNum);
+            return load(out, vars.at(node.valueNum));
+        }
+
+        compute(node, level);
+        // Shared leaves are only kept in variables in the pixel loop, as
+        // they are otherwise emitted wherever they are used.
+        if (refCount[node.valueNum] > 1 && !isConstant(node) && node.op.type != ExprOpType::MUX &&
+            (node.left || level == Variance::Pixel)) {
+            store(out, node.valueNum);
+            load(out, vars.at(node.valueNum));
+        }
+    };
+    emit(*tree.getRoot(), Variance::Pixel);
+    return ops;
+}
+
+// Token representation of a decoded operator, used for diagnostics.
+std::string exprOpToString(const ExprOp &op, const std::vector<Compiled::PropAccess> &pa)
+{
+    auto clipName = [](int i) { return clipNamePrefix + std::to_string(i); };
+    static const char *const cmpNames[] = { "=", "<", "<=", "?", "!=", ">=", ">" };
+    static const char *const fmaNames[] = { "fmadd", "fmsub", "fnmadd", "fnmsub" };
+    std::stringstream ss;
+
+    switch (op.type) {
+    case ExprOpType::MEM_LOAD:
+        ss << clipName(op.imm.i);
+        if (op.x || op.y)
+            ss << '[' << op.x << ',' << op.y << ']' << (op.bc == BoundaryCondition::Mirrored ? ":m" : ":c");
+        break;
+    case ExprOpType::MEM_LOAD_VAR: ss << clipName(op.imm.i) << "[]"; break;
+    case ExprOpType::CONVOLUTION:
+        ss << clipName(op.imm.i) << "[conv:" << op.name << ']' << (op.bc == BoundaryCondition::Mirrored ? ":m" : ":c");
+        break;
+    case ExprOpType::CONSTANTI: ss << op.imm.i; break;
+    case ExprOpType::CONSTANTF: ss.precision(9); ss << op.imm.f; break;
+    case ExprOpType::CONST_LOAD: {
+        static const char *const names[] = { "N", "X", "Y", "width", "height" };
+        const int last = static_cast<int>(LoadConstType::LAST);
+        if (op.imm.i < last)
+            ss << names[op.imm.i];
+        else if (op.imm.i - last < static_cast<int>(pa.size()))
+            ss << clipName(pa[op.imm.i - last].clip) << '.' << op.name;
+        else
+            ss << clipName(op.imm.i - last) << '.' << op.name;
+        break;
+    }
+    case ExprOpType::VAR_LOAD: ss << op.name << '@'; break;
+    case ExprOpType::VAR_STORE: ss << op.name << '!'; break;
+    case ExprOpType::ADD: ss << '+'; break;
+    case ExprOpType::SUB: ss << '-'; break;
+    case ExprOpType::MUL: ss << '*'; break;
+    case ExprOpType::DIV: ss << '/'; break;
+    case ExprOpType::MOD: ss << '%'; break;
+    case ExprOpType::SQRT: ss << "sqrt"; break;
+    case ExprOpType::ABS: ss << "abs"; break;
+    case ExprOpType::MAX: ss << "max"; break;
+    case ExprOpType::MIN: ss << "min"; break;
+    case ExprOpType::CLAMP: ss << "clamp"; break;
+    case ExprOpType::CMP: ss << cmpNames[op.imm.u]; break;
+    case ExprOpType::TRUNC: ss << "trunc"; break;
+    case ExprOpType::ROUND: ss << "round"; break;
+    case ExprOpType::FLOOR: ss << "floor"; break;
+    case ExprOpType::AND: ss << "and"; break;
+    case ExprOpType::OR: ss << "or"; break;
+    case ExprOpType::XOR: ss << "xor"; break;
+    case ExprOpType::NOT: ss << "not"; break;
+    case ExprOpType::BITAND: ss << "bitand"; break;
+    case ExprOpType::BITOR: ss << "bitor"; break;
+    case ExprOpType::BITXOR: ss << "bitxor"; break;
+    case ExprOpType::BITNOT: ss << "bitnot"; break;
+    case ExprOpType::EXP: ss << "exp"; break;
+    case ExprOpType::LOG: ss << "log"; break;
+    case ExprOpType::POW: ss << "pow"; break;
+    case ExprOpType::SIN: ss << "sin"; break;
+    case ExprOpType::COS: ss << "cos"; break;
+    case ExprOpType::TERNARY: ss << '?'; break;
+    case ExprOpType::SORT: ss << "sort" << op.imm.u; break;
+    case ExprOpType::DUP: ss << "dup" << op.imm.u; break;
+    case ExprOpType::SWAP: ss << "swap" << op.imm.u; break;
+    case ExprOpType::DROP: ss << "drop" << op.imm.u; break;
+    case ExprOpType::ARGMIN: ss << "argmin" << op.imm.u; break;
+    case ExprOpType::ARGMAX: ss << "argmax" << op.imm.u; break;
+    case ExprOpType::ARGSORT: ss << "argsort" << op.imm.u; break;
+    case ExprOpType::NEG: ss << "neg"; break;
+    case ExprOpType::FMA: ss << fmaNames[op.imm.u]; break;
+    case ExprOpType::MUX: ss << "mux"; break;
+    }
+    return ss.str();
+}
+
+// Each source row is loaded as the vectors left of, at and right of the
+// current one, and every horizontal tap is a permute of two of them, instead
+// of one unaligned load per tap. Separable kernels sum the rows first, so
+// that only the horizontal taps are permuted.
+template<int lanes>
+typename Compiler<lanes>::Value Compiler<lanes>::buildConvolution(State &state, const ExprOp &op)
+{
+    using namespace rr;
+
+    const ConvolutionKernel kernel(op.name);
+    const int rx = kernel.width / 2, ry = kernel.height / 2;
+    const VSVideoFormat format = ctx.vi[op.imm.i].format;
+    const int size = format.bytesPerSample;
+    const bool mirrored = op.bc == BoundaryCondition::Mirrored;
+    Pointer<Byte> base = state.wptrs[state.base + op.imm.i + 1];
+    Int stride = state.strides[state.base + op.imm.i + 1];
+    // Only the vector at the current position when there are no horizontal taps.
+    const int numVectors = rx ? 3 : 1, centre = rx ? 1 : 0;
+
+    auto row = [&](int dy) -> Int {
+        if (dy == 0 || state.interior)
+            return state.y + dy;
+        Int y = state.y + dy;
+        if (mirrored)
+            y = Min(Max(y, -1 - y), 2 * state.height - 1 - Max(y, -1 - y));
+        return Clamp(y, 0, state.height - 1);
+    };
+    // Byte offsets of the pixels of the vector at x + dx, with the boundary
+    // condition applied.
+    auto columns = [&](int dx) -> IntV {
+        IntV x = state.xvec + IntV(state.x + dx);
+        if (mirrored) {
+            x = Max(x, IntV(-1) - x);
+            x = Min(x, IntV(2 * state.width - 1) - x);
+        }
+        return Min(Max(x, IntV(0)), IntV(state.width - 1)) * IntV(size);
+    };
+
+    auto run = [&](auto zero) -> Value {
+        using V = decltype(zero);
+        // Integer accumulation is only chosen for integer clips.
+        auto convert = [](auto v) -> V { return V(v); };
+        auto load = [&](Pointer<Byte> p) -> V {
+            if (format.sampleType == stInteger) {
+                if (size == 1)
+                    return convert(IntV(*Pointer<ByteV>(p, alignment(sizeof(uint8_t)))));
+                else if (size == 2)
+                    return convert(IntV(*Pointer<UShortV>(p, alignment(sizeof(uint16_t)))));
+                return convert(IntV(*Pointer<IntV>(p, alignment(sizeof(uint32_t)))));
+            }
+            if (size == 2)
+                return convert(FP16To32(*Pointer<UShortV>(p, alignment(sizeof(uint16_t)))));
+            return convert(FloatV(*Pointer<FloatV>(p, alignment(sizeof(float)))));
+        };
+        auto gather = [&](Pointer<Byte> p, IntV offsets) -> V {
+            if (format.sampleType == stInteger) {
+                if (size == 1)
+                    return convert(IntV(Gather(Pointer<Byte>(p), offsets, IntV(~0), sizeof(uint8_t))));
+                else if (size == 2)
+                    return convert(IntV(Gather(Pointer<UShort>(p), offsets, IntV(~0), sizeof(uint16_t))));
+                return convert(IntV(Gather(Pointer<Int>(p), offsets, IntV(~0), sizeof(uint32_t))));
+            }
+            if (size == 2)
+                return convert(FP16To32(Gather(Pointer<UShort>(p), offsets, IntV(~0), sizeof(uint16_t))));
+            return convert(FloatV(Gather(Pointer<Float>(p), offsets, IntV(~0), sizeof(float))));
+        };
+
+        // Vectors of the source rows. Only those next to the left and right
+        // edges need the boundary condition on each lane; the rest are
+        // aligned loads.
+        std::vector<V> vectors(kernel.height * numVectors);
+        auto loadRows = [&] {
+            for (int dy = -ry; dy <= ry; dy++) {
+                Pointer<Byte> p = base + row(dy) * stride + state.x * size;
+                for (int k = 0; k < numVectors; k++)
+                    vectors[(dy + ry) * numVectors + k] = load(p + (k - centre) * lanes * size);
+            }
+        };
+        if (state.interior) {
+            loadRows();
+        } else {
+            If(state.x >= lanes && state.x + 2 * lanes <= state.width) {
+                loadRows();
+            } Else {
+                for (int dy = -ry; dy <= ry; dy++) {
+                    Pointer<Byte> p = base + row(dy) * stride;
+                    for (int k = 0; k < numVectors; k++)
+                        vectors[(dy + ry) * numVectors + k] = gather(p, columns((k - centre) * lanes));
+                }
+            }
+        }
+
+        auto weight = [](float w) -> V {
+            if constexpr (std::is_same_v<V, IntV>)
+                return IntV(static_cast<int>(w));
+            else
+                return FloatV(w);
+        };
+        bool empty = true;
+        V sum = zero;
+        auto accumulate = [&](float w, V v) {
+            if (w == 0)
+                return;
+            if (w != 1)
+                v = v * weight(w);
+            if (empty)
+                sum = v;
+            else
+                sum = sum + v;
+            empty = false;
+        };
+        // Pixels at x + dx, from the vectors of one row.
+        auto shift = [&](const V *row, int dx) -> V {
+            if (dx == 0)
+                return row[centre];
+            int select[lanes];
+            for (int i = 0; i < lanes; i++)
+                select[i] = dx < 0 ? lanes + dx + i : dx + i;
+            const V &lhs = row[dx < 0 ? 0 : 1], &rhs = row[dx < 0 ? 1 : 2];
+            return RValue<V>(Nucleus::createShuffleVector(lhs.loadValue(), rhs.loadValue(), select));
+        };
+
+        if (kernel.separable()) {
+            std::vector<V> columnSums(numVectors);
+            for (int k = 0; k < numVectors; k++) {
+                empty = true;
+                for (int dy = -ry; dy <= ry; dy++)
+                    accumulate(kernel.v[dy + ry], vectors[(dy + ry) * numVectors + k]);
+                columnSums[k] = empty ? zero : sum;
+            }
+            empty = true;
+            for (int dx = -rx; dx <= rx; dx++)
+                accumulate(kernel.h[dx + rx], shift(columnSums.data(), dx));
+        } else {
+            for (int dy = -ry; dy <= ry; dy++)
+                for (int dx = -rx; dx <= rx; dx++)
+                    accumulate(kernel.at(dx, dy), shift(vectors.data() + (dy + ry) * numVectors, dx));
+        }
+        return empty ? Value(zero) : Value(sum);
+    };
+
+    if (format.sampleType == stInteger && !ctx.forceFloat() && kernel.integral())
+        return run(IntV(0));
+    return run(FloatV(0.0f));
+}
+
+template<int lanes>
+typename Compiler<lanes>::Value Compiler<lanes>::buildOneIter(const Helper &helpers, State &state, const Program &prog)
+{
+    std::vector<Value> stack;
+    buildOps(helpers, state, prog.ops, stack);
+
+    if (stack.empty())
+        throw std::runtime_error("empty expression: " + prog.expr);
+    if (stack.size() > 1)
+        throw std::runtime_error(std::to_string(stack.size()) + " unconsumed values on stack: " + prog.expr);
+
+    return stack.back();
+}
+
+template<int lanes>
+void Compiler<lanes>::buildOps(const Helper &helpers, State &state, const std::vector<ExprOp> &ops, std::vector<Value> &stack)
+{
+    using namespace rr;
+
+    for (const ExprOp &op: ops) {
+        auto tok = [&] { return exprOpToString(op, ctx.pa); };
+
+        // Check validity.
+        if ((op.type == ExprOpType::MEM_LOAD || op.type == ExprOpType::CONVOLUTION) && op.imm.i >= ctx.numInputs)
+            throw std::runtime_error("reference to undefined clip: " + tok());
+        if ((op.type == ExprOpType::DUP || op.type == ExprOpType::SWAP) && op.imm.u >= stack.size())
+            throw std::runtime_error("insufficient values on stack: " + tok());
+        if ((op.type == ExprOpType::DROP || op.type == ExprOpType::SORT) && op.imm.u > stack.size())
+            throw std::runtime_error("insufficient values on stack: " + tok());
+        if (stack.size() < numOperands[static_cast<size_t>(op.type)])
+            throw std::runtime_error("insufficient values on stack: " + tok());
+
+#define OUT(x) stack.push_back(x)
+        switch (op.type) {
+        case ExprOpType::DUP:
+            stack.push_back(stack[stack.size() - 1 - op.imm.u]);
             break;
         case ExprOpType::SWAP: {
             std::swap(stack[stack.size()-1], stack[stack.size() - 1 - op.imm.u]);
@@ -873,12 +3629,21 @@ void Compiler<lanes>::buildOneIter(const Helper &helpers, State &state)
         }
 
         case ExprOpType::MEM_LOAD: {
-            Pointer<Byte> p = state.wptrs[op.imm.i + 1];
-            const VSVideoFormat format = ctx.vi[op.imm.i]->format;
+            const auto key = std::make_tuple(state.base + op.imm.i + 1, state.column * lanes + op.x, state.row + op.y, static_cast<int>(op.bc));
+            auto loaded = state.loads.find(key);
+            if (loaded != state.loads.end()) {
+                OUT(loaded->second);
+                break;
+            }
+            Pointer<Byte> p = state.wptrs[state.base + op.imm.i + 1];
+            const VSVideoFormat format = ctx.vi[op.imm.i].format;
             const bool unaligned = op.x != 0;
             Int y = state.y, x = state.x;
             IntV offsets = 0;
-            if (op.bc == BoundaryCondition::Clamped) {
+            if (state.interior) {
+                y = state.y + op.y;
+                x = state.x + op.x;
+            } else if (op.bc == BoundaryCondition::Clamped) {
                 if (op.y != 0)
                     y = Clamp(state.y + op.y, 0, state.height-1);
                 if (op.x != 0)
@@ -902,27 +3667,28 @@ void Compiler<lanes>::buildOneIter(const Helper &helpers, State &state)
                     x = 0;
                 }
             }
-            p += y * state.strides[op.imm.i + 1] + x * format.bytesPerSample;
-            const bool regularLoad = op.bc != BoundaryCondition::Mirrored || op.x == 0;
+            p += y * state.strides[state.base + op.imm.i + 1] + x * format.bytesPerSample;
+            const bool regularLoad = state.interior || op.bc != BoundaryCondition::Mirrored || op.x == 0;
             if (format.sampleType == stInteger) {
                 IntV v;
                 if (format.bytesPerSample == 1) {
                     if (regularLoad)
-                        v = IntV(*Pointer<ByteV>(p, (unaligned ? 1:lanes)*sizeof(uint8_t)));
+                        v = IntV(*Pointer<ByteV>(p, unaligned ? 1 : alignment(sizeof(uint8_t))));
                     else
                         v = IntV(Gather(Pointer<Byte>(p), offsets, IntV(~0), sizeof(uint8_t)));
                 } else if (format.bytesPerSample == 2) {
                     if (regularLoad)
-                        v = IntV(*Pointer<UShortV>(p, (unaligned ? 1:lanes)*sizeof(uint16_t)));
+                        v = IntV(*Pointer<UShortV>(p, unaligned ? 1 : alignment(sizeof(uint16_t))));
                     else
                         v = IntV(Gather(Pointer<UShort>(p), offsets, IntV(~0), sizeof(uint16_t)));
                 } else if (format.bytesPerSample == 4) {
                     if (regularLoad)
-                        v = IntV(*Pointer<IntV>(p, (unaligned ? 1:lanes)*sizeof(uint32_t)));
+                        v = IntV(*Pointer<IntV>(p, unaligned ? 1 : alignment(sizeof(uint32_t))));
                     else
                         v = IntV(Gather(Pointer<Int>(p), offsets, IntV(~0), sizeof(uint32_t)));
                 }
-                v = relativeAccessAdjust<lanes>(x, state.x, state.width, op, v);
+                if (!state.interior)
+                    v = relativeAccessAdjust<lanes>(x, state.x, state.width, op, v);
                 if (ctx.forceFloat())
                     OUT(FloatV(v));
                 else
@@ -932,26 +3698,31 @@ void Compiler<lanes>::buildOneIter(const Helper &helpers, State &state)
                 if (format.bytesPerSample == 2) {
                     UShortV vi;
                     if (regularLoad)
-                        vi = *Pointer<UShortV>(p, (unaligned ? 1:lanes)*sizeof(uint16_t));
+                        vi = *Pointer<UShortV>(p, unaligned ? 1 : alignment(sizeof(uint16_t)));
                     else
                         vi = Gather(Pointer<UShort>(p), offsets, IntV(~0), sizeof(uint16_t));
                     v = FP16To32(vi);
                 } else if (format.bytesPerSample == 4) {
                     if (regularLoad)
-                        v = *Pointer<FloatV>(p, (unaligned ? 1:lanes)*sizeof(float));
+                        v = *Pointer<FloatV>(p, unaligned ? 1 : alignment(sizeof(float)));
                     else
                         v = Gather(Pointer<Float>(p), offsets, IntV(~0), sizeof(float));
                 }
-                v = relativeAccessAdjust<lanes>(x, state.x, state.width, op, v);
+                if (!state.interior)
+                    v = relativeAccessAdjust<lanes>(x, state.x, state.width, op, v);
                 OUT(v);
             }
+            state.loads.emplace(key, stack.back());
             break;
         }
+        case ExprOpType::CONVOLUTION:
+            OUT(buildConvolution(state, op));
+            break;
         case ExprOpType::CONSTANTI:
             OUT((int)op.imm.i);
             break;
         case ExprOpType::CONSTANTF:
-            if (op.imm.f == (float)(int)op.imm.f)
+            if (isIntConstant(op.imm.f))
                 OUT((int)op.imm.f);
             else
                 OUT(op.imm.f);
@@ -1032,9 +3803,9 @@ void Compiler<lanes>::buildOneIter(const Helper &helpers, State &state)
         case ExprOpType::MEM_LOAD_VAR: {
             LOAD2(absx_, absy_);
 
-            const VSVideoFormat format = ctx.vi[op.imm.i]->format;
-            Pointer<Byte> p = state.wptrs[op.imm.i + 1];
-            IntV stride = state.strides[op.imm.i + 1], size = format.bytesPerSample;
+            const VSVideoFormat format = ctx.vi[op.imm.i].format;
+            Pointer<Byte> p = state.wptrs[state.base + op.imm.i + 1];
+            IntV stride = state.strides[state.base + op.imm.i + 1], size = format.bytesPerSample;
             IntV absx = Min(Max(absx_.ensureInt(), IntV(0)), IntV(state.width-1));
             IntV absy = Min(Max(absy_.ensureInt(), IntV(0)), IntV(state.height-1));
             IntV offsets = absy * stride + absx * size;
@@ -1177,6 +3948,29 @@ void Compiler<lanes>::buildOneIter(const Helper &helpers, State &state)
                 OUT((t.i() & ci) | (f.i() & ~ci));
             break;
         }
+
+        case ExprOpType::NEG: {
+            LOAD1(x);
+            if (x.isFloat())
+                OUT(-x.f());
+            else
+                OUT(-x.i());
+            break;
+        }
+        case ExprOpType::FMA: {
+            LOAD2(b, c);
+            LOAD1(a);
+            FloatV af = a.ensureFloat(), bf = b.ensureFloat(), cf = c.ensureFloat();
+            // Without hardware support llvm.fma is a library call.
+            static const bool hasFMA = targetHas("fma");
+            FMAType type = static_cast<FMAType>(op.imm.u);
+            if (type == FMAType::FNMADD || type == FMAType::FNMSUB)
+                bf = -bf;
+            if (type == FMAType::FMSUB || type == FMAType::FNMSUB)
+                af = -af;
+            OUT(hasFMA ? FMA(bf, cf, af) : bf * cf + af);
+            break;
+        }
 #undef BITWISEOP
 #undef LOGICOP
 #undef UNARYOPF
@@ -1191,78 +3985,156 @@ void Compiler<lanes>::buildOneIter(const Helper &helpers, State &state)
         case ExprOpType::ARGMIN:
         case ExprOpType::ARGMAX:
         case ExprOpType::ARGSORT:
+        case ExprOpType::MUX:
             assert(0 && "shouldn't happen");
             break;
         } // switch
     }
+}
 
-    if (stack.empty())
-        throw std::runtime_error("empty expression: " + ctx.expr);
-    if (stack.size() > 1)
-        throw std::runtime_error(std::to_string(stack.size()) + " unconsumed values on stack: " + ctx.expr);
+// Converts a result to the value stored in an integer output format.
+template<int lanes>
+typename Compiler<lanes>::IntV Compiler<lanes>::buildRound(Value res)
+{
+    using namespace rr;
+    auto format = ctx.vo.format;
+    const int maxval = (1<<format.bitsPerSample) - 1;
+    if (res.isFloat()) {
+        FloatV clamped = Min(Max(res.f(), FloatV(0)), FloatV(maxval));
+        return RoundInt(clamped);
+    } else if (format.bitsPerSample < 32)
+        return Min(Max(res.i(), IntV(0)), IntV(maxval));
+    else
+        return res.i();
+}
 
-    auto res = stack.back();
-    auto format = ctx.vo->format;
-    Pointer<Byte> p = state.wptrs[0];
-    p += state.y * state.strides[0] + state.x * format.bytesPerSample;
+template<int lanes>
+void Compiler<lanes>::buildStore(State &state, Value res)
+{
+    using namespace rr;
+    auto format = ctx.vo.format;
+    Pointer<Byte> p = state.wptrs[state.base];
+    p += state.y * state.strides[state.base] + state.x * format.bytesPerSample;
     if (format.sampleType == stInteger) {
-        IntV rounded;
-        const int maxval = (1<<format.bitsPerSample) - 1;
-        if (res.isFloat()) {
-            FloatV clamped = Min(Max(res.f(), FloatV(0)), FloatV(maxval));
-            rounded = RoundInt(clamped);
-        } else if (format.bitsPerSample < 32)
-            rounded = Min(Max(res.i(), IntV(0)), IntV(maxval));
-        else
-            rounded = res.i();
+        IntV rounded = buildRound(res);
         if (format.bytesPerSample == 1)
-            *Pointer<ByteV>(p, lanes*sizeof(uint8_t)) = ByteV(UShortV(rounded));
+            *Pointer<ByteV>(p, alignment(sizeof(uint8_t))) = ByteV(UShortV(rounded));
         else if (format.bytesPerSample == 2)
-            *Pointer<UShortV>(p, lanes*sizeof(uint16_t)) = UShortV(rounded);
+            *Pointer<UShortV>(p, alignment(sizeof(uint16_t))) = UShortV(rounded);
         else if (format.bytesPerSample == 4)
-            *Pointer<IntV>(p, lanes*sizeof(uint32_t)) = rounded;
+            *Pointer<IntV>(p, alignment(sizeof(uint32_t))) = rounded;
     } else if (format.sampleType == stFloat) {
         if (format.bytesPerSample == 2) {
             UShortV vi = FP32To16(res.ensureFloat());
-            *Pointer<UShortV>(p, lanes*sizeof(uint16_t)) = vi;
+            *Pointer<UShortV>(p, alignment(sizeof(uint16_t))) = vi;
         } else if (format.bytesPerSample == 4)
-            *Pointer<FloatV>(p, lanes*sizeof(float)) = res.ensureFloat();
+            *Pointer<FloatV>(p, alignment(sizeof(float))) = res.ensureFloat();
+    }
+}
+
+// Accumulates the values a kernel would store into the statistics of the
+// current row, and into the histogram of all rows. The bins split the range
+// of integer formats, or [0, 1] for float formats, evenly.
+template<int lanes>
+void Compiler<lanes>::buildReduce(State &state, Value res, Reduction &acc)
+{
+    using namespace rr;
+    auto format = ctx.vo.format;
+    // Lanes past the end of the row only cover padding.
+    IntV valid = IntV(~0);
+    if (!state.interior)
+        valid = CmpLT(state.xvec + IntV(state.x), IntV(state.width));
+    IntV bin;
+    if (format.sampleType == stInteger) {
+        IntV v = buildRound(res) & valid;
+        acc.isum = acc.isum + v;
+        acc.imin = Min(acc.imin, v | (IntV(std::numeric_limits<int>::max()) & ~valid));
+        acc.imax = Max(acc.imax, v);
+        acc.count = acc.count - CmpNEQ(v, IntV(0));
+        bin = (v * IntV(ctx.bins)) >> format.bitsPerSample;
+    } else {
+        FloatV f = res.ensureFloat();
+        if (format.bytesPerSample == 2)
+            f = FP16To32(FP32To16(f));
+        IntV v = As<IntV>(f) & valid;
+        acc.fsum = acc.fsum + As<FloatV>(v);
+        acc.fmin = Min(acc.fmin, As<FloatV>(v | (IntV(infinity) & ~valid)));
+        acc.fmax = Max(acc.fmax, As<FloatV>(v | (IntV(negativeInfinity) & ~valid)));
+        acc.count = acc.count - (CmpNEQ(As<FloatV>(v), FloatV(0)) & valid);
+        // Out of range values go to the outer bins, NaN to the first one.
+        FloatV scaled = Min(Max(As<FloatV>(v) * FloatV(static_cast<float>(ctx.bins)), FloatV(0)), FloatV(static_cast<float>(ctx.bins - 1)));
+        bin = Min(Max(IntV(scaled), IntV(0)), IntV(ctx.bins - 1));
+    }
+    if (ctx.bins > 0) {
+        // Scalar updates, as lanes may hit the same bin.
+        for (int i = 0; i < lanes; i++) {
+            Int b = Extract(bin, i);
+            state.histogram[b] = state.histogram[b] + (Extract(valid, i) & 1);
+        }
+    }
+}
+
+// The helpers the programs call, as a mask of Helper::Use.
+template<int lanes>
+unsigned Compiler<lanes>::usedHelpers() const
+{
+    unsigned used = 0;
+    for (const auto &prog: ctx.programs) {
+        for (const auto *ops: { &prog.ops, &prog.frameOps, &prog.rowOps }) {
+            for (const auto &op: *ops) {
+                switch (op.type) {
+                case ExprOpType::EXP: used |= Helper::useExp; break;
+                case ExprOpType::LOG: used |= Helper::useLog; break;
+                case ExprOpType::SIN: used |= Helper::useSin; break;
+                case ExprOpType::COS: used |= Helper::useCos; break;
+                case ExprOpType::POW: used |= Helper::usePow; break;
+                default: break;
+                }
+            }
+        }
     }
+    return used;
 }
 
+// Emits the used helpers into mod. By default kernels only declare them and
+// call the copies that buildRuntime() compiled once per process, instead of
+// optimizing and generating code for them again in every routine.
 template<int lanes>
-typename Compiler<lanes>::Helper Compiler<lanes>::buildHelpers(rr::Module &mod)
+typename Compiler<lanes>::Helper Compiler<lanes>::buildHelpers(rr::Module &mod, unsigned used, typename Helper::Mode mode)
 {
     Helper h;
-    using ftype = typename Compiler<lanes>::Helper::ftype;
-    using ftype2 = typename Compiler<lanes>::Helper::ftype2;
-    h.Sin = std::make_unique<ftype>(mod, "vsin");
-    h.Sin->setPure();
-    {
+    // Creates the helper, returns whether its body has to be built.
+    auto create = [&](auto &f, unsigned use, const char *name) {
+        using ftype = typename std::remove_reference_t<decltype(f)>::element_type;
+        if (!(used & use))
+            return false;
+        std::string symbol = "akarin_expr_" + std::string(name) + std::to_string(lanes);
+        if (mode == Helper::Declare)
+            f = std::make_unique<ftype>(mod, symbol.c_str(), rr::Module::Declaration{});
+        else
+            f = std::make_unique<ftype>(mod, symbol.c_str());
+        f->setPure();
+        if (mode == Helper::Inline)
+            f->setInline();
+        return mode != Helper::Declare;
+    };
+    if (create(h.Sin, Helper::useSin, "vsin")) {
         FloatV x = h.Sin->template Arg<0>();
         Return(SinCos_(x, true));
     }
-    h.Cos = std::make_unique<ftype>(mod, "vcos");
-    h.Cos->setPure();
-    {
-        FloatV x = h.Sin->template Arg<0>();
+    if (create(h.Cos, Helper::useCos, "vcos")) {
+        FloatV x = h.Cos->template Arg<0>();
         Return(SinCos_(x, false));
     }
-    h.Exp = std::make_unique<ftype>(mod, "vexp");
-    h.Exp->setPure();
-    {
-        FloatV x = h.Sin->template Arg<0>();
+    if (create(h.Exp, Helper::useExp, "vexp")) {
+        FloatV x = h.Exp->template Arg<0>();
         Return(Exp_(x));
     }
-    h.Log = std::make_unique<ftype>(mod, "vlog");
-    h.Log->setPure();
-    {
-        FloatV x = h.Sin->template Arg<0>();
+    if (create(h.Log, Helper::useLog, "vlog")) {
+        FloatV x = h.Log->template Arg<0>();
         Return(Log(x));
     }
-    h.Pow = std::make_unique<ftype2>(mod, "vpow");
-    h.Pow->setPure();
-    {
+    if (create(h.Pow, Helper::usePow, "vpow")) {
         FloatV x = h.Pow->template Arg<0>();
         FloatV y = h.Pow->template Arg<1>();
         Return(BuiltinPow(x, y));
@@ -1271,106 +4143,737 @@ typename Compiler<lanes>::Helper Compiler<lanes>::buildHelpers(rr::Module &mod)
     return h;
 }
 
+// Compiles all helpers into a library once per process and vector width.
+// Cached objects loaded from disk also call into it.
 template<int lanes>
-Compiled Compiler<lanes>::compile()
+void Compiler<lanes>::buildRuntime()
 {
-    if (ctx.cached) {
-        return ctx.getCached();
+    static std::once_flag once;
+    std::call_once(once, [] {
+        rr::Module mod;
+        buildHelpers(mod, Helper::useAll, Helper::Define);
+        mod.acquireLibrary("runtime");
+    });
+}
+
+template<int lanes>
+void Compiler<lanes>::prepare()
+{
+    // Property accesses are shared by all planes, so that each property is
+    // only fetched once per frame. Variables are private to each plane.
+    std::map<std::pair<int, std::string>, int> paMap;
+    for (auto &prog: ctx.programs) {
+        for (size_t i = 0; i < prog.ops.size(); i++) {
+            const std::string &tok = prog.tokens[i];
+            ExprOp &op = prog.ops[i];
+
+            constexpr int last = static_cast<int>(LoadConstType::LAST);
+            if (op.type != ExprOpType::CONST_LOAD || op.imm.i < last) continue;
+
+            int id = op.imm.i - last;
+            if (id >= ctx.numInputs)
+                throw std::runtime_error("reference to undefined clip: " + tok);
+
+            auto key = std::make_pair(id, op.name);
+            auto it = paMap.find(key);
+            if (it == paMap.end())
+                paMap.insert({key, (int)paMap.size()});
+            op.imm.i = last + paMap.at(key);
+        }
+    }
+    ctx.pa.resize(paMap.size());
+    for (const auto &item: paMap) {
+        ctx.pa[item.second] = Compiled::PropAccess{ item.first.first, item.first.second };
     }
 
-    using namespace rr;
-    Module mod;
+    for (auto &prog: ctx.programs) {
+        std::map<std::string, int> varMap;
+        for (size_t i = 0; i < prog.ops.size(); i++) {
+            const std::string &tok = prog.tokens[i];
+            ExprOp &op = prog.ops[i];
+
+            if (op.type != ExprOpType::VAR_LOAD && op.type != ExprOpType::VAR_STORE) continue;
+            auto it = varMap.find(op.name);
+            if (it == varMap.end()) {
+                if (op.type == ExprOpType::VAR_LOAD)
+                    throw std::runtime_error("reference to uninitialized variable: " + tok);
+                varMap.insert({ op.name, (int)varMap.size() });
+            }
+            op.imm.i = ctx.numVars + varMap.at(op.name);
+        }
+        ctx.numVars += static_cast<int>(varMap.size());
+
+        // Check the stack the same way buildOneIter does, so that errors are
+        // reported at filter creation even if code generation is deferred.
+        size_t depth = 0;
+        for (size_t i = 0; i < prog.ops.size(); i++) {
+            const std::string &tok = prog.tokens[i];
+            const ExprOp &op = prog.ops[i];
+
+            if ((op.type == ExprOpType::MEM_LOAD || op.type == ExprOpType::MEM_LOAD_VAR || op.type == ExprOpType::CONVOLUTION) &&
+                op.imm.i >= ctx.numInputs)
+                throw std::runtime_error("reference to undefined clip: " + tok);
+            if ((op.type == ExprOpType::DUP || op.type == ExprOpType::SWAP) && op.imm.u >= depth)
+                throw std::runtime_error("insufficient values on stack: " + tok);
+            if ((op.type == ExprOpType::DROP || op.type == ExprOpType::SORT) && op.imm.u > depth)
+                throw std::runtime_error("insufficient values on stack: " + tok);
+            if (op.type > ExprOpType::LAST)
+                throw std::runtime_error("illegal token: " + tok);
+            if (depth < numOperands[static_cast<size_t>(op.type)])
+                throw std::runtime_error("insufficient values on stack: " + tok);
+
+            if (op.type == ExprOpType::DUP)
+                depth++;
+            else if (op.type == ExprOpType::DROP)
+                depth -= op.imm.u;
+            else if (op.type == ExprOpType::VAR_STORE)
+                depth--;
+            else if (op.type != ExprOpType::SWAP && op.type != ExprOpType::SORT)
+                depth = depth - numOperands[static_cast<size_t>(op.type)] + 1;
+        }
+        if (depth == 0)
+            throw std::runtime_error("empty expression: " + prog.expr);
+        if (depth > 1)
+            throw std::runtime_error(std::to_string(depth) + " unconsumed values on stack: " + prog.expr);
+    }
 
-    std::map<std::pair<int, std::string>, int> paMap;
-    for (size_t i = 0; i < ctx.ops.size(); i++) {
-        const std::string &tok = ctx.tokens[i];
-        ExprOp &op = ctx.ops[i];
+    if (ctx.optimize) {
+        for (auto &prog: ctx.programs)
+            optimize(prog);
+    }
 
-        constexpr int last = static_cast<int>(LoadConstType::LAST);
-        if (op.type != ExprOpType::CONST_LOAD || op.imm.i < last) continue;
+    if (ctx.unroll == 0)
+        ctx.unroll = chooseUnroll();
+}
 
-        int id = op.imm.i - last;
-        if (id >= ctx.numInputs)
-            throw std::runtime_error("reference to undefined clip: " + tok);
+// Estimates the per-pixel cost of the kernel in simple vector operations.
+// Cheap kernels are bound by instruction latency and benefit from having
+// several independent vectors in flight, expensive ones would only spill
+// registers, and helper calls clobber them anyway.
+static bool isTranscendental(const ExprOp &op)
+{
+    switch (op.type) {
+    case ExprOpType::EXP:
+    case ExprOpType::LOG:
+    case ExprOpType::POW:
+    case ExprOpType::SIN:
+    case ExprOpType::COS:
+        return true;
+    default:
+        return false;
+    }
+}
 
-        auto key = std::make_pair(id, op.name);
-        auto it = paMap.find(key);
-        if (it == paMap.end())
-            paMap.insert({key, (int)paMap.size()});
-        op.imm.i = last + paMap.at(key);
+// Rough cost of an operator per vector, in simple instructions.
+static int operatorCost(const ExprOp &op)
+{
+    switch (op.type) {
+    case ExprOpType::CONSTANTI:
+    case ExprOpType::CONSTANTF:
+    case ExprOpType::VAR_LOAD:
+    case ExprOpType::VAR_STORE:
+    case ExprOpType::DUP:
+    case ExprOpType::SWAP:
+    case ExprOpType::DROP:
+        return 0;
+    case ExprOpType::MEM_LOAD:
+        return op.x != 0 && op.bc == BoundaryCondition::Mirrored ? 8 : 1;
+    case ExprOpType::MEM_LOAD_VAR:
+        return 8;
+    case ExprOpType::CONVOLUTION: {
+        ConvolutionKernel kernel(op.name);
+        return kernel.separable() ? 2 * (kernel.width + kernel.height) : 2 * kernel.width * kernel.height;
     }
-    std::vector<Compiled::PropAccess> pa(paMap.size());
-    for (const auto &item: paMap) {
-        pa[item.second] = Compiled::PropAccess{ item.first.first, item.first.second };
+    case ExprOpType::DIV:
+    case ExprOpType::MOD:
+    case ExprOpType::SQRT:
+        return 4;
+    case ExprOpType::EXP:
+    case ExprOpType::LOG:
+    case ExprOpType::POW:
+    case ExprOpType::SIN:
+    case ExprOpType::COS:
+        return 32;
+    case ExprOpType::SORT:
+        return 2 * static_cast<int>(buildSortNet(op.imm.u).size());
+    default:
+        return 1;
+    }
+}
+
+template<int lanes>
+int Compiler<lanes>::chooseUnroll() const
+{
+    int cost = 0;
+    for (const auto &prog: ctx.programs) {
+        for (const auto &op: prog.ops) {
+            if (isTranscendental(op))
+                return 1;
+            cost += operatorCost(op);
+        }
+    }
+    return cost <= 12 ? 4 : cost <= 40 ? 2 : 1;
+}
+
+// Rewrites the program with the expression tree optimizer. Setting
+// AKARIN_EXPR_DUMP=1 prints the program before and after to stderr.
+template<int lanes>
+void Compiler<lanes>::optimize(Program &prog)
+{
+    ExpressionTree tree;
+    tree.forceFloat = ctx.forceFloat();
+    for (const auto &vi: ctx.vi)
+        tree.floatClips.push_back(vi.format.sampleType == stFloat);
+    if (!optimizeExpressionTree(tree, prog.ops))
+        return;
+
+    auto ops = emitExpressionTree(tree, ctx.numVars);
+
+    static const bool dump = envSize("AKARIN_EXPR_DUMP", 0) != 0;
+    if (dump) {
+        auto join = [this](const std::vector<ExprOp> &ops) {
+            std::string s;
+            for (const auto &op: ops)
+                s += exprOpToString(op, ctx.pa) + " ";
+            return s;
+        };
+        fprintf(stderr, "akarin.Expr: %s\n  before: %s\n  frame:  %s\n  row:    %s\n  after:  %s\n", prog.expr.c_str(), join(prog.ops).c_str(),
+                join(ops[static_cast<size_t>(Variance::Frame)]).c_str(), join(ops[static_cast<size_t>(Variance::Row)]).c_str(),
+                join(ops[static_cast<size_t>(Variance::Pixel)]).c_str());
+    }
+
+    prog.frameOps = std::move(ops[static_cast<size_t>(Variance::Frame)]);
+    prog.rowOps = std::move(ops[static_cast<size_t>(Variance::Row)]);
+    prog.ops = std::move(ops[static_cast<size_t>(Variance::Pixel)]);
+    prog.tokens.clear();
+    for (const auto &op: prog.ops)
+        prog.tokens.push_back(exprOpToString(op, ctx.pa));
+}
+
+template<int lanes>
+Compiled Compiler<lanes>::compile()
+{
+    if (ctx.cached) {
+        return ctx.cachedEntry;
+    }
+
+    prepare();
+    return build();
+}
+
+template<int lanes>
+std::shared_future<Compiled> Compiler<lanes>::compileAsync(const std::shared_ptr<const void> &owner, bool defer) &&
+{
+    if (ctx.cached) {
+        std::promise<Compiled> p;
+        p.set_value(ctx.cachedEntry);
+        return p.get_future().share();
     }
 
-    std::map<std::string, int> varMap;
-    for (size_t i = 0; i < ctx.ops.size(); i++) {
-        const std::string &tok = ctx.tokens[i];
-        ExprOp &op = ctx.ops[i];
+    prepare();
+
+    ThreadPool *pool = ThreadPool::compiler();
+    if (!pool) {
+        std::promise<Compiled> p;
+        p.set_value(build());
+        return p.get_future().share();
+    }
+
+    // Copied, as start() moves the context.
+    const std::string key = ctx.key();
+    return exprCache.lookupOrStart(key, owner, [&] {
+        auto task = std::make_shared<std::packaged_task<Compiled()>>(
+            [self = std::make_shared<Compiler>(std::move(*this))] {
+                if (exprCache.cancel(self->ctx.key()))
+                    throw std::runtime_error("compilation cancelled");
+                try {
+                    return self->build();
+                } catch (...) {
+                    exprCache.abandon(self->ctx.key());
+                    throw;
+                }
+            });
+        auto f = task->get_future().share();
+        pool->submit([task] { (*task)(); }, defer, [key] { return exprCache.cancel(key); });
+        return f;
+    });
+}
+
+template<int lanes>
+Compiled Compiler<lanes>::build()
+{
+    using namespace rr;
+
+    const auto &pa = ctx.pa;
 
-        if (op.type != ExprOpType::VAR_LOAD && op.type != ExprOpType::VAR_STORE) continue;
-        auto it = varMap.find(op.name);
-        if (it == varMap.end()) {
-            if (op.type == ExprOpType::VAR_LOAD)
-                throw std::runtime_error("reference to uninitialized variable: " + tok);
-            varMap.insert({ op.name, (int)varMap.size() });
+    unsigned used = usedHelpers();
+    if (used && !ctx.inlineMath)
+        buildRuntime();
+
+    DiskCache &diskCache = DiskCache::get();
+    std::string diskKey;
+    if (diskCache.enabled()) {
+        diskKey = DiskCache::fullKey(ctx.key());
+        size_t size = 0;
+        if (auto routine = diskCache.load(diskKey, "procPlane", size)) {
+            Compiled r { routine, pa };
+#ifdef USE_EXPR_CACHE
+            r = exprCache.insert(ctx.key(), r, size);
+#endif
+            return r;
         }
-        op.imm.i = varMap.at(op.name);
     }
 
-    Helper helpers = buildHelpers(mod);
+    using clock = std::chrono::steady_clock;
+    auto start = clock::now();
+
+    Module mod;
+    Helper helpers = buildHelpers(mod, used, ctx.inlineMath ? Helper::Inline : Helper::Declare);
 
-    //            void *rwptrs, int strides[], float *props, int width, int height
-    ModuleFunction<Void(Pointer<Byte>, Pointer<Byte>, Pointer<Byte>, Int, Int)> function(mod, "procPlane");
+    //            void *rwptrs, int strides[], float *props, int width, int height, int yStart, int yEnd
+    ModuleFunction<Void(Pointer<Byte>, Pointer<Byte>, Pointer<Byte>, Int, Int, Int, Int)> function(mod, "procPlane");
 
     State state;
+    state.interior = false;
+    state.row = state.column = 0;
     pointer rwptrs = function.Arg<0>();
     Pointer<Int> strides = Pointer<Int>(Pointer<Byte>(function.Arg<1>()));
     state.consts = Pointer<Float>(Pointer<Byte>(function.Arg<2>()));
     state.width = function.Arg<3>();
     state.height = function.Arg<4>();
+    // Only the row range is restricted, boundary conditions still use the
+    // full plane height so that stripe edges read their neighbors' rows.
+    Int yStart = function.Arg<5>();
+    Int yEnd = function.Arg<6>();
 
-    for (size_t i = 0; i < varMap.size(); i++)
+    for (int i = 0; i < ctx.numVars; i++)
         state.variables.push_back(Value(IntV(0)));
 
     for (int i = 0; i < lanes; i++)
         state.xvec = Insert(state.xvec, i, i);
 
-    for (int i = 0; i < ctx.numInputs + 1; i++) {
+    const int numPtrs = ctx.numInputs + 1;
+    for (int i = 0; i < numPtrs * static_cast<int>(ctx.programs.size()); i++) {
         state.wptrs.push_back(*Pointer<Pointer<Byte>>(rwptrs + sizeof(void *) * i));
         state.strides.push_back(Int(strides[i]));
     }
+    if (ctx.reduce)
+        state.histogram = *Pointer<Pointer<Int>>(rwptrs + sizeof(void *) * numPtrs * ctx.programs.size());
+
+    // Hoisted subexpressions leave nothing on the stack.
+    auto buildHoisted = [&](std::vector<ExprOp> Program::*ops) {
+        for (size_t i = 0; i < ctx.programs.size(); i++) {
+            std::vector<Value> stack;
+            state.base = numPtrs * static_cast<int>(i);
+            buildOps(helpers, state, ctx.programs[i].*ops, stack);
+        }
+    };
 
-    auto &y = state.y, &x = state.x;
-    For(y = 0, y < state.height, y++)
-    {
-        For(x = 0, x < state.width, x+=LANES*UNROLL)
+    // Evaluates all planes of n consecutive vectors in each row of the
+    // current block before storing any of them, so that shared loads and
+    // subexpressions can be reused and the independent vectors can be
+    // interleaved. The variables of the hoisted row programs of each row are
+    // in rowVariables.
+    Int x = 0, y = 0;
+    std::vector<std::vector<Value>> rowVariables;
+    // Statistics of each plane in each row of the current block for a
+    // reducing kernel.
+    std::deque<Reduction> reductions;
+    auto buildVectors = [&](int n) {
+        std::vector<Value> results;
+        state.loads.clear();
+        for (int r = 0; r < static_cast<int>(rowVariables.size()); r++) {
+            state.y = y + r;
+            state.row = r;
+            state.variables = rowVariables[r];
+            for (int k = 0; k < n; k++) {
+                state.x = x + k * lanes;
+                state.column = k;
+                for (size_t i = 0; i < ctx.programs.size(); i++) {
+                    state.base = numPtrs * static_cast<int>(i);
+                    results.push_back(buildOneIter(helpers, state, ctx.programs[i]));
+                }
+            }
+        }
+        auto result = results.begin();
+        for (int r = 0; r < static_cast<int>(rowVariables.size()); r++) {
+            state.y = y + r;
+            for (int k = 0; k < n; k++) {
+                state.x = x + k * lanes;
+                for (size_t i = 0; i < ctx.programs.size(); i++) {
+                    state.base = numPtrs * static_cast<int>(i);
+                    if (ctx.reduce)
+                        buildReduce(state, *result++, reductions[r * ctx.programs.size() + i]);
+                    else
+                        buildStore(state, *result++);
+                }
+            }
+        }
+    };
+
+    // How far relative pixel accesses reach beyond the current vector.
+    int reachX = 0, reachY = 0;
+    for (const auto &prog: ctx.programs) {
+        for (const auto &op: prog.ops) {
+            if (op.type == ExprOpType::MEM_LOAD) {
+                reachX = std::max(reachX, std::abs(op.x));
+                reachY = std::max(reachY, std::abs(op.y));
+            } else if (op.type == ExprOpType::CONVOLUTION) {
+                // The vectors on either side are loaded whole.
+                ConvolutionKernel kernel(op.name);
+                reachX = std::max(reachX, kernel.width > 1 ? lanes : 0);
+                reachY = std::max(reachY, kernel.height / 2);
+            }
+        }
+    }
+
+    const int step = lanes * ctx.unroll;
+    // Groups of full vectors first, then the rest one vector at a time, as
+    // long as the vectors stay within [x, end - reachX).
+    auto buildLoop = [&](Int end) {
+        if (ctx.unroll > 1) {
+            For((void)0, x + step + reachX <= end, x += step)
+            {
+                buildVectors(ctx.unroll);
+            }
+        }
+        While(x + lanes + reachX <= end)
+        {
+            buildVectors(1);
+            x += lanes;
+        }
+    };
+    // Processes rows [y, y + rows).
+    auto buildRows = [&](int rows) {
+        rowVariables.clear();
+        for (int r = 0; r < rows; r++) {
+            state.y = y + r;
+            buildHoisted(&Program::rowOps);
+            rowVariables.push_back(state.variables);
+        }
+        reductions.clear();
+        for (int i = 0; ctx.reduce && i < rows * static_cast<int>(ctx.programs.size()); i++) {
+            Reduction &acc = reductions.emplace_back();
+            acc.isum = acc.imax = acc.count = IntV(0);
+            acc.imin = IntV(std::numeric_limits<int>::max());
+            acc.fsum = FloatV(0.0f);
+            acc.fmin = As<FloatV>(IntV(infinity));
+            acc.fmax = As<FloatV>(IntV(negativeInfinity));
+        }
+        x = 0;
+        if (reachX == 0 && reachY == 0) {
+            buildLoop(state.width + lanes - 1);
+        } else {
+            // Vectors at the edges of the plane apply the boundary conditions,
+            // the interior ones load their neighbours directly.
+            Bool interiorRows = y >= reachY && y + rows <= state.height - reachY;
+            While(x < state.width)
+            {
+                If(interiorRows && x >= reachX && x + lanes + reachX <= state.width)
+                {
+                    state.interior = true;
+                    buildLoop(state.width);
+                    state.interior = false;
+                }
+                Else
+                {
+                    buildVectors(1);
+                    x += lanes;
+                }
+            }
+        }
+        // Each row of a reducing kernel has a record of four vectors in its
+        // destination: the sums, minima, maxima and counts of nonzero values
+        // of each lane, as integers or floats like the output format.
+        for (size_t i = 0; i < reductions.size(); i++) {
+            const int base = numPtrs * static_cast<int>(i % ctx.programs.size());
+            const Reduction &acc = reductions[i];
+            Pointer<Byte> p = state.wptrs[base] + (y + static_cast<int>(i / ctx.programs.size())) * state.strides[base];
+            constexpr int size = lanes * sizeof(int32_t);
+            if (ctx.vo.format.sampleType == stInteger) {
+                *Pointer<IntV>(p, alignment(sizeof(int32_t))) = acc.isum;
+                *Pointer<IntV>(p + size, alignment(sizeof(int32_t))) = acc.imin;
+                *Pointer<IntV>(p + 2 * size, alignment(sizeof(int32_t))) = acc.imax;
+            } else {
+                *Pointer<FloatV>(p, alignment(sizeof(float))) = acc.fsum;
+                *Pointer<FloatV>(p + size, alignment(sizeof(float))) = acc.fmin;
+                *Pointer<FloatV>(p + 2 * size, alignment(sizeof(float))) = acc.fmax;
+            }
+            *Pointer<IntV>(p + 3 * size, alignment(sizeof(int32_t))) = acc.count;
+        }
+    };
+    buildHoisted(&Program::frameOps);
+    y = yStart;
+    // Blocks of rows share the source vectors they have in common, e.g. a
+    // vertical stencil loads each of its rows once per block.
+    if (ctx.rows > 1) {
+        For((void)0, y + ctx.rows <= yEnd, y += ctx.rows)
         {
-            for (int k = 0; k < UNROLL; k++)
-                buildOneIter(helpers, state);
+            buildRows(ctx.rows);
         }
     }
+    While(y < yEnd)
+    {
+        buildRows(1);
+        y++;
+    }
     Return();
 
-    Compiled r { mod.acquire("proc"), pa };
+    // The object is always captured, its size is used for the cache budget.
+    std::string object;
+    // The time LLVM takes grows faster than the size of these straight-line
+    // kernels, so those over the budget are optimized less, and those far
+    // over it like baseline kernels.
+    static const Config::Edit standard = Config::Edit().set(Optimization::Pipeline::Standard);
+    const size_t instructions = mod.getInstructionCount();
+    const bool overBudget = ctx.irBudget && instructions > ctx.irBudget;
+    const bool farOverBudget = ctx.irBudget && instructions > 4 * ctx.irBudget;
+    const Config::Edit &cfg = ctx.baseline || farOverBudget ? baselineConfig() : overBudget ? reducedConfig() :
+        ctx.standardPipeline ? standard : Config::Edit::None;
+    auto generated = clock::now();
+    Compiled r { mod.acquire("proc", cfg, &object), pa };
+    static const bool log = envSize("AKARIN_EXPR_COMPILE_LOG", 0) != 0;
+    if (log) {
+        std::string exprs;
+        for (const auto &prog: ctx.programs)
+            exprs += (exprs.empty() ? "" : " | ") + prog.expr;
+        auto ms = [](clock::duration d) { return std::chrono::duration<double, std::milli>(d).count(); };
+        fprintf(stderr, "akarin.Expr: %s\n  %zu instructions, %s%s, generated in %.1f ms, compiled in %.1f ms\n", exprs.c_str(), instructions,
+                ctx.baseline ? "baseline" : farOverBudget ? "baseline (over 4x budget)" : overBudget ? "reduced (over budget)" :
+                ctx.standardPipeline ? "optimized (standard pipeline)" : "optimized",
+                !used ? "" : ctx.inlineMath ? ", math inlined" : ", math shared",
+                ms(generated - start), ms(clock::now() - generated));
+    }
+    if (diskCache.enabled())
+        diskCache.store(diskKey, object);
 #ifdef USE_EXPR_CACHE
-    exprCache.insert({ctx.key(), r});
+    r = exprCache.insert(ctx.key(), r, object.size());
 #endif
     return r;
 }
 
+// Frame properties worth specializing a kernel on: those used in the
+// condition of a ternary or directly multiplied by, so that constant folding
+// removes dead branches or whole terms. Returns nothing for invalid
+// expressions, which the generic kernel reports.
+static std::vector<Compiled::PropAccess> specializableProps(const std::vector<std::string> &exprs)
+{
+    typedef std::set<std::pair<int, std::string>> PropSet;
+    struct Entry {
+        PropSet props;
+        bool isProp;
+    };
+    constexpr int last = static_cast<int>(LoadConstType::LAST);
+    PropSet candidates;
+
+    for (const auto &expr: exprs) {
+        std::vector<Entry> stack;
+        std::map<std::string, Entry> vars;
+        for (const auto &tok: tokenize(expr)) {
+            ExprOp op = decodeToken(tok);
+            const size_t numArgs = op.type == ExprOpType::SORT ? op.imm.u :
+                op.type == ExprOpType::DUP || op.type == ExprOpType::SWAP ? op.imm.u + 1 :
+                op.type == ExprOpType::DROP ? op.imm.u : numOperands[static_cast<size_t>(op.type)];
+            if (op.type > ExprOpType::LAST || stack.size() < numArgs)
+                return {};
+
+            Entry merged { {}, false };
+            for (size_t i = stack.size() - numArgs; i < stack.size(); i++)
+                merged.props.insert(stack[i].props.begin(), stack[i].props.end());
+
+            switch (op.type) {
+            case ExprOpType::CONST_LOAD:
+                if (op.imm.i >= last)
+                    stack.push_back({ { { op.imm.i - last, op.name } }, true });
+                else
+                    stack.push_back({ {}, false });
+                break;
+            case ExprOpType::VAR_STORE:
+                vars[op.name] = stack.back();
+                stack.pop_back();
+                break;
+            case ExprOpType::VAR_LOAD:
+                if (!vars.count(op.name))
+                    return {};
+                stack.push_back(vars.at(op.name));
+                break;
+            case ExprOpType::DUP:
+                stack.push_back(stack[stack.size() - 1 - op.imm.u]);
+                break;
+            case ExprOpType::SWAP:
+                std::swap(stack[stack.size() - 1], stack[stack.size() - 1 - op.imm.u]);
+                break;
+            case ExprOpType::DROP:
+                stack.resize(stack.size() - op.imm.u);
+                break;
+            case ExprOpType::SORT:
+                for (size_t i = stack.size() - numArgs; i < stack.size(); i++)
+                    stack[i] = merged;
+                break;
+            default:
+                if (op.type == ExprOpType::TERNARY) {
+                    const Entry &cond = stack[stack.size() - 3];
+                    candidates.insert(cond.props.begin(), cond.props.end());
+                } else if (op.type == ExprOpType::MUL) {
+                    for (size_t i = stack.size() - 2; i < stack.size(); i++) {
+                        if (stack[i].isProp)
+                            candidates.insert(stack[i].props.begin(), stack[i].props.end());
+                    }
+                }
+                stack.resize(stack.size() - numArgs);
+                stack.push_back(merged);
+                break;
+            }
+        }
+    }
+
+    std::vector<Compiled::PropAccess> props;
+    for (const auto &prop: candidates)
+        props.push_back({ prop.first, prop.second });
+    return props;
+}
+
+// A lookup table for the expressions of a kernel if they are expensive and
+// only depend on constants, frame properties and the pixel values of one
+// integer clip of up to 16 bits or of two 8-bit clips. Setting
+// AKARIN_EXPR_LUT=0 disables them.
+static std::unique_ptr<ExprData::Lookup> makeLookup(const std::vector<std::string> &exprs, const std::vector<const VSVideoInfo *> &vi, const VSVideoInfo &vo)
+{
+    static const bool enabled = envSize("AKARIN_EXPR_LUT", 1) != 0;
+    if (!enabled)
+        return nullptr;
+
+    std::vector<int> clips;
+    int cost = 0;
+    for (const auto &expr: exprs) {
+        for (const auto &tok: tokenize(expr)) {
+            ExprOp op = decodeToken(tok);
+            if (op.type == ExprOpType::MEM_LOAD_VAR || op.type == ExprOpType::CONVOLUTION ||
+                (op.type == ExprOpType::MEM_LOAD && (op.x != 0 || op.y != 0 || op.imm.i >= static_cast<int>(vi.size()))) ||
+                (op.type == ExprOpType::CONST_LOAD && op.imm.i < static_cast<int>(LoadConstType::LAST)))
+                return nullptr;
+            if (op.type == ExprOpType::MEM_LOAD && std::find(clips.begin(), clips.end(), op.imm.i) == clips.end())
+                clips.push_back(op.imm.i);
+            cost += operatorCost(op);
+        }
+    }
+    // Looking up a pixel costs about as much as a few simple operators.
+    if (clips.empty() || clips.size() > 2 || cost < 16)
+        return nullptr;
+    for (int clip: clips) {
+        const VSVideoFormat &format = vi[clip]->format;
+        if (format.sampleType != stInteger || format.bitsPerSample > (clips.size() == 1 ? 16 : 8))
+            return nullptr;
+    }
+
+    auto lookup = std::make_unique<ExprData::Lookup>();
+    lookup->clips = clips;
+    lookup->inputSize = vi[clips[0]]->format.bytesPerSample;
+    lookup->entries = clips.size() == 1 ? size_t(1) << vi[clips[0]]->format.bitsPerSample : 65536;
+    // Building a table should not cost more than processing a frame.
+    if (lookup->entries > static_cast<size_t>(vo.width) * vo.height)
+        return nullptr;
+    return lookup;
+}
+
+// Evaluates the generic kernel on every possible input, see ExprData::Lookup.
+static std::shared_ptr<uint8_t> buildLookupTable(const ExprData &d, size_t k, ExprData::ProcessProc proc, float *consts)
+{
+    const ExprData::Lookup &lookup = *d.lookups[k];
+    const auto &kernel = d.kernels[k];
+    const int outputSize = d.vi.format.bytesPerSample;
+    // The pixels of the first clip are their x coordinate, and those of the
+    // second one their y coordinate.
+    const int width = lookup.clips.size() == 1 ? static_cast<int>(lookup.entries) : 256;
+    const int height = static_cast<int>(lookup.entries) / width;
+
+    auto allocate = [](size_t size) {
+        uint8_t *p = vsh::vsh_aligned_malloc<uint8_t>(size, 64);
+        if (!p)
+            throw std::bad_alloc();
+        return std::shared_ptr<uint8_t>(p, vsh::vsh_aligned_free);
+    };
+    auto columns = allocate(lookup.entries * lookup.inputSize), rows = allocate(lookup.entries);
+    for (size_t i = 0; i < lookup.entries; i++) {
+        if (lookup.inputSize == 1)
+            columns.get()[i] = static_cast<uint8_t>(i % width);
+        else
+            reinterpret_cast<uint16_t *>(columns.get())[i] = static_cast<uint16_t>(i);
+        rows.get()[i] = static_cast<uint8_t>(i / width);
+    }
+
+    auto table = allocate(lookup.entries * outputSize * kernel.size());
+    std::vector<uint8_t *> rwptrs(kernel.size() * (d.numInputs + 1), nullptr);
+    std::vector<int> strides(kernel.size() * (d.numInputs + 1), 0);
+    for (size_t j = 0; j < kernel.size(); j++) {
+        const size_t base = j * (d.numInputs + 1);
+        rwptrs[base] = table.get() + j * lookup.entries * outputSize;
+        strides[base] = width * outputSize;
+        // Clips not in the table are not read.
+        for (int i = 0; i < d.numInputs; i++) {
+            const bool second = lookup.clips.size() == 2 && i == lookup.clips[1];
+            rwptrs[base + i + 1] = second ? rows.get() : columns.get();
+            strides[base + i + 1] = second ? width : width * lookup.inputSize;
+        }
+    }
+    proc(&rwptrs[0], &strides[0], consts, width, height, 0, height);
+    return table;
+}
+
+// Maps rows [yStart, yEnd) of a plane through a table of ExprData::Lookup.
+// src2 is only given for tables of two clips.
+template<typename S, typename D>
+static void applyLookup(const uint8_t *src, int srcStride, const uint8_t *src2, int src2Stride, uint8_t *dst, int dstStride,
+                        const uint8_t *table, size_t entries, int width, int yStart, int yEnd)
+{
+    const D *t = reinterpret_cast<const D *>(table);
+    for (int y = yStart; y < yEnd; y++) {
+        const S *s = reinterpret_cast<const S *>(src + static_cast<ptrdiff_t>(y) * srcStride);
+        D *out = reinterpret_cast<D *>(dst + static_cast<ptrdiff_t>(y) * dstStride);
+        if (src2) {
+            const uint8_t *s2 = src2 + static_cast<ptrdiff_t>(y) * src2Stride;
+            for (int x = 0; x < width; x++)
+                out[x] = t[s[x] | s2[x] << 8];
+        } else {
+            // Clips with fewer than 16 bits may still hold larger values.
+            for (int x = 0; x < width; x++)
+                out[x] = t[std::min<size_t>(s[x], entries - 1)];
+        }
+    }
+}
+
+static float getFrameProp(const VSAPI *vsapi, const VSFrame *frame, const std::string &name)
+{
+    auto m = vsapi->getFramePropertiesRO(frame);
+    int err = 0;
+    float val = vsapi->mapGetInt(m, name.c_str(), 0, &err);
+    if (err == peType)
+        val = vsapi->mapGetFloat(m, name.c_str(), 0, &err);
+    if (err == peType) {
+        auto d = vsapi->mapGetData(m, name.c_str(), 0, &err);
+        if (d) val = d[0];
+    }
+    if (err != 0)
+        val = std::nanf(""); // XXX: should we warn the user?
+    return val;
+}
+
 static const VSFrame *VS_CC exprGetFrame(int n, int activationReason, void *instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
     ExprData *d = static_cast<ExprData *>(instanceData);
     int numInputs = d->numInputs;
 
     if (activationReason == arInitial) {
-        for (int i = 0; i < numInputs; i++)
-            vsapi->requestFrameFilter(n, d->node[i], frameCtx);
+        for (int i = 0; i < numInputs; i++) {
+            if (d->access[i] != ClipAccess::None)
+                vsapi->requestFrameFilter(n, d->node[i], frameCtx);
+        }
     } else if (activationReason == arAllFramesReady) {
+        // Null for the clips that are not read.
         std::vector<const VSFrame *> src(numInputs, nullptr);
-        for (int i = 0; i < numInputs; i++)
-            src[i] = vsapi->getFrameFilter(n, d->node[i], frameCtx);
+        for (int i = 0; i < numInputs; i++) {
+            if (d->access[i] != ClipAccess::None)
+                src[i] = vsapi->getFrameFilter(n, d->node[i], frameCtx);
+        }
 
         const VSVideoFormat fi = d->vi.format;
         int height = vsapi->getFrameHeight(src[0], 0);
@@ -1379,24 +4882,36 @@ static const VSFrame *VS_CC exprGetFrame(int n, int activationReason, void *inst
         const VSFrame *srcf[3] = { d->plane[0] != poCopy ? nullptr : src[0], d->plane[1] != poCopy ? nullptr : src[0], d->plane[2] != poCopy ? nullptr : src[0] };
         VSFrame *dst = vsapi->newVideoFrame2(&fi, width, height, srcf, planes, src[0], core);
 
-        std::vector<uint8_t *> rwptrs(numInputs + 1, nullptr);
-        std::vector<int> strides(numInputs + 1, 0);
-
-        for (int plane = 0; plane < d->vi.format.numPlanes; plane++) {
-            if (d->plane[plane] != poProcess)
-                continue;
+        for (size_t k = 0; k < d->kernels.size(); k++) {
+            const auto &kernel = d->kernels[k];
+            const Compiled *compiled;
+            try {
+                compiled = d->tiered[k] ? d->tiered[k]->get(d->compiled[k]) : &d->compiled[k].get();
+            } catch (std::exception &e) {
+                for (int i = 0; i < numInputs; i++)
+                    vsapi->freeFrame(src[i]);
+                vsapi->freeFrame(dst);
+                vsapi->setFilterError((std::string{ "Expr: " } + e.what()).c_str(), frameCtx);
+                return nullptr;
+            }
 
-            strides[0] = vsapi->getStride(dst, plane);
-            for (int i = 0; i < numInputs; i++) {
-                if (d->node[i]) {
-                    rwptrs[i + 1] = (uint8_t *)vsapi->getReadPtr(src[i], plane);
-                    strides[i + 1] = vsapi->getStride(src[i], plane);
+            std::vector<uint8_t *> rwptrs(kernel.size() * (numInputs + 1), nullptr);
+            std::vector<int> strides(kernel.size() * (numInputs + 1), 0);
+            for (size_t j = 0; j < kernel.size(); j++) {
+                const int plane = kernel[j];
+                const size_t base = j * (numInputs + 1);
+                strides[base] = vsapi->getStride(dst, plane);
+                for (int i = 0; i < numInputs; i++) {
+                    if (src[i]) {
+                        rwptrs[base + i + 1] = (uint8_t *)vsapi->getReadPtr(src[i], plane);
+                        strides[base + i + 1] = vsapi->getStride(src[i], plane);
+                    }
                 }
+                rwptrs[base] = vsapi->getWritePtr(dst, plane);
             }
 
-            rwptrs[0] = vsapi->getWritePtr(dst, plane);
-            int h = vsapi->getFrameHeight(dst, plane);
-            int w = vsapi->getFrameWidth(dst, plane);
+            int h = vsapi->getFrameHeight(dst, kernel[0]);
+            int w = vsapi->getFrameWidth(dst, kernel[0]);
 
             union U {
                 int i;
@@ -1404,24 +4919,79 @@ static const VSFrame *VS_CC exprGetFrame(int n, int activationReason, void *inst
                 U(int i = 0) : i(i) {}
                 U(float f) : f(f) {}
             };
-            std::vector<U> consts = { n };
-            for (const auto &pa : d->compiled[plane].propAccess) {
-                auto m = vsapi->getFramePropertiesRO(src[pa.clip]);
-                int err = 0;
-                float val = vsapi->mapGetInt(m, pa.name.c_str(), 0, &err);
-                if (err == peType)
-                    val = vsapi->mapGetFloat(m, pa.name.c_str(), 0, &err);
-                if (err == peType) {
-                    auto d = vsapi->mapGetData(m, pa.name.c_str(), 0, &err);
-                    if (d) val = d[0];
+            // Tiny stripes are not worth the synchronization overhead.
+            const int numStripes = std::max(1, std::min(d->threads, h / 16));
+            auto process = [&](const std::function<void(int, int)> &stripe) {
+                if (numStripes == 1) {
+                    stripe(0, h);
+                    return;
+                }
+                std::vector<std::future<void>> pending;
+                for (int i = 1; i < numStripes; i++) {
+                    auto task = std::make_shared<std::packaged_task<void()>>([&, i] {
+                        stripe(h * i / numStripes, h * (i + 1) / numStripes);
+                    });
+                    pending.push_back(task->get_future());
+                    ThreadPool::stripes()->submit([task] { (*task)(); });
+                }
+                stripe(0, h / numStripes);
+                for (auto &f : pending)
+                    f.wait();
+            };
+
+            const auto &lookup = d->lookups[k];
+            std::shared_ptr<uint8_t> table;
+            if (lookup) {
+                std::vector<float> values;
+                std::vector<U> consts = { n };
+                for (const auto &pa : compiled->propAccess) {
+                    values.push_back(getFrameProp(vsapi, src[pa.clip], pa.name));
+                    consts.push_back(values.back());
                 }
-                if (err != 0)
-                    val = std::nanf(""); // XXX: should we warn the user?
-                consts.push_back(val);
+                table = lookup->get(values, [&] {
+                    auto proc = reinterpret_cast<ExprData::ProcessProc>(const_cast<void *>(compiled->routine->getEntry()));
+                    return buildLookupTable(*d, k, proc, reinterpret_cast<float *>(&consts[0]));
+                });
             }
+            if (table) {
+
+                typedef void (*LookupProc)(const uint8_t *, int, const uint8_t *, int, uint8_t *, int, const uint8_t *, size_t, int, int, int);
+                static const LookupProc procs[2][3] = {
+                    { applyLookup<uint8_t, uint8_t>, applyLookup<uint8_t, uint16_t>, applyLookup<uint8_t, uint32_t> },
+                    { applyLookup<uint16_t, uint8_t>, applyLookup<uint16_t, uint16_t>, applyLookup<uint16_t, uint32_t> },
+                };
+                const LookupProc apply = procs[lookup->inputSize - 1][fi.bytesPerSample == 4 ? 2 : fi.bytesPerSample - 1];
+                const size_t tableSize = lookup->entries * fi.bytesPerSample;
+                process([&](int yStart, int yEnd) {
+                    for (size_t j = 0; j < kernel.size(); j++) {
+                        const size_t base = j * (numInputs + 1);
+                        const size_t first = base + lookup->clips[0] + 1;
+                        const size_t second = lookup->clips.size() == 2 ? base + lookup->clips[1] + 1 : 0;
+                        apply(rwptrs[first], strides[first], second ? rwptrs[second] : nullptr, second ? strides[second] : 0,
+                              rwptrs[base], strides[base], table.get() + j * tableSize, lookup->entries, w, yStart, yEnd);
+                    }
+                });
+                continue;
+            }
+
+            // Falls back to the generic kernel while a specialized one is
+            // being compiled, or once the limit is reached.
+            if (d->specialize && !d->specialized[k]->props.empty()) {
+                std::vector<float> values;
+                for (const auto &pa : d->specialized[k]->props)
+                    values.push_back(getFrameProp(vsapi, src[pa.clip], pa.name));
+                if (const Compiled *specialized = d->specialized[k]->get(values, d->specialize))
+                    compiled = specialized;
+            }
+
+            std::vector<U> consts = { n };
+            for (const auto &pa : compiled->propAccess)
+                consts.push_back(getFrameProp(vsapi, src[pa.clip], pa.name));
 
-            ExprData::ProcessProc proc = reinterpret_cast<ExprData::ProcessProc>(const_cast<void *>(d->compiled[plane].routine->getEntry()));
-            proc(&rwptrs[0], &strides[0], reinterpret_cast<float*>(&consts[0]), w, h);
+            ExprData::ProcessProc proc = reinterpret_cast<ExprData::ProcessProc>(const_cast<void *>(compiled->routine->getEntry()));
+            process([&](int yStart, int yEnd) {
+                proc(&rwptrs[0], &strides[0], reinterpret_cast<float*>(&consts[0]), w, h, yStart, yEnd);
+            });
         }
 
         for (int i = 0; i < numInputs; i++) {
@@ -1438,10 +5008,87 @@ static void VS_CC exprFree(void *instanceData, VSCore *core, const VSAPI *vsapi)
     for (auto *p: d->node)
         vsapi->freeNode(p);
     delete d;
+    exprCache.trim();
+}
+
+static void checkInputs(const std::vector<const VSVideoInfo *> &vi) {
+    for (size_t i = 0; i < vi.size(); i++) {
+        if (!vsh::isConstantVideoFormat(vi[i]))
+            throw std::runtime_error("Only clips with constant format and dimensions allowed");
+        if (vi[0]->format.numPlanes != vi[i]->format.numPlanes
+            || vi[0]->format.subSamplingW != vi[i]->format.subSamplingW
+            || vi[0]->format.subSamplingH != vi[i]->format.subSamplingH
+            || vi[0]->width != vi[i]->width
+            || vi[0]->height != vi[i]->height)
+        {
+            throw std::runtime_error("All inputs must have the same number of planes and the same dimensions, subsampling included");
+        }
+
+        int bits = vi[i]->format.bitsPerSample;
+        if (((bits > 32 || (bits > 16 && bits < 32)) && vi[i]->format.sampleType == stInteger)
+            || (bits != 16 && bits != 32 && vi[i]->format.sampleType == stFloat))
+            throw std::runtime_error("Input clips must be 8-16/32 bit integer or 16/32 bit float format");
+    }
+}
+
+// How valid expressions read each of numInputs clips. The output is based on
+// the frames of the first clip, which are always read.
+static std::vector<ClipAccess> clipAccess(const std::vector<std::string> &exprs, int numInputs) {
+    std::vector<ClipAccess> access(numInputs, ClipAccess::None);
+    access[0] = ClipAccess::Frame;
+    constexpr int last = static_cast<int>(LoadConstType::LAST);
+    for (const auto &expr: exprs) {
+        for (const auto &tok: tokenize(expr)) {
+            ExprOp op = decodeToken(tok);
+            if ((op.type == ExprOpType::MEM_LOAD || op.type == ExprOpType::MEM_LOAD_VAR || op.type == ExprOpType::CONVOLUTION) &&
+                op.imm.i < numInputs)
+                access[op.imm.i] = ClipAccess::Frame;
+            else if (op.type == ExprOpType::CONST_LOAD && op.imm.i >= last && op.imm.i - last < numInputs)
+                access[op.imm.i - last] = std::max(access[op.imm.i - last], ClipAccess::Props);
+        }
+    }
+    return access;
+}
+
+// Dependencies on the clips that are read.
+static std::vector<VSFilterDependency> clipDependencies(const std::vector<VSNode *> &nodes, const std::vector<ClipAccess> &access) {
+    std::vector<VSFilterDependency> deps;
+    for (size_t i = 0; i < nodes.size(); i++) {
+        if (access[i] != ClipAccess::None)
+            deps.push_back({ nodes[i], rpStrictSpatial });
+    }
+    return deps;
+}
+
+// The input format with the sample type and bit depth of the optional format
+// argument.
+static VSVideoFormat outputFormat(const VSMap *in, const VSVideoFormat &input, VSCore *core, const VSAPI *vsapi) {
+    int err;
+    VSVideoFormat result = input;
+    int format = vsh::int64ToIntS(vsapi->mapGetInt(in, "format", 0, &err));
+    if (!err) {
+        VSVideoFormat f;
+        auto ok = vsapi->getVideoFormatByID(&f, format, core);
+        if (ok) {
+            if (input.numPlanes != f.numPlanes)
+                throw std::runtime_error("The number of planes in the inputs and output must match");
+            vsapi->queryVideoFormat(
+                &result, 
+                input.colorFamily, 
+                f.sampleType, 
+                f.bitsPerSample, 
+                input.subSamplingW, 
+                input.subSamplingH, 
+                core
+            );
+        }
+    }
+    return result;
 }
 
 static void VS_CC exprCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
     std::unique_ptr<ExprData> d(new ExprData);
+    d->owner = ThreadPool::attach();
     int err;
 
     try {
@@ -1457,43 +5104,9 @@ static void VS_CC exprCreate(const VSMap *in, VSMap *out, void *userData, VSCore
                 vi[i] = vsapi->getVideoInfo(d->node[i]);
         }
 
-        for (int i = 0; i < d->numInputs; i++) {
-            if (!vsh::isConstantVideoFormat(vi[i]))
-                throw std::runtime_error("Only clips with constant format and dimensions allowed");
-            if (vi[0]->format.numPlanes != vi[i]->format.numPlanes
-                || vi[0]->format.subSamplingW != vi[i]->format.subSamplingW
-                || vi[0]->format.subSamplingH != vi[i]->format.subSamplingH
-                || vi[0]->width != vi[i]->width
-                || vi[0]->height != vi[i]->height)
-            {
-                throw std::runtime_error("All inputs must have the same number of planes and the same dimensions, subsampling included");
-            }
-
-            int bits = vi[i]->format.bitsPerSample;
-            if (((bits > 32 || (bits > 16 && bits < 32)) && vi[i]->format.sampleType == stInteger)
-                || (bits != 16 && bits != 32 && vi[i]->format.sampleType == stFloat))
-                throw std::runtime_error("Input clips must be 8-16/32 bit integer or 16/32 bit float format");
-        }
-
+        checkInputs(vi);
         d->vi = *vi[0];
-        int format = vsh::int64ToIntS(vsapi->mapGetInt(in, "format", 0, &err));
-        if (!err) {
-            VSVideoFormat f;
-            auto ok = vsapi->getVideoFormatByID(&f, format, core);
-            if (ok) {
-                if (d->vi.format.numPlanes != f.numPlanes)
-                    throw std::runtime_error("The number of planes in the inputs and output must match");
-                vsapi->queryVideoFormat(
-                    &d->vi.format, 
-                    d->vi.format.colorFamily, 
-                    f.sampleType, 
-                    f.bitsPerSample, 
-                    d->vi.format.subSamplingW, 
-                    d->vi.format.subSamplingH, 
-                    core
-                );
-            }
-        }
+        d->vi.format = outputFormat(in, d->vi.format, core, vsapi);
 
         int nexpr = vsapi->mapNumElements(in, "expr");
         if (nexpr > d->vi.format.numPlanes)
@@ -1513,6 +5126,36 @@ static void VS_CC exprCreate(const VSMap *in, VSMap *out, void *userData, VSCore
         int mirror = vsh::int64ToIntS(vsapi->mapGetInt(in, "boundary", 0, &err));
         if (err) mirror = 0;
 
+        d->threads = vsh::int64ToIntS(vsapi->mapGetInt(in, "threads", 0, &err));
+        if (err) d->threads = 1;
+        if (d->threads < 0)
+            throw std::runtime_error("threads must not be negative");
+        if (d->threads == 0)
+            d->threads = static_cast<int>(ThreadPool::stripes()->size());
+
+        int lanes = vsh::int64ToIntS(vsapi->mapGetInt(in, "lanes", 0, &err));
+        if (err) lanes = defaultLanes();
+        if (lanes != 8 && lanes != 16)
+            throw std::runtime_error("lanes must be 8 or 16");
+
+        int unroll = vsh::int64ToIntS(vsapi->mapGetInt(in, "unroll", 0, &err));
+        if (err) unroll = 0;
+        if (unroll != 0 && unroll != 1 && unroll != 2 && unroll != 4)
+            throw std::runtime_error("unroll must be 1, 2 or 4");
+
+        int rows = vsh::int64ToIntS(vsapi->mapGetInt(in, "rows", 0, &err));
+        if (err) rows = 1;
+        if (rows < 1 || rows > 4)
+            throw std::runtime_error("rows must be between 1 and 4");
+
+        d->specialize = vsh::int64ToIntS(vsapi->mapGetInt(in, "specialize", 0, &err));
+        if (err) d->specialize = 0;
+        if (d->specialize < 0)
+            throw std::runtime_error("specialize must not be negative");
+
+        // Tiers only help while compilation runs in the background.
+        static const bool tiered = envSize("AKARIN_EXPR_TIERED", 0) != 0 && ThreadPool::compiler();
+
         for (int i = 0; i < d->vi.format.numPlanes; i++) {
             if (!expr[i].empty()) {
                 d->plane[i] = poProcess;
@@ -1526,10 +5169,63 @@ static void VS_CC exprCreate(const VSMap *in, VSMap *out, void *userData, VSCore
             if (d->plane[i] != poProcess)
                 continue;
 
-            Compiler<LANES> comp(expr[i], &d->vi, &vi[0], vsapi, d->numInputs, optMask, mirror);
-            d->compiled[i] = comp.compile();
-            d->proc[i] = reinterpret_cast<ExprData::ProcessProc>(const_cast<void *>(d->compiled[i].routine->getEntry()));
+            // Planes of equal dimensions are processed by one fused routine,
+            // so that they are walked in a single pass.
+            auto subsampled = [&](int plane) { return plane > 0 && (d->vi.format.subSamplingW || d->vi.format.subSamplingH); };
+            auto it = std::find_if(d->kernels.begin(), d->kernels.end(), [&](const std::vector<int> &kernel) {
+                return subsampled(kernel[0]) == subsampled(i);
+            });
+            if (it != d->kernels.end())
+                it->push_back(i);
+            else
+                d->kernels.push_back({ i });
+        }
+
+        for (const auto &kernel: d->kernels) {
+            std::vector<std::string> exprs;
+            for (int plane: kernel)
+                exprs.push_back(expr[plane]);
+            // The video infos are owned by the nodes, which outlive the filter,
+            // and the owner by the filter, which outlives its calls.
+            auto compile = [exprs, vo = d->vi, vi, vsapi, numInputs = d->numInputs, optMask, mirror, unroll, rows, lanes, owner = std::weak_ptr<const void>(d->owner)](
+                    const std::map<std::pair<int, std::string>, float> &fixedProps, bool baseline = false, bool defer = false) {
+                if (lanes == 16)
+                    return Compiler<16>(exprs, &vo, &vi[0], vsapi, numInputs, optMask, mirror, unroll, rows, fixedProps, -1, baseline).compileAsync(owner.lock(), defer);
+                else
+                    return Compiler<8>(exprs, &vo, &vi[0], vsapi, numInputs, optMask, mirror, unroll, rows, fixedProps, -1, baseline).compileAsync(owner.lock(), defer);
+            };
+            // Tables already cover all property values.
+            d->lookups.push_back(makeLookup(exprs, vi, d->vi));
+            // With tiered compilation, the optimized kernel is only compiled
+            // once the baseline kernels of all filters created so far are,
+            // and frames are processed with the baseline kernel until then.
+            // Tables are cached, so they are always built from the optimized
+            // kernel, which is not deferred then.
+            const bool tier = tiered && !d->lookups.back();
+            d->compiled.push_back(compile({}, false, tier));
+            if (tier && d->compiled.back().wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+                d->tiered.push_back(std::make_unique<ExprData::Tiered>(compile({}, true)));
+            else
+                d->tiered.push_back(nullptr);
+
+            auto specialized = std::make_unique<ExprData::Specialized>();
+            if (d->specialize && !d->lookups.back())
+                specialized->props = specializableProps(exprs);
+            specialized->compile = [compile, props = specialized->props](const std::vector<float> &values) {
+                std::map<std::pair<int, std::string>, float> fixedProps;
+                for (size_t i = 0; i < props.size(); i++)
+                    fixedProps[{ props[i].clip, props[i].name }] = values[i];
+                return compile(fixedProps);
+            };
+            d->specialized.push_back(std::move(specialized));
+        }
+
+        std::vector<std::string> exprs;
+        for (int i = 0; i < d->vi.format.numPlanes; i++) {
+            if (d->plane[i] == poProcess)
+                exprs.push_back(expr[i]);
         }
+        d->access = clipAccess(exprs, d->numInputs);
     } catch (std::runtime_error &e) {
         for (auto p: d->node)
             vsapi->freeNode(p);
@@ -1537,19 +5233,205 @@ static void VS_CC exprCreate(const VSMap *in, VSMap *out, void *userData, VSCore
         return;
     }
 
-    std::vector<VSFilterDependency> deps;
-    deps.reserve(d->node.size());
-    std::transform(
-        d->node.begin(),
-        d->node.end(),
-        std::back_inserter(deps),
-        [&](auto *node) { return VSFilterDependency{node, rpStrictSpatial}; }
-    );
+    std::vector<VSFilterDependency> deps = clipDependencies(d->node, d->access);
 
     const VSVideoInfo *vi = &d->vi;
     vsapi->createVideoFilter(out, "Expr", vi, exprGetFrame, exprFree, fmParallel, deps.data(), deps.size(), d.release(), core);
 }
 
+static const VSFrame *VS_CC exprStatsGetFrame(int n, int activationReason, void *instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
+    ExprStatsData *d = static_cast<ExprStatsData *>(instanceData);
+    int numInputs = d->numInputs;
+
+    if (activationReason == arInitial) {
+        for (int i = 0; i < numInputs; i++) {
+            if (d->access[i] != ClipAccess::None)
+                vsapi->requestFrameFilter(n, d->node[i], frameCtx);
+        }
+    } else if (activationReason == arAllFramesReady) {
+        std::vector<const VSFrame *> src(numInputs, nullptr);
+        for (int i = 0; i < numInputs; i++) {
+            if (d->access[i] != ClipAccess::None)
+                src[i] = vsapi->getFrameFilter(n, d->node[i], frameCtx);
+        }
+
+        const Compiled *compiled;
+        try {
+            compiled = &d->compiled.get();
+        } catch (std::exception &e) {
+            for (int i = 0; i < numInputs; i++)
+                vsapi->freeFrame(src[i]);
+            vsapi->setFilterError((std::string{ "ExprStats: " } + e.what()).c_str(), frameCtx);
+            return nullptr;
+        }
+
+        const int h = vsapi->getFrameHeight(src[0], d->plane);
+        const int w = vsapi->getFrameWidth(src[0], d->plane);
+        // The kernel writes the per-lane statistics of each row as a record
+        // of four vectors, and counts the histogram in the extra pointer.
+        const int lanes = d->lanes;
+        const int recordSize = 4 * lanes * sizeof(int32_t);
+        std::unique_ptr<uint8_t, decltype(&vsh::vsh_aligned_free)> records(vsh::vsh_aligned_malloc<uint8_t>(recordSize * h, 64), vsh::vsh_aligned_free);
+        std::vector<int32_t> histogram(d->bins);
+
+        std::vector<uint8_t *> rwptrs(numInputs + 2, nullptr);
+        std::vector<int> strides(numInputs + 1, 0);
+        rwptrs[0] = records.get();
+        strides[0] = recordSize;
+        for (int i = 0; i < numInputs; i++) {
+            if (src[i]) {
+                rwptrs[i + 1] = const_cast<uint8_t *>(vsapi->getReadPtr(src[i], d->plane));
+                strides[i + 1] = vsapi->getStride(src[i], d->plane);
+            }
+        }
+        rwptrs[numInputs + 1] = reinterpret_cast<uint8_t *>(histogram.data());
+
+        union U {
+            int i;
+            float f;
+            U(int i = 0) : i(i) {}
+            U(float f) : f(f) {}
+        };
+        std::vector<U> consts = { n };
+        for (const auto &pa : compiled->propAccess)
+            consts.push_back(getFrameProp(vsapi, src[pa.clip], pa.name));
+
+        ExprData::ProcessProc proc = reinterpret_cast<ExprData::ProcessProc>(const_cast<void *>(compiled->routine->getEntry()));
+        proc(&rwptrs[0], &strides[0], reinterpret_cast<float*>(&consts[0]), w, h, 0, h);
+
+        VSFrame *dst = vsapi->copyFrame(src[0], core);
+        VSMap *props = vsapi->getFramePropertiesRW(dst);
+        auto name = [&](const char *suffix) { return d->prop + suffix; };
+        int64_t count = 0;
+        double sum = 0;
+        const VSVideoFormat &format = d->vo.format;
+        if (format.sampleType == stInteger) {
+            int32_t min = std::numeric_limits<int32_t>::max(), max = 0;
+            for (int y = 0; y < h; y++) {
+                const int32_t *record = reinterpret_cast<const int32_t *>(records.get() + y * recordSize);
+                for (int i = 0; i < lanes; i++) {
+                    sum += record[i];
+                    min = std::min(min, record[lanes + i]);
+                    max = std::max(max, record[2 * lanes + i]);
+                    count += record[3 * lanes + i];
+                }
+            }
+            vsapi->mapSetInt(props, name("Min").c_str(), min, maReplace);
+            vsapi->mapSetInt(props, name("Max").c_str(), max, maReplace);
+            // Normalized like the average of std.PlaneStats.
+            vsapi->mapSetFloat(props, name("Average").c_str(), sum / (static_cast<double>(w) * h) / ((1 << format.bitsPerSample) - 1), maReplace);
+        } else {
+            float min = std::numeric_limits<float>::infinity(), max = -std::numeric_limits<float>::infinity();
+            for (int y = 0; y < h; y++) {
+                const float *record = reinterpret_cast<const float *>(records.get() + y * recordSize);
+                for (int i = 0; i < lanes; i++) {
+                    sum += record[i];
+                    min = std::min(min, record[lanes + i]);
+                    max = std::max(max, record[2 * lanes + i]);
+                    count += reinterpret_cast<const int32_t *>(record)[3 * lanes + i];
+                }
+            }
+            vsapi->mapSetFloat(props, name("Min").c_str(), min, maReplace);
+            vsapi->mapSetFloat(props, name("Max").c_str(), max, maReplace);
+            vsapi->mapSetFloat(props, name("Average").c_str(), sum / (static_cast<double>(w) * h), maReplace);
+        }
+        vsapi->mapSetFloat(props, name("Sum").c_str(), sum, maReplace);
+        vsapi->mapSetInt(props, name("NonZero").c_str(), count, maReplace);
+        if (d->bins > 0) {
+            std::vector<int64_t> bins(histogram.begin(), histogram.end());
+            vsapi->mapSetIntArray(props, name("Histogram").c_str(), bins.data(), d->bins);
+        }
+
+        for (int i = 0; i < numInputs; i++)
+            vsapi->freeFrame(src[i]);
+        return dst;
+    }
+
+    return nullptr;
+}
+
+static void VS_CC exprStatsFree(void *instanceData, VSCore *core, const VSAPI *vsapi) {
+    ExprStatsData *d = static_cast<ExprStatsData *>(instanceData);
+    for (auto *p: d->node)
+        vsapi->freeNode(p);
+    delete d;
+    exprCache.trim();
+}
+
+static void VS_CC exprStatsCreate(const VSMap *in, VSMap *out, void *userData, VSCore *core, const VSAPI *vsapi) {
+    std::unique_ptr<ExprStatsData> d(new ExprStatsData);
+    d->owner = ThreadPool::attach();
+    int err;
+
+    try {
+        d->numInputs = vsapi->mapNumElements(in, "clips");
+        for (int i = 0; i < d->numInputs; i++)
+            d->node.push_back(vsapi->mapGetNode(in, "clips", i, &err));
+
+        std::vector<const VSVideoInfo *> vi(d->numInputs, nullptr);
+        for (int i = 0; i < d->numInputs; i++)
+            vi[i] = vsapi->getVideoInfo(d->node[i]);
+        checkInputs(vi);
+
+        d->vo = *vi[0];
+        d->vo.format = outputFormat(in, d->vo.format, core, vsapi);
+        if (d->vo.format.sampleType == stInteger && d->vo.format.bitsPerSample > 16)
+            throw std::runtime_error("format must be 8-16 bit integer or 16/32 bit float");
+
+        std::string expr = vsapi->mapGetData(in, "expr", 0, nullptr);
+
+        d->plane = vsh::int64ToIntS(vsapi->mapGetInt(in, "plane", 0, &err));
+        if (err) d->plane = 0;
+        if (d->plane < 0 || d->plane >= d->vo.format.numPlanes)
+            throw std::runtime_error("plane must be a valid plane of the inputs");
+
+        d->bins = vsh::int64ToIntS(vsapi->mapGetInt(in, "bins", 0, &err));
+        if (err) d->bins = 0;
+        if (d->bins < 0 || d->bins > 32768)
+            throw std::runtime_error("bins must be between 0 and 32768");
+
+        const char *prop = vsapi->mapGetData(in, "prop", 0, &err);
+        d->prop = err ? "ExprStats" : prop;
+
+        int optMask = vsh::int64ToIntS(vsapi->mapGetInt(in, "opt", 0, &err));
+        if (err) optMask = 0;
+
+        int mirror = vsh::int64ToIntS(vsapi->mapGetInt(in, "boundary", 0, &err));
+        if (err) mirror = 0;
+
+        d->lanes = vsh::int64ToIntS(vsapi->mapGetInt(in, "lanes", 0, &err));
+        if (err) d->lanes = defaultLanes();
+        if (d->lanes != 8 && d->lanes != 16)
+            throw std::runtime_error("lanes must be 8 or 16");
+
+        int unroll = vsh::int64ToIntS(vsapi->mapGetInt(in, "unroll", 0, &err));
+        if (err) unroll = 0;
+        if (unroll != 0 && unroll != 1 && unroll != 2 && unroll != 4)
+            throw std::runtime_error("unroll must be 1, 2 or 4");
+
+        int rows = vsh::int64ToIntS(vsapi->mapGetInt(in, "rows", 0, &err));
+        if (err) rows = 1;
+        if (rows < 1 || rows > 4)
+            throw std::runtime_error("rows must be between 1 and 4");
+
+        if (d->lanes == 16)
+            d->compiled = Compiler<16>({ expr }, &d->vo, &vi[0], vsapi, d->numInputs, optMask, mirror, unroll, rows, {}, d->bins).compileAsync(d->owner);
+        else
+            d->compiled = Compiler<8>({ expr }, &d->vo, &vi[0], vsapi, d->numInputs, optMask, mirror, unroll, rows, {}, d->bins).compileAsync(d->owner);
+        d->access = clipAccess({ expr }, d->numInputs);
+    } catch (std::runtime_error &e) {
+        for (auto p: d->node)
+            vsapi->freeNode(p);
+        vsapi->mapSetError(out, (std::string{ "ExprStats: " } + e.what()).c_str());
+        return;
+    }
+
+    std::vector<VSFilterDependency> deps = clipDependencies(d->node, d->access);
+
+    const VSVideoInfo *vi = vsapi->getVideoInfo(d->node[0]);
+    vsapi->createVideoFilter(out, "ExprStats", vi, exprStatsGetFrame, exprStatsFree, fmParallel, deps.data(), deps.size(), d.release(), core);
+}
+
 static void initExpr() {
 #ifndef _WIN32
     std::setlocale(LC_NUMERIC, "C");
@@ -1558,6 +5440,7 @@ static void initExpr() {
         .set(rr::Optimization::Level::Aggressive)
         .set(rr::Optimization::FMF::FastMath)
         .clearOptimizationPasses()
+        .add(rr::Optimization::Pass::Inline)
         .add(rr::Optimization::Pass::ScalarReplAggregates)
         .add(rr::Optimization::Pass::InstructionCombining)
         .add(rr::Optimization::Pass::Reassociate)
@@ -1567,7 +5450,6 @@ static void initExpr() {
         .add(rr::Optimization::Pass::CFGSimplification)
         .add(rr::Optimization::Pass::EarlyCSEPass)
         .add(rr::Optimization::Pass::CFGSimplification)
-        .add(rr::Optimization::Pass::Inline)
         ;
 
     rr::Nucleus::adjustDefaultConfig(cfg);
@@ -1587,11 +5469,11 @@ float interpret(const std::vector<ExprOp> &ops, int N, int width, int height, in
         // Stack operations
         switch (op.type) {
         case ExprOpType::DUP:
-            check_stack(op.imm.u);
+            check_stack(op.imm.u + 1);
             stack.push_back(stack[stack.size() - 1 - op.imm.u]);
             break;
         case ExprOpType::SWAP: {
-            check_stack(op.imm.u);
+            check_stack(op.imm.u + 1);
             std::swap(stack[stack.size()-1], stack[stack.size() - 1 - op.imm.u]);
             break;
         }
@@ -1783,6 +5665,8 @@ float interpret(const std::vector<ExprOp> &ops, int N, int width, int height, in
         case ExprOpType::ARGMIN:
         case ExprOpType::ARGMAX: {
             check_stack(op.imm.i);
+            if (op.imm.i == 0)
+                throw std::runtime_error("argmin and argmax need at least one value");
             const int off = stack.size() - op.imm.u;
             int idx = 0;
             float cur = stack[off+idx];
@@ -1807,6 +5691,14 @@ float interpret(const std::vector<ExprOp> &ops, int N, int width, int height, in
             std::copy(idxs.begin(), idxs.end(), &stack[stack.size() - op.imm.u]);
             break;
         }
+
+        // Only supported by Expr.
+        case ExprOpType::CONVOLUTION:
+        // Only produced by the Expr optimizer.
+        case ExprOpType::NEG:
+        case ExprOpType::FMA:
+        case ExprOpType::MUX:
+            throw std::runtime_error("unsupported operator in interpreter");
         }
 #undef UNARYOP
 #undef BINARYOPF
@@ -1827,15 +5719,490 @@ float interpret(const std::vector<ExprOp> &ops, int N, int width, int height, in
     return stack[0];
 }
 
+// A register form of an expression for the interpreter. The stack is
+// resolved when the expression is compiled, so that every value lives in a
+// register and each instruction names its operands: stack helpers, variables,
+// constants and property loads only rename registers and produce no code.
+// Properties are resolved to indices in an array passed to run(). Pixel
+// values are not supported.
+class Bytecode {
+#define BYTECODE_OPCODES(X) \
+    X(ADD) X(SUB) X(MUL) X(DIV) X(MOD) X(SQRT) X(ABS) X(MAX) X(MIN) X(CLAMP) \
+    X(EQ) X(LT) X(LE) X(NEQ) X(NLT) X(NLE) \
+    X(TRUNC) X(ROUND) X(FLOOR) \
+    X(AND) X(OR) X(XOR) X(NOT) \
+    X(BITAND) X(BITOR) X(BITXOR) X(BITNOT) \
+    X(EXP) X(LOG) X(POW) X(SIN) X(COS) \
+    X(TERNARY) X(MOV) X(SORT) X(ARGMIN) X(ARGMAX) X(ARGSORT) X(RET)
+#define BYTECODE_ENUM(name) name,
+    enum Opcode : uint8_t { BYTECODE_OPCODES(BYTECODE_ENUM) };
+#undef BYTECODE_ENUM
+
+    // For SORT, ARGMIN, ARGMAX and ARGSORT, c is the number of values in
+    // consecutive registers starting at dst.
+    struct Insn {
+        Opcode op;
+        uint16_t dst, a, b, c;
+    };
+
+    // Registers are N, X, Y, width, height, then properties, constants and
+    // temporaries.
+    enum { regN, regX, regY, regWidth, regHeight, numEnvRegs };
+    static constexpr int numLocalRegs = 256;
+
+    std::vector<Insn> code;
+    std::vector<int> propIndices;
+    std::vector<float> consts;
+    int numRegs = 0;
+
+public:
+    Bytecode() = default;
+    // prop maps a clip and a property name to an index in the array of
+    // properties.
+    Bytecode(const std::vector<ExprOp> &ops, std::function<int(int clip, const std::string &name)> prop) {
+        // Registers of properties and constants are numbered first, so that
+        // temporaries follow them.
+        std::map<int, uint16_t> propRegs;
+        std::map<uint32_t, uint16_t> constRegs;
+        auto isProp = [](const ExprOp &op) {
+            return op.type == ExprOpType::CONST_LOAD && op.imm.i >= static_cast<int>(LoadConstType::LAST);
+        };
+        auto bits = [](float f) {
+            uint32_t u;
+            memcpy(&u, &f, sizeof u);
+            return u;
+        };
+        for (const auto &op: ops) {
+            if (isProp(op)) {
+                int index = prop(op.imm.i - static_cast<int>(LoadConstType::LAST), op.name);
+                if (propRegs.emplace(index, numEnvRegs + propIndices.size()).second)
+                    propIndices.push_back(index);
+            }
+        }
+        for (const auto &op: ops) {
+            if (op.type == ExprOpType::CONSTANTI || op.type == ExprOpType::CONSTANTF) {
+                float f = op.type == ExprOpType::CONSTANTI ? op.imm.i : op.imm.f;
+                if (constRegs.emplace(bits(f), numEnvRegs + propIndices.size() + consts.size()).second)
+                    consts.push_back(f);
+            }
+        }
+        const int firstTemp = numEnvRegs + propIndices.size() + consts.size();
+        if (firstTemp > UINT16_MAX)
+            throw std::runtime_error("expression too large for the interpreter");
+        int numTemps = 0;
+
+        std::vector<uint16_t> stack;
+        std::map<std::string, uint16_t> vars;
+        auto check_stack = [&stack](int nargs) -> void {
+            int size = stack.size();
+            if (size < nargs)
+                throw std::runtime_error("stack underflow, expecting " + std::to_string(nargs) + " args, but only has " + std::to_string(size) + " elements left on stack");
+        };
+        auto isLive = [&](int reg) {
+            return std::find(stack.begin(), stack.end(), reg) != stack.end() ||
+                   std::any_of(vars.begin(), vars.end(), [reg](const auto &v) { return v.second == reg; });
+        };
+        // Returns the first of n consecutive temporaries not referenced by
+        // the stack or a variable. Operands already popped may be reused, as
+        // instructions read all operands before writing.
+        auto allocate = [&](int n) -> uint16_t {
+            for (int i = firstTemp; ; i++) {
+                bool free = true;
+                for (int j = i; j < i + n && free; j++)
+                    free = !isLive(j);
+                if (free) {
+                    if (i + n > UINT16_MAX)
+                        throw std::runtime_error("expression too large for the interpreter");
+                    numTemps = std::max(numTemps, i + n - firstTemp);
+                    return i;
+                }
+            }
+        };
+        auto emit = [&](Opcode op, int dst, int a = 0, int b = 0, int c = 0) {
+            code.push_back(Insn{ op, static_cast<uint16_t>(dst), static_cast<uint16_t>(a), static_cast<uint16_t>(b), static_cast<uint16_t>(c) });
+        };
+        // Moves the top n values into consecutive registers.
+        auto gather = [&](int n) -> uint16_t {
+            uint16_t dst = allocate(n);
+            for (int i = 0; i < n; i++)
+                emit(MOV, dst + i, stack[stack.size() - n + i]);
+            stack.resize(stack.size() - n);
+            return dst;
+        };
+        auto unary = [&](Opcode op) {
+            check_stack(1);
+            uint16_t x = stack.back();
+            stack.pop_back();
+            uint16_t dst = allocate(1);
+            emit(op, dst, x);
+            stack.push_back(dst);
+        };
+        auto binary = [&](Opcode op) {
+            check_stack(2);
+            uint16_t r = stack.back();
+            stack.pop_back();
+            uint16_t l = stack.back();
+            stack.pop_back();
+            uint16_t dst = allocate(1);
+            emit(op, dst, l, r);
+            stack.push_back(dst);
+        };
+        auto ternary = [&](Opcode op) {
+            check_stack(3);
+            uint16_t c = stack.back();
+            stack.pop_back();
+            uint16_t b = stack.back();
+            stack.pop_back();
+            uint16_t a = stack.back();
+            stack.pop_back();
+            uint16_t dst = allocate(1);
+            emit(op, dst, a, b, c);
+            stack.push_back(dst);
+        };
+
+        for (const auto &op: ops) {
+            switch (op.type) {
+            case ExprOpType::DUP:
+                check_stack(op.imm.u + 1);
+                stack.push_back(stack[stack.size() - 1 - op.imm.u]);
+                break;
+            case ExprOpType::SWAP:
+                check_stack(op.imm.u + 1);
+                std::swap(stack[stack.size() - 1], stack[stack.size() - 1 - op.imm.u]);
+                break;
+            case ExprOpType::DROP:
+                check_stack(op.imm.u);
+                stack.resize(stack.size() - op.imm.u);
+                break;
+
+            case ExprOpType::CONSTANTI: stack.push_back(constRegs.at(bits(op.imm.i))); break;
+            case ExprOpType::CONSTANTF: stack.push_back(constRegs.at(bits(op.imm.f))); break;
+            case ExprOpType::CONST_LOAD:
+                switch (static_cast<LoadConstType>(op.imm.i)) {
+                case LoadConstType::N: stack.push_back(regN); break;
+                case LoadConstType::X: stack.push_back(regX); break;
+                case LoadConstType::Y: stack.push_back(regY); break;
+                case LoadConstType::Width: stack.push_back(regWidth); break;
+                case LoadConstType::Height: stack.push_back(regHeight); break;
+                default:
+                    stack.push_back(propRegs.at(prop(op.imm.i - static_cast<int>(LoadConstType::LAST), op.name)));
+                }
+                break;
+            case ExprOpType::VAR_LOAD: {
+                auto it = vars.find(op.name);
+                if (it == vars.end())
+                    throw std::runtime_error("variable " + op.name + " used before assignment");
+                stack.push_back(it->second);
+                break;
+            }
+            case ExprOpType::VAR_STORE:
+                check_stack(1);
+                vars.insert_or_assign(op.name, stack.back());
+                stack.pop_back();
+                break;
+
+            case ExprOpType::ADD: binary(ADD); break;
+            case ExprOpType::SUB: binary(SUB); break;
+            case ExprOpType::MUL: binary(MUL); break;
+            case ExprOpType::DIV: binary(DIV); break;
+            case ExprOpType::MOD: binary(MOD); break;
+            case ExprOpType::SQRT: unary(SQRT); break;
+            case ExprOpType::ABS: unary(ABS); break;
+            case ExprOpType::MAX: binary(MAX); break;
+            case ExprOpType::MIN: binary(MIN); break;
+            case ExprOpType::CLAMP: ternary(CLAMP); break;
+            case ExprOpType::CMP:
+                switch (static_cast<ComparisonType>(op.imm.u)) {
+                case ComparisonType::EQ: binary(EQ); break;
+                case ComparisonType::LT: binary(LT); break;
+                case ComparisonType::LE: binary(LE); break;
+                case ComparisonType::NEQ: binary(NEQ); break;
+                case ComparisonType::NLT: binary(NLT); break;
+                case ComparisonType::NLE: binary(NLE); break;
+                }
+                break;
+            case ExprOpType::TRUNC: unary(TRUNC); break;
+            case ExprOpType::ROUND: unary(ROUND); break;
+            case ExprOpType::FLOOR: unary(FLOOR); break;
+            case ExprOpType::AND: binary(AND); break;
+            case ExprOpType::OR: binary(OR); break;
+            case ExprOpType::XOR: binary(XOR); break;
+            case ExprOpType::NOT: unary(NOT); break;
+            case ExprOpType::BITAND: binary(BITAND); break;
+            case ExprOpType::BITOR: binary(BITOR); break;
+            case ExprOpType::BITXOR: binary(BITXOR); break;
+            case ExprOpType::BITNOT: unary(BITNOT); break;
+            case ExprOpType::EXP: unary(EXP); break;
+            case ExprOpType::LOG: unary(LOG); break;
+            case ExprOpType::POW: binary(POW); break;
+            case ExprOpType::SIN: unary(SIN); break;
+            case ExprOpType::COS: unary(COS); break;
+            case ExprOpType::TERNARY: ternary(TERNARY); break;
+
+            case ExprOpType::SORT:
+            case ExprOpType::ARGSORT: {
+                int n = op.imm.u;
+                check_stack(n);
+                if (n == 0)
+                    break;
+                uint16_t dst = gather(n);
+                emit(op.type == ExprOpType::SORT ? SORT : ARGSORT, dst, 0, 0, n);
+                for (int i = 0; i < n; i++)
+                    stack.push_back(dst + i);
+                break;
+            }
+            case ExprOpType::ARGMIN:
+            case ExprOpType::ARGMAX: {
+                int n = op.imm.i;
+                check_stack(n);
+                if (n == 0)
+                    throw std::runtime_error("argmin and argmax need at least one value");
+                uint16_t dst = gather(n);
+                emit(op.type == ExprOpType::ARGMIN ? ARGMIN : ARGMAX, dst, 0, 0, n);
+                stack.push_back(dst);
+                break;
+            }
+
+            case ExprOpType::MEM_LOAD:
+            case ExprOpType::MEM_LOAD_VAR:
+                throw std::runtime_error("unable to use pixel values in the interpreter");
+            case ExprOpType::CONVOLUTION:
+            case ExprOpType::NEG:
+            case ExprOpType::FMA:
+            case ExprOpType::MUX:
+                throw std::runtime_error("unsupported operator in interpreter");
+            }
+        }
+
+        if (stack.empty())
+            throw std::runtime_error("empty expression");
+        if (stack.size() > 1)
+            throw std::runtime_error("unconsumed " + std::to_string(stack.size()) + " values on stack");
+        emit(RET, 0, stack[0]);
+        numRegs = firstTemp + numTemps;
+    }
+
+    explicit operator bool() const { return !code.empty(); }
+
+    // props is indexed by the values returned by the prop function passed to
+    // the constructor.
+    float run(int N, int width, int height, int Y, int X, const float *props) const {
+        float local[numLocalRegs];
+        std::unique_ptr<float[]> heap;
+        float *r = local;
+        if (numRegs > numLocalRegs) {
+            heap.reset(new float[numRegs]);
+            r = heap.get();
+        }
+        r[regN] = N;
+        r[regX] = X;
+        r[regY] = Y;
+        r[regWidth] = width;
+        r[regHeight] = height;
+        float *p = r + numEnvRegs;
+        for (int index: propIndices)
+            *p++ = props[index];
+        std::copy(consts.begin(), consts.end(), p);
+
+        const Insn *ip = code.data();
+        // Dispatch with computed gotos where available, so that each handler
+        // has its own indirect branch.
+#if defined(__GNUC__)
+#define BYTECODE_LABEL(name) &&op_##name,
+        static const void *const labels[] = { BYTECODE_OPCODES(BYTECODE_LABEL) };
+#undef BYTECODE_LABEL
+#define CASE(name) op_##name:
+#define NEXT() goto *labels[(++ip)->op]
+        goto *labels[ip->op];
+#else
+#define CASE(name) case name:
+#define NEXT() ip++; continue
+        for (;;) switch (ip->op) {
+#endif
+#define UNARYOP(name, expr) CASE(name) { float x = r[ip->a]; r[ip->dst] = (expr); NEXT(); }
+#define BINARYOP(name, expr) CASE(name) { float l = r[ip->a], rr = r[ip->b]; r[ip->dst] = (expr); NEXT(); }
+        BINARYOP(ADD, l + rr)
+        BINARYOP(SUB, l - rr)
+        BINARYOP(MUL, l * rr)
+        BINARYOP(DIV, l / rr)
+        BINARYOP(MOD, std::fmod(l, rr))
+        UNARYOP(SQRT, std::sqrt(std::max(x, 0.0f)))
+        UNARYOP(ABS, std::abs(x))
+        BINARYOP(MAX, std::max(l, rr))
+        BINARYOP(MIN, std::min(l, rr))
+        CASE(CLAMP) { r[ip->dst] = std::max(std::min(r[ip->a], r[ip->c]), r[ip->b]); NEXT(); }
+        BINARYOP(EQ, l == rr)
+        BINARYOP(LT, l < rr)
+        BINARYOP(LE, l <= rr)
+        BINARYOP(NEQ, l != rr)
+        BINARYOP(NLT, l >= rr)
+        BINARYOP(NLE, l > rr)
+        UNARYOP(TRUNC, std::trunc(x))
+        UNARYOP(ROUND, std::round(x))
+        UNARYOP(FLOOR, std::floor(x))
+        BINARYOP(AND, (l > 0.0f) & (rr > 0.0f))
+        BINARYOP(OR, (l > 0.0f) | (rr > 0.0f))
+        BINARYOP(XOR, (l > 0.0f) ^ (rr > 0.0f))
+        UNARYOP(NOT, x <= 0.0f)
+        BINARYOP(BITAND, (int)std::round(l) & (int)std::round(rr))
+        BINARYOP(BITOR, (int)std::round(l) | (int)std::round(rr))
+        BINARYOP(BITXOR, (int)std::round(l) ^ (int)std::round(rr))
+        UNARYOP(BITNOT, ~(int)std::round(x))
+        UNARYOP(EXP, std::exp(x))
+        UNARYOP(LOG, std::log(x))
+        BINARYOP(POW, std::pow(l, rr))
+        UNARYOP(SIN, std::sin(x))
+        UNARYOP(COS, std::cos(x))
+        CASE(TERNARY) { r[ip->dst] = r[ip->a] > 0.0f ? r[ip->b] : r[ip->c]; NEXT(); }
+        CASE(MOV) { r[ip->dst] = r[ip->a]; NEXT(); }
+        CASE(SORT) { std::sort(r + ip->dst, r + ip->dst + ip->c, [](float l, float r) { return l > r; }); NEXT(); }
+        CASE(ARGMIN) CASE(ARGMAX) {
+            const float *v = r + ip->dst;
+            int idx = 0;
+            for (int i = 1; i < ip->c; i++) {
+                if (ip->op == ARGMIN ? v[i] < v[idx] : v[i] > v[idx])
+                    idx = i;
+            }
+            r[ip->dst] = idx;
+            NEXT();
+        }
+        CASE(ARGSORT) {
+            float *v = r + ip->dst;
+            int idxs[UINT8_MAX + 1];
+            std::unique_ptr<int[]> heapIdxs;
+            int *idx = idxs;
+            if (ip->c > UINT8_MAX + 1) {
+                heapIdxs.reset(new int[ip->c]);
+                idx = heapIdxs.get();
+            }
+            std::iota(idx, idx + ip->c, 0);
+            std::stable_sort(idx, idx + ip->c, [v](int l, int r) { return v[l] > v[r]; });
+            std::copy(idx, idx + ip->c, v);
+            NEXT();
+        }
+        CASE(RET) return r[ip->a];
+#undef BINARYOP
+#undef UNARYOP
+#undef NEXT
+#undef CASE
+#if !defined(__GNUC__)
+        }
+#endif
+    }
+#undef BYTECODE_OPCODES
+};
+
+// Frame properties read by the expressions of a Select or PropExpr filter.
+// Each pair of clip and name is read once per frame into a flat array
+// shared by all expressions, trying the type it had last time first.
+class PropTable {
+    struct Entry {
+        int clip;
+        std::string name;
+        std::atomic<int> type;
+        Entry(int clip, const std::string &name) : clip(clip), name(name), type(ptUnset) {}
+    };
+    std::deque<Entry> entries;
+    std::map<std::pair<int, std::string>, int> index;
+
+    static int read(const VSMap *m, const Entry &e, int type, float &val, const VSAPI *vsapi) {
+        int err = peType;
+        if (type == ptInt) {
+            int64_t v = vsapi->mapGetInt(m, e.name.c_str(), 0, &err);
+            if (!err) val = v;
+        } else if (type == ptFloat) {
+            double v = vsapi->mapGetFloat(m, e.name.c_str(), 0, &err);
+            if (!err) val = v;
+        } else if (type == ptData) {
+            const char *d = vsapi->mapGetData(m, e.name.c_str(), 0, &err);
+            if (d) val = d[0];
+        }
+        return err;
+    }
+
+public:
+    // Returns the index of the property in the array returned by fetch().
+    int add(int clip, const std::string &name) {
+        auto it = index.emplace(std::make_pair(clip, name), static_cast<int>(entries.size()));
+        if (it.second)
+            entries.emplace_back(clip, name);
+        return it.first->second;
+    }
+
+    // Missing properties read as 0, byte strings as their first byte.
+    // Properties of clips whose frame is null are not read.
+    std::vector<float> fetch(const std::vector<const VSFrame *> &frames, const VSAPI *vsapi) {
+        std::vector<float> values(entries.size(), 0.0f);
+        for (size_t i = 0; i < entries.size(); i++) {
+            Entry &e = entries[i];
+            if (!frames[e.clip])
+                continue;
+            const VSMap *m = vsapi->getFramePropertiesRO(frames[e.clip]);
+            if (read(m, e, e.type.load(std::memory_order_relaxed), values[i], vsapi) != peType)
+                continue;
+            for (int type: { ptInt, ptFloat, ptData }) {
+                int err = read(m, e, type, values[i], vsapi);
+                if (!err)
+                    e.type.store(type, std::memory_order_relaxed);
+                if (err != peType)
+                    break;
+            }
+        }
+        return values;
+    }
+};
+
+// Select and PropExpr evaluate each expression once per frame, in float like
+// interpret(), from a bytecode compiled when the filter is created.
+struct PropProgram {
+    std::vector<ExprOp> ops;
+    int numInputs;
+    // How each clip is read, only ever for its properties.
+    std::vector<ClipAccess> access;
+    Bytecode bytecode;
+
+    PropProgram() : numInputs() {}
+    PropProgram(const std::string &expr, int numInputs) :
+        numInputs(numInputs), access(numInputs, ClipAccess::None) {
+        for (const auto &tok: tokenize(expr)) {
+            ExprOp op = decodeToken(tok, true);
+            ops.push_back(op);
+            const int clip = op.imm.i - static_cast<int>(LoadConstType::LAST);
+            // Out of range clips are reported by the caller.
+            if (op.type == ExprOpType::CONST_LOAD && clip >= 0 && clip < numInputs)
+                access[clip] = ClipAccess::Props;
+        }
+    }
+
+    // Called once the caller has validated ops with interpret(). Throws for
+    // expressions the bytecode cannot represent.
+    void compile(PropTable &props) {
+        bytecode = Bytecode(ops, [&props](int clip, const std::string &name) { return props.add(clip, name); });
+    }
+
+    // False for empty expressions, which delete their property.
+    explicit operator bool() const { return static_cast<bool>(bytecode); }
+
+    // values are the properties fetched from the table passed to compile().
+    float evaluate(int n, int width, int height, const std::vector<float> &values) const {
+        if (!bytecode)
+            return 0.0f;
+        return bytecode.run(n, width, height, -1 /* Y */, -1 /* X */, values.data());
+    }
+};
+
 // Select
 struct SelectData {
     std::vector<VSNode *> propNodes;
     std::vector<VSNode *> srcNodes;
     VSVideoInfo vi;
     int numPropInputs;
-    std::vector<ExprOp> ops[3];
+    // How the expressions of all planes read each clip of propNodes.
+    std::vector<ClipAccess> propAccess;
+    PropTable props;
+    PropProgram programs[3];
 
-    SelectData() : propNodes(), srcNodes(), vi(), numPropInputs(), ops() {}
+    SelectData() : propNodes(), srcNodes(), vi(), numPropInputs(), propAccess(), programs() {}
 };
 
 static const VSFrame *VS_CC selectGetFrame(int n, int activationReason, void *instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
@@ -1847,40 +6214,22 @@ static const VSFrame *VS_CC selectGetFrame(int n, int activationReason, void *in
     };
 
     if (activationReason == arInitial) {
-        for (int i = 0; i < d->numPropInputs; i++)
-            vsapi->requestFrameFilter(n, d->propNodes[i], frameCtx);
+        for (int i = 0; i < d->numPropInputs; i++) {
+            if (d->propAccess[i] != ClipAccess::None)
+                vsapi->requestFrameFilter(n, d->propNodes[i], frameCtx);
+        }
     } else if (activationReason == arAllFramesReady && !*frameData) {
         std::vector<const VSFrame *> props(d->numPropInputs, nullptr);
         for (int i = 0; i < d->numPropInputs; i++) {
-            props[i] = vsapi->getFrameFilter(n, d->propNodes[i], frameCtx);
+            if (d->propAccess[i] != ClipAccess::None)
+                props[i] = vsapi->getFrameFilter(n, d->propNodes[i], frameCtx);
         }
 
         std::unique_ptr<RuntimeData> rd(new RuntimeData);
 
-        auto propGet = [&props, vsapi](int idx, const std::string &name) -> float {
-            auto m = vsapi->getFramePropertiesRO(props[idx]);
-            int err = 0;
-            float val = vsapi->mapGetInt(m, name.c_str(), 0, &err);
-            if (err == peType)
-                val = vsapi->mapGetFloat(m, name.c_str(), 0, &err);
-            if (err == peType) {
-                auto d = vsapi->mapGetData(m, name.c_str(), 0, &err);
-                if (d) val = d[0];
-            }
-            if (err != 0)
-                val = 0.0f; // XXX: non-existant property defaults to 0.
-            return val;
-        };
+        const std::vector<float> values = d->props.fetch(props, vsapi);
         for (int i = 0; i < d->vi.format.numPlanes; i++) {
-            float x;
-            try {
-                x = interpret(d->ops[i], n, d->vi.width, d->vi.height, -1 /* Y */, -1 /* X */,
-                              [](const ExprOp &op, int y, int x) -> float { return 0.0f; } /* pixelGet */,
-                              propGet);
-            } catch (std::runtime_error &e) {
-                x = 0.0f;
-            }
-            x = std::round(x);
+            float x = std::round(d->programs[i].evaluate(n, d->vi.width, d->vi.height, values));
             rd->selectedClip[i] = std::max(0, std::min((int)x, (int)d->srcNodes.size() - 1));
         }
 
@@ -1986,14 +6335,10 @@ static void VS_CC selectCreate(const VSMap *in, VSMap *out, void *userData, VSCo
             expr[i] = expr[nexpr - 1];
         }
         for (int i = 0; i < numPlanes; i++) {
-            auto tokens = tokenize(expr[i]);
-            for (const auto &tok: tokens) {
-                auto op = decodeToken(tok, true);
-                d->ops[i].push_back(op);
-            }
+            d->programs[i] = PropProgram(expr[i], d->numPropInputs);
             try {
                 const int numPropInputs = d->numPropInputs;
-                (void)interpret(d->ops[i], 0, d->vi.width, d->vi.height, -1 /* Y */, -1 /* X */,
+                (void)interpret(d->programs[i].ops, 0, d->vi.width, d->vi.height, -1 /* Y */, -1 /* X */,
                           [](const ExprOp &op, int y, int x) -> float { /* pixelGet */
                               throw std::runtime_error("unable to use pixel values in Select");
                           },
@@ -2005,6 +6350,13 @@ static void VS_CC selectCreate(const VSMap *in, VSMap *out, void *userData, VSCo
             } catch (std::runtime_error &e) {
                 throw e;
             }
+            d->programs[i].compile(d->props);
+        }
+
+        d->propAccess.assign(d->numPropInputs, ClipAccess::None);
+        for (int i = 0; i < numPlanes; i++) {
+            for (int j = 0; j < d->numPropInputs; j++)
+                d->propAccess[j] = std::max(d->propAccess[j], d->programs[i].access[j]);
         }
     } catch (std::runtime_error &e) {
         for (auto *p: d->propNodes)
@@ -2015,11 +6367,7 @@ static void VS_CC selectCreate(const VSMap *in, VSMap *out, void *userData, VSCo
         return;
     }
 
-    std::vector<VSFilterDependency> deps;
-    deps.reserve(d->propNodes.size() + d->srcNodes.size());
-    for (auto *node : d->propNodes) {
-        deps.emplace_back(node, rpStrictSpatial);
-    }
+    std::vector<VSFilterDependency> deps = clipDependencies(d->propNodes, d->propAccess);
     for (auto *node : d->srcNodes) {
         deps.emplace_back(node, rpStrictSpatial);
     }
@@ -2032,37 +6380,48 @@ static void VS_CC selectCreate(const VSMap *in, VSMap *out, void *userData, VSCo
 struct PropExprData {
     std::vector<VSNode *> nodes;
     VSVideoInfo vi;
-    std::vector<std::pair<std::string, std::vector<std::vector<ExprOp>>>> ops;
+    PropTable props;
+    std::vector<std::pair<std::string, std::vector<PropProgram>>> ops;
 
     PropExprData() : nodes(), vi(), ops() {}
+
+    // How the expressions evaluated for frame n, or for any frame if n is
+    // negative, read each clip. The output is based on the frames of the
+    // first clip.
+    std::vector<ClipAccess> access(int n) const {
+        std::vector<ClipAccess> result(nodes.size(), ClipAccess::None);
+        result[0] = ClipAccess::Frame;
+        for (const auto &pair: ops) {
+            for (size_t i = 0; i < pair.second.size(); i++) {
+                if (n >= 0 && i != n % pair.second.size())
+                    continue;
+                const auto &program = pair.second[i];
+                for (size_t j = 0; j < program.access.size(); j++)
+                    result[j] = std::max(result[j], program.access[j]);
+            }
+        }
+        return result;
+    }
 };
 
 static const VSFrame *VS_CC propExprGetFrame(int n, int activationReason, void *instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
     PropExprData *d = static_cast<PropExprData *>(instanceData);
 
     if (activationReason == arInitial) {
-        for (auto *p: d->nodes)
-            vsapi->requestFrameFilter(n, p, frameCtx);
+        const std::vector<ClipAccess> access = d->access(n);
+        for (size_t i = 0; i < d->nodes.size(); i++) {
+            if (access[i] != ClipAccess::None)
+                vsapi->requestFrameFilter(n, d->nodes[i], frameCtx);
+        }
     } else if (activationReason == arAllFramesReady) {
+        const std::vector<ClipAccess> access = d->access(n);
         std::vector<const VSFrame *> props(d->nodes.size(), nullptr);
         for (size_t i = 0; i < d->nodes.size(); i++) {
-            props[i] = vsapi->getFrameFilter(n, d->nodes[i], frameCtx);
-        }
-
-        auto propGet = [&props, vsapi](int idx, const std::string &name) -> float {
-            auto m = vsapi->getFramePropertiesRO(props[idx]);
-            int err = 0;
-            float val = vsapi->mapGetInt(m, name.c_str(), 0, &err);
-            if (err == peType)
-                val = vsapi->mapGetFloat(m, name.c_str(), 0, &err);
-            if (err == peType) {
-                auto d = vsapi->mapGetData(m, name.c_str(), 0, &err);
-                if (d) val = d[0];
-            }
-            if (err != 0)
-                val = 0.0f; // XXX: non-existant property defaults to 0.
-            return val;
-        };
+            if (access[i] != ClipAccess::None)
+                props[i] = vsapi->getFrameFilter(n, d->nodes[i], frameCtx);
+        }
+
+        const std::vector<float> values = d->props.fetch(props, vsapi);
 
         const VSVideoFormat fi = d->vi.format;
         const VSFrame *srcf[3] = { props[0], props[0], props[0] };
@@ -2075,26 +6434,18 @@ static const VSFrame *VS_CC propExprGetFrame(int n, int activationReason, void *
         std::vector<float> vals;
         // Two step atomic update
         for (const auto &pair: d->ops) {
-            const auto &ops = pair.second[n % pair.second.size()];
-            float x;
-            try {
-                x = interpret(ops, n, d->vi.width, d->vi.height, -1 /* Y */, -1 /* X */,
-                              [](const ExprOp &op, int y, int x) -> float { return 0.0f; } /* pixelGet */,
-                              propGet);
-            } catch (std::runtime_error &e) {
-                x = 0.0f;
-            }
-            vals.push_back(x);
+            const auto &program = pair.second[n % pair.second.size()];
+            vals.push_back(program.evaluate(n, d->vi.width, d->vi.height, values));
         }
         VSMap *map = vsapi->getFramePropertiesRW(dst);
         for (size_t i = 0; i < d->ops.size(); i++) {
             const auto &pair = d->ops[i];
             const auto &name = pair.first;
-            const auto &ops = pair.second[n % pair.second.size()];
+            const auto &program = pair.second[n % pair.second.size()];
             float v = vals[i];
 
             vsapi->mapDeleteKey(map, name.c_str());
-            if (ops.size() > 0) {
+            if (program) {
                 if (v == (float)(int64_t)v)
                     vsapi->mapSetInt(map, name.c_str(), (int64_t)v, maAppend);
                 else
@@ -2168,18 +6519,13 @@ static void VS_CC propExprCreate(const VSMap *in, VSMap *out, void *userData, VS
                     throw std::runtime_error("invalid type for key " + std::string(key) + ", only int/float/str are supported");
                 }
 
-                std::vector<std::vector<ExprOp>> opss(exprs.size());
+                std::vector<PropProgram> programs(exprs.size());
                 for (size_t i = 0; i < exprs.size(); i++) {
                     const auto &expr = exprs[i];
-                    auto &ops = opss[i];
                     if (expr.size() != 0) {
-                        auto tokens = tokenize(expr);
-                        for (const auto &tok: tokens) {
-                            auto op = decodeToken(tok, true);
-                            ops.push_back(op);
-                        }
+                        programs[i] = PropProgram(expr, numInputs);
                         try {
-                            (void)interpret(ops, 0, d->vi.width, d->vi.height, -1 /* Y */, -1 /* X */,
+                            (void)interpret(programs[i].ops, 0, d->vi.width, d->vi.height, -1 /* Y */, -1 /* X */,
                                       [key](const ExprOp &op, int y, int x) -> float { /* pixelGet */
                                           throw std::runtime_error(std::string(key) + ": unable to use pixel values in PropExpr");
                                       },
@@ -2191,9 +6537,10 @@ static void VS_CC propExprCreate(const VSMap *in, VSMap *out, void *userData, VS
                         } catch (std::runtime_error &e) {
                             throw e;
                         }
+                        programs[i].compile(d->props);
                     }
                 }
-                d->ops.emplace_back(key, std::move(opss));
+                d->ops.emplace_back(key, std::move(programs));
             }
             vsapi->freeMap(out_map);
             vsapi->freeMap(in_map);
@@ -2211,14 +6558,7 @@ static void VS_CC propExprCreate(const VSMap *in, VSMap *out, void *userData, VS
         return;
     }
 
-    std::vector<VSFilterDependency> deps;
-    deps.reserve(d->nodes.size());
-    std::transform(
-        d->nodes.begin(),
-        d->nodes.end(),
-        std::back_inserter(deps),
-        [&](auto *node) { return VSFilterDependency{node, rpStrictSpatial}; }
-    );
+    std::vector<VSFilterDependency> deps = clipDependencies(d->nodes, d->access(-1));
 
     const VSVideoInfo *vi = &d->vi;
     vsapi->createVideoFilter(out, "PropExpr", vi, propExprGetFrame, propExprFree, fmParallel, deps.data(), deps.size(), d.release(), core);
@@ -2227,6 +6567,8 @@ static void VS_CC propExprCreate(const VSMap *in, VSMap *out, void *userData, VS
 void VS_CC versionCreate(const VSMap *in, VSMap *out, void *user_data, VSCore *core, const VSAPI *vsapi)
 {
     vsapi->mapSetData(out, "expr_backend", "llvm", -1, dtUtf8, maAppend);
+    vsapi->mapSetInt(out, "expr_disk_cache_hits", DiskCache::get().numHits(), maAppend);
+    vsapi->mapSetInt(out, "expr_disk_cache_misses", DiskCache::get().numMisses(), maAppend);
     for (const auto &f : features)
         vsapi->mapSetData(out, "expr_features", f.c_str(), -1, dtUtf8, maAppend);
     for (const auto &f : selectFeatures)
@@ -2240,7 +6582,8 @@ void VS_CC versionCreate(const VSMap *in, VSMap *out, void *user_data, VSCore *c
 // Init
 
 void VS_CC exprInitialize(VSPlugin *plugin, const VSPLUGINAPI *vsapi) {
-    vsapi->registerFunction("Expr", "clips:vnode[];expr:data[];format:int:opt;opt:int:opt;boundary:int:opt;", "clip:vnode;", exprCreate, nullptr, plugin);
+    vsapi->registerFunction("Expr", "clips:vnode[];expr:data[];format:int:opt;opt:int:opt;boundary:int:opt;lanes:int:opt;threads:int:opt;unroll:int:opt;rows:int:opt;specialize:int:opt;", "clip:vnode;", exprCreate, nullptr, plugin);
+    vsapi->registerFunction("ExprStats", "clips:vnode[];expr:data;plane:int:opt;bins:int:opt;prop:data:opt;format:int:opt;opt:int:opt;boundary:int:opt;lanes:int:opt;unroll:int:opt;rows:int:opt;", "clip:vnode;", exprStatsCreate, nullptr, plugin);
     vsapi->registerFunction("Select", "clip_src:vnode[];prop_src:vnode[];expr:data[];", "clip:vnode;", selectCreate, nullptr, plugin);
     vsapi->registerFunction("PropExpr", "clips:vnode[];dict:func;", "clip:vnode;", propExprCreate, nullptr, plugin);
     registerVersionFunc(versionCreate);
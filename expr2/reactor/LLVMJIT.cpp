@@ -20,6 +20,8 @@
 #include "LLVMAsm.hpp"
 #include "Routine.hpp"
 
+#include <mutex>
+
 // TODO(b/143539525): Eliminate when warning has been fixed.
 #ifdef _MSC_VER
 __pragma(warning(push))
@@ -29,6 +31,10 @@ __pragma(warning(push))
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
 #include "llvm/ExecutionEngine/Orc/RTDyldObjectLinkingLayer.h"
+#if LLVM_VERSION_MAJOR >= 16
+	#include "llvm/ExecutionEngine/Orc/ObjectLinkingLayer.h"
+#endif
+#include "llvm/ExecutionEngine/ObjectCache.h"
 #include "llvm/ExecutionEngine/SectionMemoryManager.h"
 
 #if LLVM_VERSION_MAJOR >= 21
@@ -45,11 +51,12 @@ __pragma(warning(push))
 #include "llvm/Support/CommandLine.h"
 #include "llvm/Support/TargetSelect.h"
 #include "llvm/TargetParser/Host.h"
+#include "llvm/Support/MemoryBuffer.h"
 #if LLVM_VERSION_MAJOR >= 21
 	#include "llvm/TargetParser/Triple.h"
-	#include "llvm/Support/MemoryBuffer.h"
 #endif
 #include "llvm/Transforms/InstCombine/InstCombine.h"
+#include "llvm/Transforms/IPO/AlwaysInliner.h"
 #include "llvm/Transforms/Instrumentation/MemorySanitizer.h"
 #include "llvm/Transforms/Scalar/ADCE.h"
 #include "llvm/Transforms/Scalar/DeadStoreElimination.h"
@@ -158,6 +165,7 @@ public:
 	llvm::orc::JITTargetMachineBuilder getTargetMachineBuilder(rr::Optimization::Level optLevel) const;
 	const llvm::DataLayout &getDataLayout() const;
 	const llvm::Triple &getTargetTriple() const;
+	std::string getTargetKey() const;
 
 private:
 	JITGlobals(llvm::orc::JITTargetMachineBuilder &&jitTargetMachineBuilder, llvm::DataLayout &&dataLayout);
@@ -251,6 +259,16 @@ const llvm::Triple &JITGlobals::getTargetTriple() const
 	return jitTargetMachineBuilder.getTargetTriple();
 }
 
+// Object code is only valid for the exact target triple, CPU, sub-target
+// features and LLVM version it was generated with.
+std::string JITGlobals::getTargetKey() const
+{
+	return jitTargetMachineBuilder.getTargetTriple().str() + ";" +
+	       jitTargetMachineBuilder.getCPU() + ";" +
+	       jitTargetMachineBuilder.getFeatures().getString() + ";" +
+	       LLVM_VERSION_STRING;
+}
+
 JITGlobals::JITGlobals(llvm::orc::JITTargetMachineBuilder &&jitTargetMachineBuilder, llvm::DataLayout &&dataLayout)
     : jitTargetMachineBuilder(jitTargetMachineBuilder)
     , dataLayout(dataLayout)
@@ -406,6 +424,35 @@ static uint32_t sync_fetch_and_op(uint32_t volatile *ptr, uint32_t val, F f)
 }
 #endif
 
+// Functions of the libraries acquired by JITBuilder::acquireLibrary(), which
+// stay loaded for the lifetime of the process and which all routines may call.
+class LibraryFunctions
+{
+public:
+	static void define(const std::string &name, const void *address)
+	{
+		std::lock_guard<std::mutex> lock(get().mutex);
+		get().functions[name] = const_cast<void *>(address);
+	}
+
+	static void *find(llvm::StringRef name)
+	{
+		std::lock_guard<std::mutex> lock(get().mutex);
+		auto it = get().functions.find(name);
+		return it != get().functions.end() ? it->second : nullptr;
+	}
+
+private:
+	static LibraryFunctions &get()
+	{
+		static LibraryFunctions instance;
+		return instance;
+	}
+
+	std::mutex mutex;
+	llvm::StringMap<void *> functions;
+};
+
 #if LLVM_VERSION_MAJOR >= 12 /* TODO(b/165000222): Unconditional after LLVM 11 upgrade */
 class ExternalSymbolGenerator : public llvm::orc::DefinitionGenerator
 #else
@@ -648,6 +695,12 @@ class ExternalSymbolGenerator : public llvm::orc::JITDylib::DefinitionGenerator
 				continue;
 			}
 
+			if(void *address = LibraryFunctions::find(unmangled))
+			{
+				symbols[name] = toSymbol(address);
+				continue;
+			}
+
 #if __has_feature(memory_sanitizer) || (__has_feature(address_sanitizer) && ADDRESS_SANITIZER_INSTRUMENTATION_SUPPORTED)
 			// Sanitizers use a dynamically linked runtime. Instrumented routines reference some
 			// symbols from this library. Look them up dynamically in the default namespace.
@@ -736,9 +789,148 @@ struct FatalDiagnosticsHandler : public llvm::DiagnosticHandler
 	bool *fatal;
 };
 
-// JITRoutine is a rr::Routine that holds a LLVM JIT session, compiler and
-// object layer as each routine may require different target machine
-// settings and no Reactor routine directly links against another.
+// ObjectCapture hands the relocatable object emitted by the compile layer to
+// the caller, so that it can be persisted and loaded later without going
+// through optimization and codegen again.
+class ObjectCapture final : public llvm::ObjectCache
+{
+public:
+	ObjectCapture(std::string *object)
+	    : object(object)
+	{}
+
+	void notifyObjectCompiled(const llvm::Module *module, llvm::MemoryBufferRef obj) override
+	{
+		object->assign(obj.getBufferStart(), obj.getBufferSize());
+	}
+
+	std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module *module) override
+	{
+		return nullptr;
+	}
+
+private:
+	std::string *object;
+};
+
+// JITSession holds the ORC execution session and the object linking layer.
+// Since LLVM 13 a single session is shared by all routines of the process,
+// each of which links into a JITDylib of its own and frees its code through
+// a resource tracker when it dies. Older versions cannot remove a JITDylib
+// from a session, so there every routine creates a session of its own.
+class JITSession
+{
+public:
+	JITSession();
+	~JITSession();
+
+	static JITSession &get();
+
+	llvm::orc::JITDylib &createJITDylib(const char *name);
+
+private:
+	MemoryMapper memoryMapper;
+	std::atomic<uint64_t> numDylibs{ 0 };
+
+public:
+	llvm::orc::ExecutionSession session;
+	std::unique_ptr<llvm::orc::ObjectLayer> objectLayer;
+};
+
+JITSession::JITSession()
+#if LLVM_VERSION_MAJOR >= 13
+    : session([]() -> std::unique_ptr<llvm::orc::SelfExecutorProcessControl> {
+	    auto p = llvm::orc::SelfExecutorProcessControl::Create();
+	    if (!p) abort(); // shouldn't fail
+	    return std::move(*p);
+    }())
+#endif
+{
+	const llvm::Triple &triple = JITGlobals::get()->getTargetTriple();
+
+#if LLVM_VERSION_MAJOR >= 16
+	// JITLink allocates all sections of an object from one slab and needs no
+	// memory manager per object, but only covers some targets completely.
+	if((triple.isOSBinFormatELF() || triple.isOSBinFormatMachO()) &&
+	   (triple.getArch() == llvm::Triple::x86_64 || triple.getArch() == llvm::Triple::aarch64))
+	{
+		objectLayer = std::make_unique<llvm::orc::ObjectLinkingLayer>(session);
+		return;
+	}
+#else
+	// RuntimeDyld on all targets: the in-process memory manager of JITLink
+	// before LLVM 16 never unmaps allocations without deallocation actions,
+	// which would leak every routine.
+#endif
+
+	auto rtdyldLayer = std::make_unique<llvm::orc::RTDyldObjectLinkingLayer>(session,
+#if LLVM_VERSION_MAJOR >= 21
+	                                                                        [this](const llvm::MemoryBuffer &) {
+		                                                                        return std::make_unique<llvm::SectionMemoryManager>(&memoryMapper);
+	                                                                        }
+#else
+	                                                                        [this]() {
+		                                                                        return std::make_unique<llvm::SectionMemoryManager>(&memoryMapper);
+	                                                                        }
+#endif
+	);
+
+#ifdef ENABLE_RR_DEBUG_INFO
+	// TODO(b/165000222): Update this on next LLVM roll.
+	// https://github.com/llvm/llvm-project/commit/98f2bb4461072347dcca7d2b1b9571b3a6525801
+	// introduces RTDyldObjectLinkingLayer::registerJITEventListener().
+	// The current API does not appear to have any way to bind the
+	// rr::DebugInfo::NotifyFreeingObject event.
+	rtdyldLayer->setNotifyLoaded([](llvm::orc::VModuleKey,
+	                                const llvm::object::ObjectFile &obj,
+	                                const llvm::RuntimeDyld::LoadedObjectInfo &l) {
+		static std::atomic<uint64_t> unique_key{ 0 };
+		rr::DebugInfo::NotifyObjectEmitted(unique_key++, obj, l);
+	});
+#endif  // ENABLE_RR_DEBUG_INFO
+
+	if(triple.isOSBinFormatCOFF())
+	{
+		// Hack to support symbol visibility in COFF.
+		// Matches hack in llvm::orc::LLJIT::createObjectLinkingLayer().
+		// See documentation on these functions for more detail.
+		rtdyldLayer->setOverrideObjectFlagsWithResponsibilityFlags(true);
+		rtdyldLayer->setAutoClaimResponsibilityForObjectSymbols(true);
+	}
+
+	objectLayer = std::move(rtdyldLayer);
+}
+
+JITSession::~JITSession()
+{
+#if LLVM_VERSION_MAJOR >= 12 /* TODO(b/165000222): Unconditional after LLVM 11 upgrade */
+	if(auto err = session.endSession())
+	{
+		session.reportError(std::move(err));
+	}
+#endif
+}
+
+JITSession &JITSession::get()
+{
+	// Never destroyed, as routines held by static caches may outlive it.
+	static JITSession *instance = new JITSession();
+	return *instance;
+}
+
+// JITDylib names must be unique within a session.
+llvm::orc::JITDylib &JITSession::createJITDylib(const char *name)
+{
+	std::string unique = std::string("<") + name + "#" + std::to_string(numDylibs++) + ">";
+	llvm::orc::JITDylib &dylib(Unwrap(session.createJITDylib(std::move(unique))));
+	dylib.addGenerator(std::make_unique<ExternalSymbolGenerator>());
+	return dylib;
+}
+
+// JITRoutine is a rr::Routine that holds the code of one compiled module.
+// The compiler is created per routine as each routine may require different
+// target machine settings, and no Reactor routine directly links against
+// another, so each has a JITDylib of its own.
 class JITRoutine : public rr::Routine
 {
 public:
@@ -748,56 +940,15 @@ public:
 	    const char *name,
 	    llvm::Function **funcs,
 	    size_t count,
-	    const rr::Config &config)
-	    : name(name)
-#if LLVM_VERSION_MAJOR >= 13
-	    , session([]() -> std::unique_ptr<llvm::orc::SelfExecutorProcessControl> {
-		    auto p = llvm::orc::SelfExecutorProcessControl::Create();
-		    if (!p) abort(); // shouldn't fail
-		    return std::move(*p);
-	    }())
-#endif
-	    , objectLayer(session,
-#if LLVM_VERSION_MAJOR >= 21
-	                   [this](const llvm::MemoryBuffer &) {
-		                   return std::make_unique<llvm::SectionMemoryManager>(&memoryMapper);
-	                   }
-#else
-	                   [this]() {
-		                   return std::make_unique<llvm::SectionMemoryManager>(&memoryMapper);
-	                   }
-#endif
-	    )
-	    , addresses(count)
+	    const rr::Config &config,
+	    std::string *object)
+	    : JITRoutine(name, count)
 	{
 		bool fatalCompileIssue = false;
 		context->setDiagnosticHandler(std::make_unique<FatalDiagnosticsHandler>(&fatalCompileIssue), true);
 
-#ifdef ENABLE_RR_DEBUG_INFO
-		// TODO(b/165000222): Update this on next LLVM roll.
-		// https://github.com/llvm/llvm-project/commit/98f2bb4461072347dcca7d2b1b9571b3a6525801
-		// introduces RTDyldObjectLinkingLayer::registerJITEventListener().
-		// The current API does not appear to have any way to bind the
-		// rr::DebugInfo::NotifyFreeingObject event.
-		objectLayer.setNotifyLoaded([](llvm::orc::VModuleKey,
-		                               const llvm::object::ObjectFile &obj,
-		                               const llvm::RuntimeDyld::LoadedObjectInfo &l) {
-			static std::atomic<uint64_t> unique_key{ 0 };
-			rr::DebugInfo::NotifyObjectEmitted(unique_key++, obj, l);
-		});
-#endif  // ENABLE_RR_DEBUG_INFO
-
-		if(JITGlobals::get()->getTargetTriple().isOSBinFormatCOFF())
-		{
-			// Hack to support symbol visibility in COFF.
-			// Matches hack in llvm::orc::LLJIT::createObjectLinkingLayer().
-			// See documentation on these functions for more detail.
-			objectLayer.setOverrideObjectFlagsWithResponsibilityFlags(true);
-			objectLayer.setAutoClaimResponsibilityForObjectSymbols(true);
-		}
-
 		llvm::SmallVector<llvm::orc::SymbolStringPtr, 8> functionNames(count);
-		llvm::orc::MangleAndInterner mangle(session, JITGlobals::get()->getDataLayout());
+		llvm::orc::MangleAndInterner mangle(jit.session, JITGlobals::get()->getDataLayout());
 
 		for(size_t i = 0; i < count; i++)
 		{
@@ -820,48 +971,61 @@ public:
 		// Make sure funcs are not referenced after this point.
 		funcs = nullptr;
 
-		llvm::orc::IRCompileLayer compileLayer(session, objectLayer, std::make_unique<llvm::orc::ConcurrentIRCompiler>(JITGlobals::get()->getTargetMachineBuilder(config.getOptimization().getLevel())));
-		llvm::orc::JITDylib &dylib(Unwrap(session.createJITDylib("<routine>")));
-		dylib.addGenerator(std::make_unique<ExternalSymbolGenerator>());
-
-		llvm::cantFail(compileLayer.add(dylib, llvm::orc::ThreadSafeModule(std::move(module), std::move(context))));
-
-		// Resolve the function addresses.
-		for(size_t i = 0; i < count; i++)
+		std::unique_ptr<ObjectCapture> capture;
+		if(object)
 		{
-			fatalCompileIssue = false;  // May be set to true by session.lookup()
+			capture = std::make_unique<ObjectCapture>(object);
+		}
 
-			// This is where the actual compilation happens.
-			auto symbol = session.lookup({ &dylib }, functionNames[i]);
+		llvm::orc::IRCompileLayer compileLayer(jit.session, *jit.objectLayer, std::make_unique<llvm::orc::ConcurrentIRCompiler>(JITGlobals::get()->getTargetMachineBuilder(config.getOptimization().getLevel()), capture.get()));
 
-			ASSERT_MSG(symbol, "Failed to lookup address of routine function %d: %s",
-			           (int)i, llvm::toString(symbol.takeError()).c_str());
+		llvm::cantFail(compileLayer.add(resources(), llvm::orc::ThreadSafeModule(std::move(module), std::move(context))));
 
-			if(fatalCompileIssue)
-			{
-				addresses[i] = nullptr;
-			}
-			else  // Successful compilation
-			{
-#if LLVM_VERSION_MAJOR < 17
-				addresses[i] = reinterpret_cast<void *>(static_cast<intptr_t>(symbol->getAddress()));
-#else
-				addresses[i] = reinterpret_cast<void *>(static_cast<intptr_t>(symbol->getAddress().getValue()));
-#endif
-			}
-		}
+		// This is where the actual compilation happens.
+		resolve(functionNames, fatalCompileIssue, true);
 
 #ifdef ENABLE_RR_EMIT_ASM_FILE
 		rr::AsmFile::fixupAsmFile(asmFilename, addresses);
 #endif
 	}
 
+	JITRoutine(
+	    const char *name,
+	    const char *const *entries,
+	    size_t count,
+	    const std::string &object)
+	    : JITRoutine(name, count)
+	{
+		bool fatalLoadIssue = false;
+
+		llvm::SmallVector<llvm::orc::SymbolStringPtr, 8> functionNames(count);
+		llvm::orc::MangleAndInterner mangle(jit.session, JITGlobals::get()->getDataLayout());
+
+		for(size_t i = 0; i < count; i++)
+		{
+			functionNames[i] = mangle(entries[i]);
+		}
+
+		auto buffer = llvm::MemoryBuffer::getMemBufferCopy(object, name);
+		if(auto err = jit.objectLayer->add(resources(), std::move(buffer)))
+		{
+			llvm::consumeError(std::move(err));
+			return;
+		}
+
+		resolve(functionNames, fatalLoadIssue, false);
+	}
+
 	~JITRoutine()
 	{
-#if LLVM_VERSION_MAJOR >= 12 /* TODO(b/165000222): Unconditional after LLVM 11 upgrade */
-		if(auto err = session.endSession())
+#if LLVM_VERSION_MAJOR >= 13
+		if(auto err = tracker->remove())
+		{
+			jit.session.reportError(std::move(err));
+		}
+		if(auto err = jit.session.removeJITDylib(dylib))
 		{
-			session.reportError(std::move(err));
+			jit.session.reportError(std::move(err));
 		}
 #endif
 	}
@@ -872,10 +1036,75 @@ public:
 	}
 
 private:
+	JITRoutine(const char *name, size_t count)
+	    : name(name)
+#if LLVM_VERSION_MAJOR >= 13
+	    , jit(JITSession::get())
+#else
+	    , ownSession(new JITSession())
+	    , jit(*ownSession)
+#endif
+	    , dylib(jit.createJITDylib(name))
+#if LLVM_VERSION_MAJOR >= 13
+	    , tracker(dylib.createResourceTracker())
+#endif
+	    , addresses(count)
+	{
+	}
+
+#if LLVM_VERSION_MAJOR >= 13
+	llvm::orc::ResourceTrackerSP resources() const
+	{
+		return tracker;
+	}
+#else
+	llvm::orc::JITDylib &resources() const
+	{
+		return dylib;
+	}
+#endif
+
+	// Resolves the function addresses. Failing to resolve a loaded object is
+	// not fatal, the caller is expected to fall back to compiling from IR.
+	void resolve(llvm::ArrayRef<llvm::orc::SymbolStringPtr> functionNames, bool &fatalIssue, bool required)
+	{
+		for(size_t i = 0; i < functionNames.size(); i++)
+		{
+			fatalIssue = false;  // May be set to true by session.lookup()
+
+			auto symbol = jit.session.lookup({ &dylib }, functionNames[i]);
+
+			if(!symbol)
+			{
+				std::string error = llvm::toString(symbol.takeError());
+				ASSERT_MSG(!required, "Failed to lookup address of routine function %d: %s",
+				           (int)i, error.c_str());
+				addresses[i] = nullptr;
+			}
+			else if(fatalIssue)
+			{
+				addresses[i] = nullptr;
+			}
+			else  // Successful compilation
+			{
+#if LLVM_VERSION_MAJOR < 17
+				addresses[i] = reinterpret_cast<void *>(static_cast<intptr_t>(symbol->getAddress()));
+#else
+				addresses[i] = reinterpret_cast<void *>(static_cast<intptr_t>(symbol->getAddress().getValue()));
+#endif
+			}
+		}
+	}
+
 	std::string name;
-	llvm::orc::ExecutionSession session;
-	MemoryMapper memoryMapper;
-	llvm::orc::RTDyldObjectLinkingLayer objectLayer;
+#if LLVM_VERSION_MAJOR < 13
+	std::unique_ptr<JITSession> ownSession;
+#endif
+	JITSession &jit;
+	llvm::orc::JITDylib &dylib;
+#if LLVM_VERSION_MAJOR >= 13
+	llvm::orc::ResourceTrackerSP tracker;
+#endif
 	std::vector<const void *> addresses;
 };
 
@@ -942,16 +1171,6 @@ void JITBuilder::optimize(const rr::Config &cfg)
 	llvm::ModulePassManager pm;
 
 #if LLVM_VERSION_MAJOR >= 16
-	llvm::OptimizationLevel level;
-	switch(cfg.getOptimization().getLevel())
-	{
-	case rr::Optimization::Level::None: level = llvm::OptimizationLevel::O0; break;
-	case rr::Optimization::Level::Less: level = llvm::OptimizationLevel::O1; break;
-	case rr::Optimization::Level::Default: level = llvm::OptimizationLevel::O2; break;
-	case rr::Optimization::Level::Aggressive: level = llvm::OptimizationLevel::O3; break;
-	default: UNREACHABLE("Unknown Optimization Level %d", int(cfg.getOptimization().getLevel()));
-	}
-
 	if(cfg.getOptimization().getFMF() == Optimization::FMF::FastMath)
 	{
 		for(auto &F : *module)
@@ -963,9 +1182,23 @@ void JITBuilder::optimize(const rr::Config &cfg)
 			F.addFnAttr("approx-func-fp-math", "true");
 		}
 	}
+#endif
+
+	if(cfg.getOptimization().getPipeline() == rr::Optimization::Pipeline::Standard)
+	{
+		switch(cfg.getOptimization().getLevel())
+		{
+		case rr::Optimization::Level::None: pm = pb.buildO0DefaultPipeline(llvm::OptimizationLevel::O0); break;
+		case rr::Optimization::Level::Less: pm = pb.buildPerModuleDefaultPipeline(llvm::OptimizationLevel::O1); break;
+		case rr::Optimization::Level::Default: pm = pb.buildPerModuleDefaultPipeline(llvm::OptimizationLevel::O2); break;
+		case rr::Optimization::Level::Aggressive: pm = pb.buildPerModuleDefaultPipeline(llvm::OptimizationLevel::O3); break;
+		default: UNREACHABLE("Unknown Optimization Level %d", int(cfg.getOptimization().getLevel()));
+		}
+
+		pm.run(*module, mam);
+		return;
+	}
 
-	pm = pb.buildPerModuleDefaultPipeline(level);
-#else
 	llvm::FunctionPassManager fpm;
 
 	for(auto pass : cfg.getOptimization().getPasses())
@@ -983,9 +1216,22 @@ void JITBuilder::optimize(const rr::Config &cfg)
 		case rr::Optimization::Pass::Reassociate: fpm.addPass(llvm::ReassociatePass()); break;
 		case rr::Optimization::Pass::DeadStoreElimination: fpm.addPass(llvm::DSEPass()); break;
 		case rr::Optimization::Pass::SCCP: fpm.addPass(llvm::SCCPPass()); break;
+#if LLVM_VERSION_MAJOR >= 16
 		case rr::Optimization::Pass::ScalarReplAggregates: fpm.addPass(llvm::SROAPass(llvm::SROAOptions::PreserveCFG)); break;
+#else
+		case rr::Optimization::Pass::ScalarReplAggregates: fpm.addPass(llvm::SROAPass()); break;
+#endif
 		case rr::Optimization::Pass::EarlyCSEPass: fpm.addPass(llvm::EarlyCSEPass()); break;
-		case rr::Optimization::Pass::Inline: break;
+		case rr::Optimization::Pass::Inline:
+			// Only functions marked always-inline are inlined. This is a module
+			// pass, so the function passes before it run first.
+			if(!fpm.isEmpty())
+			{
+				pm.addPass(llvm::createModuleToFunctionPassAdaptor(std::move(fpm)));
+				fpm = llvm::FunctionPassManager();
+			}
+			pm.addPass(llvm::AlwaysInlinerPass());
+			break;
 		default:
 			UNREACHABLE("pass: %d", int(pass));
 		}
@@ -995,15 +1241,58 @@ void JITBuilder::optimize(const rr::Config &cfg)
 	{
 		pm.addPass(llvm::createModuleToFunctionPassAdaptor(std::move(fpm)));
 	}
-#endif
 
 	pm.run(*module, mam);
 }
 
-std::shared_ptr<rr::Routine> JITBuilder::acquireRoutine(const char *name, llvm::Function **funcs, size_t count, const rr::Config &cfg)
+std::shared_ptr<rr::Routine> JITBuilder::acquireRoutine(const char *name, llvm::Function **funcs, size_t count, const rr::Config &cfg, std::string *object)
+{
+	ASSERT(module);
+	return std::make_shared<JITRoutine>(std::move(module), std::move(context), name, funcs, count, cfg, object);
+}
+
+void JITBuilder::acquireLibrary(const char *name, const rr::Config &cfg)
 {
 	ASSERT(module);
-	return std::make_shared<JITRoutine>(std::move(module), std::move(context), name, funcs, count, cfg);
+
+	std::vector<llvm::Function *> funcs;
+	std::vector<std::string> names;
+	for(auto &func : *module)
+	{
+		if(!func.isDeclaration() && func.hasExternalLinkage())
+		{
+			funcs.push_back(&func);
+			names.push_back(func.getName().str());
+		}
+	}
+
+	// Never freed, as routines may call the library at any later time.
+	static std::mutex mutex;
+	static auto *libraries = new std::vector<std::shared_ptr<rr::Routine>>();
+
+	auto library = std::make_shared<JITRoutine>(std::move(module), std::move(context), name, funcs.data(), funcs.size(), cfg, nullptr);
+	for(size_t i = 0; i < names.size(); i++)
+	{
+		LibraryFunctions::define(names[i], library->getEntry(static_cast<int>(i)));
+	}
+
+	std::lock_guard<std::mutex> lock(mutex);
+	libraries->push_back(std::move(library));
+}
+
+std::shared_ptr<rr::Routine> Nucleus::loadRoutine(const char *name, const char *entry, const std::string &object)
+{
+	auto routine = std::make_shared<JITRoutine>(name, &entry, 1, object);
+	if(!routine->getEntry(0))
+	{
+		return nullptr;
+	}
+	return routine;
+}
+
+std::string Nucleus::getTargetKey()
+{
+	return JITGlobals::get()->getTargetKey();
 }
 
 }  // namespace rr
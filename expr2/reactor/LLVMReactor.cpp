@@ -570,7 +570,7 @@ Config Nucleus::getDefaultConfig()
 	return ::defaultConfig();
 }
 
-std::shared_ptr<Routine> Nucleus::acquireRoutine(const char *name, const Config::Edit &cfgEdit /* = Config::Edit::None */)
+std::shared_ptr<Routine> Nucleus::acquireRoutine(const char *name, const Config::Edit &cfgEdit /* = Config::Edit::None */, std::string *object /* = nullptr */)
 {
 	if(jit->builder->GetInsertBlock()->empty() || !jit->builder->GetInsertBlock()->back().isTerminator())
 	{
@@ -625,7 +625,7 @@ std::shared_ptr<Routine> Nucleus::acquireRoutine(const char *name, const Config:
 			jit->module->print(file, 0);
 		}
 
-		routine = jit->acquireRoutine(name, &jit->function, 1, cfg);
+		routine = jit->acquireRoutine(name, &jit->function, 1, cfg, object);
 	};
 
 #ifdef JIT_IN_SEPARATE_THREAD
@@ -642,6 +642,27 @@ std::shared_ptr<Routine> Nucleus::acquireRoutine(const char *name, const Config:
 	return routine;
 }
 
+size_t Nucleus::getInstructionCount() const
+{
+	return jit->module->getInstructionCount();
+}
+
+void Nucleus::acquireLibrary(const char *name, const Config::Edit &cfgEdit /* = Config::Edit::None */)
+{
+	auto acquire = [&](rr::JITBuilder *jit) {
+		auto cfg = cfgEdit.apply(jit->config);
+		jit->optimize(cfg);
+		jit->acquireLibrary(name, cfg);
+	};
+
+#ifdef JIT_IN_SEPARATE_THREAD
+	std::thread thread(acquire, jit);
+	thread.join();
+#else
+	acquire(jit);
+#endif
+}
+
 Value *Nucleus::allocateStackVariable(Type *type, int arraySize)
 {
 	// Need to allocate it in the entry block for mem2reg to work
@@ -1217,6 +1238,26 @@ RValue<Int8> Gather(RValue<Pointer<Int>> base, RValue<Int8> offsets, RValue<Int8
 	return As<Int8>(V(createGather(V(base.value()), T(Int::type()), V(offsets.value()), V(mask.value()), alignment, zeroMaskedLanes)));
 }
 
+RValue<Float16> Gather(RValue<Pointer<Float>> base, RValue<Int16> offsets, RValue<Int16> mask, unsigned int alignment, bool zeroMaskedLanes /* = false */)
+{
+	return As<Float16>(V(createGather(V(base.value()), T(Float::type()), V(offsets.value()), V(mask.value()), alignment, zeroMaskedLanes)));
+}
+
+RValue<Byte16> Gather(RValue<Pointer<Byte>> base, RValue<Int16> offsets, RValue<Int16> mask, unsigned int alignment, bool zeroMaskedLanes /* = false */)
+{
+	return As<Byte16>(V(createGather(V(base.value()), T(Byte::type()), V(offsets.value()), V(mask.value()), alignment, zeroMaskedLanes)));
+}
+
+RValue<UShort16> Gather(RValue<Pointer<UShort>> base, RValue<Int16> offsets, RValue<Int16> mask, unsigned int alignment, bool zeroMaskedLanes /* = false */)
+{
+	return As<UShort16>(V(createGather(V(base.value()), T(UShort::type()), V(offsets.value()), V(mask.value()), alignment, zeroMaskedLanes)));
+}
+
+RValue<Int16> Gather(RValue<Pointer<Int>> base, RValue<Int16> offsets, RValue<Int16> mask, unsigned int alignment, bool zeroMaskedLanes /* = false */)
+{
+	return As<Int16>(V(createGather(V(base.value()), T(Int::type()), V(offsets.value()), V(mask.value()), alignment, zeroMaskedLanes)));
+}
+
 static void createScatter(llvm::Value *base, llvm::Value *val, llvm::Value *offsets, llvm::Value *mask, unsigned int alignment)
 {
 	ASSERT(base->getType()->isPointerTy());
@@ -1838,8 +1879,8 @@ Value *Nucleus::createConstantVector(const double *constants, Type *type)
 	ASSERT(llvm::isa<llvm::VectorType>(T(type)));
 	const int numConstants = elementCount(type);                                           // Number of provided constants for the (emulated) type.
 	const int numElements = llvm::cast<llvm::FixedVectorType>(T(type))->getNumElements();  // Number of elements of the underlying vector type.
-	ASSERT(numElements <= 8 && numConstants <= numElements);
-	llvm::Constant *constantVector[8];
+	ASSERT(numElements <= 16 && numConstants <= numElements);
+	llvm::Constant *constantVector[16];
 
 	for(int i = 0; i < numElements; i++)
 	{
@@ -2374,6 +2415,11 @@ Type *UShort8::type()
 	return T(llvm::VectorType::get(T(UShort::type()), 8, false));
 }
 
+Type *UShort16::type()
+{
+	return T(llvm::VectorType::get(T(UShort::type()), 16, false));
+}
+
 RValue<Int> operator++(Int &val, int)  // Post-increment
 {
 	RR_DEBUG_INFO_UPDATE_LOC();
@@ -3079,6 +3125,100 @@ RValue<UInt8> operator>>(RValue<UInt8> lhs, unsigned char rhs)
 	return As<UInt8>(V(lowerVectorLShr(V(lhs.value()), rhs)));
 }
 
+// 16 element vectors are only natively supported with AVX-512. All operations
+// are lowered to target independent IR, which LLVM splits into two halves on
+// narrower targets.
+Type *Int16::type()
+{
+	return T(llvm::VectorType::get(T(Int::type()), 16, false));
+}
+
+Int16::Int16(RValue<Byte16> cast)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	Value *c = V(jit->builder->CreateZExt(V(cast.value()), T(Int16::type())));
+	*this = As<Int16>(c);
+}
+
+Int16::Int16(RValue<UShort16> cast)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	Value *c = V(jit->builder->CreateZExt(V(cast.value()), T(Int16::type())));
+	*this = As<Int16>(c);
+}
+
+Int16::Int16(RValue<Int> rhs)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	Value *vector = loadValue();
+	Value *insert = Nucleus::createInsertElement(vector, rhs.value(), 0);
+
+	int swizzle[16] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+	Value *replicate = Nucleus::createShuffleVector(insert, insert, swizzle);
+
+	storeValue(replicate);
+}
+
+RValue<Int16> operator<<(RValue<Int16> lhs, unsigned char rhs)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return As<Int16>(V(lowerVectorShl(V(lhs.value()), rhs)));
+}
+
+RValue<Int16> operator>>(RValue<Int16> lhs, unsigned char rhs)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return As<Int16>(V(lowerVectorAShr(V(lhs.value()), rhs)));
+}
+
+RValue<Int16> CmpEQ(RValue<Int16> x, RValue<Int16> y)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return RValue<Int16>(Nucleus::createSExt(Nucleus::createICmpEQ(x.value(), y.value()), Int16::type()));
+}
+
+RValue<Int16> CmpLT(RValue<Int16> x, RValue<Int16> y)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return RValue<Int16>(Nucleus::createSExt(Nucleus::createICmpSLT(x.value(), y.value()), Int16::type()));
+}
+
+RValue<Int16> CmpLE(RValue<Int16> x, RValue<Int16> y)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return RValue<Int16>(Nucleus::createSExt(Nucleus::createICmpSLE(x.value(), y.value()), Int16::type()));
+}
+
+RValue<Int16> CmpNEQ(RValue<Int16> x, RValue<Int16> y)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return RValue<Int16>(Nucleus::createSExt(Nucleus::createICmpNE(x.value(), y.value()), Int16::type()));
+}
+
+RValue<Int16> CmpNLT(RValue<Int16> x, RValue<Int16> y)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return RValue<Int16>(Nucleus::createSExt(Nucleus::createICmpSGE(x.value(), y.value()), Int16::type()));
+}
+
+RValue<Int16> CmpNLE(RValue<Int16> x, RValue<Int16> y)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return RValue<Int16>(Nucleus::createSExt(Nucleus::createICmpSGT(x.value(), y.value()), Int16::type()));
+}
+
+RValue<Int16> Max(RValue<Int16> x, RValue<Int16> y)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return As<Int16>(V(lowerPMINMAX(V(x.value()), V(y.value()), llvm::ICmpInst::ICMP_SGT)));
+}
+
+RValue<Int16> Min(RValue<Int16> x, RValue<Int16> y)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return As<Int16>(V(lowerPMINMAX(V(x.value()), V(y.value()), llvm::ICmpInst::ICMP_SLT)));
+}
+
 Type *Half::type()
 {
 	return T(llvm::Type::getInt16Ty(*jit->context));
@@ -3734,6 +3874,7 @@ RValue<FloatT> Log2(RValue<FloatT> v)
 	template RValue<FloatT> Log2<FloatT>(RValue<FloatT> v);
 INSTANTIATE_FUNCS(Float4);
 INSTANTIATE_FUNCS(Float8);
+INSTANTIATE_FUNCS(Float16);
 #undef INSTANTIATE_FUNCS
 
 RValue<UInt> Ctlz(RValue<UInt> v, bool isZeroUndef)
@@ -3941,6 +4082,106 @@ RValue<Float8> Sqrt(RValue<Float8> x)
 	return As<Float8>(V(lowerSQRT(V(x.value()))));
 }
 
+Type *Float16::type()
+{
+	return T(llvm::VectorType::get(T(Float::type()), 16, false));
+}
+
+RValue<Float16> operator%(RValue<Float16> lhs, RValue<Float16> rhs)
+{
+	return RValue<Float16>(Nucleus::createFRem(lhs.value(), rhs.value()));
+}
+
+Float16::Float16(RValue<Float> rhs)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	Value *vector = loadValue();
+	Value *insert = Nucleus::createInsertElement(vector, rhs.value(), 0);
+
+	int swizzle[16] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+	Value *replicate = Nucleus::createShuffleVector(insert, insert, swizzle);
+
+	storeValue(replicate);
+}
+
+RValue<Int16> CmpEQ(RValue<Float16> x, RValue<Float16> y)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return RValue<Int16>(Nucleus::createSExt(Nucleus::createFCmpOEQ(x.value(), y.value()), Int16::type()));
+}
+
+RValue<Int16> CmpLT(RValue<Float16> x, RValue<Float16> y)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return RValue<Int16>(Nucleus::createSExt(Nucleus::createFCmpOLT(x.value(), y.value()), Int16::type()));
+}
+
+RValue<Int16> CmpLE(RValue<Float16> x, RValue<Float16> y)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return RValue<Int16>(Nucleus::createSExt(Nucleus::createFCmpOLE(x.value(), y.value()), Int16::type()));
+}
+
+RValue<Int16> CmpNEQ(RValue<Float16> x, RValue<Float16> y)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return RValue<Int16>(Nucleus::createSExt(Nucleus::createFCmpONE(x.value(), y.value()), Int16::type()));
+}
+
+RValue<Int16> CmpNLT(RValue<Float16> x, RValue<Float16> y)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return RValue<Int16>(Nucleus::createSExt(Nucleus::createFCmpOGE(x.value(), y.value()), Int16::type()));
+}
+
+RValue<Int16> CmpNLE(RValue<Float16> x, RValue<Float16> y)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return RValue<Int16>(Nucleus::createSExt(Nucleus::createFCmpOGT(x.value(), y.value()), Int16::type()));
+}
+
+RValue<Float16> Max(RValue<Float16> x, RValue<Float16> y)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return As<Float16>(V(lowerPFMINMAX(V(x.value()), V(y.value()), llvm::FCmpInst::FCMP_OGT)));
+}
+
+RValue<Float16> Min(RValue<Float16> x, RValue<Float16> y)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return As<Float16>(V(lowerPFMINMAX(V(x.value()), V(y.value()), llvm::FCmpInst::FCMP_OLT)));
+}
+
+RValue<Float16> Round(RValue<Float16> x)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return Float16(RoundInt(x));
+}
+
+RValue<Int16> RoundInt(RValue<Float16> cast)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return As<Int16>(V(lowerRoundInt(V(cast.value()), T(Int16::type()))));
+}
+
+RValue<Float16> Trunc(RValue<Float16> x)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return RValue<Float16>(V(lowerTrunc(V(x.value()))));
+}
+
+RValue<Float16> Floor(RValue<Float16> x)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return RValue<Float16>(V(lowerFloor(V(x.value()))));
+}
+
+RValue<Float16> Sqrt(RValue<Float16> x)
+{
+	RR_DEBUG_INFO_UPDATE_LOC();
+	return As<Float16>(V(lowerSQRT(V(x.value()))));
+}
+
 RValue<Long> Ticks()
 {
 	RR_DEBUG_INFO_UPDATE_LOC();
@@ -4840,6 +5081,16 @@ void *Nucleus::getLastFunction()
 	return jit->function;
 }
 
+void *Nucleus::declareFunction(const char *name, Type *ReturnType, const std::vector<Type *> &Params)
+{
+	if(auto func = jit->module->getFunction(name))
+	{
+		return func;
+	}
+
+	return rr::createFunction(name, T(ReturnType), T(Params));
+}
+
 Value *Call(llvm::Function *func, std::initializer_list<Value *> args)
 {
 	llvm::SmallVector<llvm::Value *, 8> arguments;
@@ -4852,6 +5103,11 @@ void setPure(llvm::Function *func) {
 	func->addFnAttr(llvm::Attribute::WillReturn);
 }
 
+void setInline(llvm::Function *func) {
+	func->setLinkage(llvm::GlobalValue::InternalLinkage);
+	func->addFnAttr(llvm::Attribute::AlwaysInline);
+}
+
 void Module::add(llvm::Function *f, const char *name)
 {
 	functions.push_back(f);
@@ -4859,10 +5115,10 @@ void Module::add(llvm::Function *f, const char *name)
 		f->setName(name);
 }
 
-std::shared_ptr<Routine> Module::acquire(const char *name, const Config::Edit &cfgEdit /* = Config::Edit::None */)
+// Return creates a new basicblock, which we have to terminate with a return instruction.
+static void terminateFunctions(const std::vector<llvm::Function *> &functions)
 {
 	for (auto f: functions) {
-		// Return creates a new basicblock, which we have to terminate with a return instruction.
 		jit->builder->SetInsertPoint(&f->back());
 		if(jit->builder->GetInsertBlock()->empty() || !jit->builder->GetInsertBlock()->back().isTerminator())
 		{
@@ -4879,7 +5135,23 @@ std::shared_ptr<Routine> Module::acquire(const char *name, const Config::Edit &c
 			}
 		}
 	}
-	return core->acquireRoutine(name, cfgEdit);
+}
+
+std::shared_ptr<Routine> Module::acquire(const char *name, const Config::Edit &cfgEdit /* = Config::Edit::None */, std::string *object /* = nullptr */)
+{
+	terminateFunctions(functions);
+	return core->acquireRoutine(name, cfgEdit, object);
+}
+
+void Module::acquireLibrary(const char *name, const Config::Edit &cfgEdit /* = Config::Edit::None */)
+{
+	terminateFunctions(functions);
+	core->acquireLibrary(name, cfgEdit);
+}
+
+size_t Module::getInstructionCount() const
+{
+	return core->getInstructionCount();
 }
 
 
@@ -4935,6 +5207,32 @@ RValue<UShort8> TryFP32To16(RValue<Float8> x, bool &ok)
 	return res;
 }
 
+RValue<Float16> TryFP16To32(RValue<UShort16> x, bool &ok)
+{
+	Float16 res = 0;
+	ok = false;
+#if LLVM_VERSION_MAJOR >= 11
+	ok = true;
+	auto halfType = llvm::Type::getHalfTy(*jit->context);
+	auto halfVecType = llvm::VectorType::get(halfType, 16, false);
+	auto xh = jit->builder->CreateBitCast(V(x.value()), halfVecType);
+	return As<Float16>(V(jit->builder->CreateFPExt(xh, T(Float16::type()), "half2flt")));
+#endif
+	return res;
+}
+
+RValue<UShort16> TryFP32To16(RValue<Float16> x, bool &ok)
+{
+	UShort16 res = 0;
+	ok = false;
+#if LLVM_VERSION_MAJOR >= 11
+	ok = true;
+	auto halfType = llvm::Type::getHalfTy(*jit->context);
+	auto halfVecType = llvm::VectorType::get(halfType, 16, false);
+	return As<UShort16>(V(jit->builder->CreateFPTrunc(V(x.value()), halfVecType, "flt2half")));
+#endif
+	return res;
+}
 
 // specialize for all float types
 #define SPECIALIZE(type) \
@@ -4943,6 +5241,7 @@ RValue<UShort8> TryFP32To16(RValue<Float8> x, bool &ok)
 SPECIALIZE(Float);
 SPECIALIZE(Float4);
 SPECIALIZE(Float8);
+SPECIALIZE(Float16);
 #undef SPECIALIZE
 
 }  // namespace rr
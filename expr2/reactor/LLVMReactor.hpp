@@ -92,7 +92,8 @@ public:
 
 	void optimize(const rr::Config &cfg);
 
-	std::shared_ptr<rr::Routine> acquireRoutine(const char *name, llvm::Function **funcs, size_t count, const rr::Config &cfg);
+	std::shared_ptr<rr::Routine> acquireRoutine(const char *name, llvm::Function **funcs, size_t count, const rr::Config &cfg, std::string *object = nullptr);
+	void acquireLibrary(const char *name, const rr::Config &cfg);
 
 	const Config config;
 	std::unique_ptr<llvm::LLVMContext> context;
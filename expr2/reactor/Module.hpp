@@ -57,12 +57,20 @@ public:
 	//Nucleus *getCore() { return core.get(); }
 	void add(llvm::Function *f, const char *name);
 
-	std::shared_ptr<Routine> acquire(const char *name, const Config::Edit &cfgEdit = Config::Edit::None);
+	std::shared_ptr<Routine> acquire(const char *name, const Config::Edit &cfgEdit = Config::Edit::None, std::string *object = nullptr);
+	// Compiles the functions into a library instead, see Nucleus::acquireLibrary().
+	void acquireLibrary(const char *name, const Config::Edit &cfgEdit = Config::Edit::None);
+	// Size of the functions built so far, see Nucleus::getInstructionCount().
+	size_t getInstructionCount() const;
+
+	// Tag for ModuleFunctions that declare a function of a library.
+	struct Declaration {};
 };
 
 // Internal use only.
 Value *Call(llvm::Function *func, std::initializer_list<Value *> args);
 void setPure(llvm::Function *func);
+void setInline(llvm::Function *func);
 
 // Generic template, leave undefined!
 template<typename FunctionType>
@@ -77,6 +85,9 @@ class ModuleFunction<Return(Arguments...)>
 
 public:
 	ModuleFunction(Module &m, const char *name = nullptr);
+	// Declares the function of that name of a library, which has no body in
+	// this module.
+	ModuleFunction(Module &m, const char *name, Module::Declaration);
 
 	template<int index>
 	Argument<typename std::tuple_element<index, std::tuple<Arguments...>>::type> Arg() const
@@ -86,6 +97,8 @@ public:
 	}
 
 	ModuleFunction &setPure() { rr::setPure(func); return *this; }
+	// Always inlines the function into its callers and drops it afterwards.
+	ModuleFunction &setInline() { rr::setInline(func); return *this; }
 
 	RValue<Return> Call(RValue<Arguments> ...args)
 	{
@@ -121,6 +134,22 @@ ModuleFunction<Return(Arguments...)>::ModuleFunction(Module &m, const char *name
 	m.add(func = static_cast<llvm::Function *>(Nucleus::getLastFunction()), name);
 }
 
+template<typename Return, typename... Arguments>
+ModuleFunction<Return(Arguments...)>::ModuleFunction(Module &m, const char *name, Module::Declaration)
+{
+	mod = &m;
+	retType = Return::type();
+	Type *types[] = { Arguments::type()... };
+	for(Type *type : types)
+	{
+		if(type != Void::type())
+		{
+			argTypes.push_back(type);
+		}
+	}
+	func = static_cast<llvm::Function *>(Nucleus::declareFunction(name, Return::type(), argTypes));
+}
+
 
 }  // namespace rr
 
@@ -77,10 +77,19 @@ public:
 
 	using Passes = std::vector<Pass>;
 
-	Optimization(Level level = Level::Default, FMF fmf = FMF::NoFastMath,  const Passes &passes = {})
+	// Where the optimization passes come from: the list of passes, or the
+	// standard pipeline of the level that LLVM builds.
+	enum class Pipeline
+	{
+		Passes,
+		Standard,
+	};
+
+	Optimization(Level level = Level::Default, FMF fmf = FMF::NoFastMath,  const Passes &passes = {}, Pipeline pipeline = Pipeline::Passes)
 	    : level(level)
 	    , fmf(fmf)
 	    , passes(passes)
+	    , pipeline(pipeline)
 	{
 #if defined(REACTOR_DEFAULT_OPT_LEVEL)
 		{
@@ -92,11 +101,13 @@ public:
 	Level getLevel() const { return level; }
 	FMF getFMF() const { return fmf; }
 	const Passes &getPasses() const { return passes; }
+	Pipeline getPipeline() const { return pipeline; }
 
 private:
 	Level level = Level::Default;
 	FMF fmf = FMF::NoFastMath;
 	Passes passes;
+	Pipeline pipeline = Pipeline::Passes;
 };
 
 // Config holds the Reactor configuration settings.
@@ -123,6 +134,12 @@ public:
 			fmfChanged = true;
 			return *this;
 		}
+		Edit &set(Optimization::Pipeline source)
+		{
+			pipeline = source;
+			pipelineChanged = true;
+			return *this;
+		}
 		Edit &add(Optimization::Pass pass)
 		{
 			optPassEdits.push_back({ ListEdit::Add, pass });
@@ -155,8 +172,10 @@ public:
 
 		Optimization::Level optLevel;
 		Optimization::FMF fmf;
+		Optimization::Pipeline pipeline;
 		bool optLevelChanged = false;
 		bool fmfChanged = false;
+		bool pipelineChanged = false;
 		std::vector<OptPassesEdit> optPassEdits;
 	};
 
@@ -184,7 +203,20 @@ public:
 	static void adjustDefaultConfig(const Config::Edit &cfgEdit);
 	static Config getDefaultConfig();
 
-	std::shared_ptr<Routine> acquireRoutine(const char *name, const Config::Edit &cfgEdit = Config::Edit::None);
+	std::shared_ptr<Routine> acquireRoutine(const char *name, const Config::Edit &cfgEdit = Config::Edit::None, std::string *object = nullptr);
+
+	// Relocatable object code of an acquired routine can be captured by
+	// passing object to acquireRoutine(), and later loaded back as a routine
+	// on a host with the same getTargetKey(). entry is the name of the
+	// routine function. Returns nullptr if the object can not be loaded.
+	static std::shared_ptr<Routine> loadRoutine(const char *name, const char *entry, const std::string &object);
+	// Compiles all functions of the module into a library that stays loaded
+	// for the lifetime of the process. Routines acquired afterwards may call
+	// its functions through declareFunction() with the same name.
+	void acquireLibrary(const char *name, const Config::Edit &cfgEdit = Config::Edit::None);
+	// Number of instructions generated so far, before any optimization.
+	size_t getInstructionCount() const;
+	static std::string getTargetKey();
 
 	static Value *allocateStackVariable(Type *type, int arraySize = 0);
 	static BasicBlock *createBasicBlock();
@@ -353,6 +385,9 @@ public:
 	static Type *getPrintfStorageType(Type *valueType);
 
 	static void *getLastFunction();
+	// Declares a function defined by a library, see acquireLibrary(), without
+	// changing the function being built.
+	static void *declareFunction(const char *name, Type *returnType, const std::vector<Type *> &paramTypes);
 
 	// Diagnostic utilities
 	struct OptimizerReport
@@ -44,9 +44,10 @@ Config Config::Edit::apply(const Config &cfg) const
 
 	auto level = optLevelChanged ? optLevel : cfg.optimization.getLevel();
 	auto fmflag = fmfChanged ? fmf : cfg.optimization.getFMF();
+	auto source = pipelineChanged ? pipeline : cfg.optimization.getPipeline();
 	auto passes = cfg.optimization.getPasses();
 	apply(optPassEdits, passes);
-	return Config{ Optimization{ level, fmflag, passes } };
+	return Config{ Optimization{ level, fmflag, passes, source } };
 }
 
 template<typename T>
@@ -282,6 +283,19 @@ static Value *createSwizzle8(Value *val, uint32_t select)
 	return Nucleus::createShuffleVector(val, val, swizzle);
 }
 
+// Same as createSwizzle8, but for 16 element vectors with a 64-bit select
+// value holding one hex digit per element.
+static Value *createSwizzle16(Value *val, uint64_t select)
+{
+	int swizzle[16];
+	for(int i = 0; i < 16; i++)
+	{
+		swizzle[i] = static_cast<int>((select >> (60 - 4 * i)) & 0x0F);
+	}
+
+	return Nucleus::createShuffleVector(val, val, swizzle);
+}
+
 static Value *createMask4(Value *lhs, Value *rhs, uint16_t select)
 {
 	bool mask[4] = { false, false, false, false };
@@ -1778,6 +1792,11 @@ RValue<Byte16> Byte16::operator=(const Reference<Byte16> &rhs)
 	return store(rhs.load());
 }
 
+Byte16::Byte16(RValue<UShort16> cast)
+{
+	storeValue(Nucleus::createTrunc(cast.value(), Byte16::type()));
+}
+
 RValue<Byte16> Swizzle(RValue<Byte16> x, uint64_t select)
 {
 	int shuffle[16] = {
@@ -2332,6 +2351,60 @@ RValue<UShort8> Swizzle(RValue<UShort8> x, uint32_t select)
 	return RValue<UShort8>(createSwizzle8(x.value(), select));
 }
 
+UShort16::UShort16(RValue<Int16> cast)
+{
+	storeValue(Nucleus::createTrunc(cast.value(), UShort16::type()));
+}
+
+UShort16::UShort16(unsigned short c)
+{
+	int64_t constantVector[16] = { c, c, c, c, c, c, c, c, c, c, c, c, c, c, c, c };
+	storeValue(Nucleus::createConstantVector(constantVector, type()));
+}
+
+UShort16::UShort16(RValue<UShort16> rhs)
+{
+	store(rhs);
+}
+
+UShort16::UShort16(const UShort16 &rhs)
+{
+	store(rhs.load());
+}
+
+UShort16::UShort16(const Reference<UShort16> &rhs)
+{
+	store(rhs.load());
+}
+
+UShort16::UShort16(RValue<UShort8> lo, RValue<UShort8> hi)
+{
+	int shuffle[16] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 };
+	Value *packed = Nucleus::createShuffleVector(lo.value(), hi.value(), shuffle);
+
+	storeValue(packed);
+}
+
+RValue<UShort16> UShort16::operator=(RValue<UShort16> rhs)
+{
+	return store(rhs);
+}
+
+RValue<UShort16> UShort16::operator=(const UShort16 &rhs)
+{
+	return store(rhs.load());
+}
+
+RValue<UShort16> UShort16::operator=(const Reference<UShort16> &rhs)
+{
+	return store(rhs.load());
+}
+
+RValue<UShort16> Swizzle(RValue<UShort16> x, uint64_t select)
+{
+	return RValue<UShort16>(createSwizzle16(x.value(), select));
+}
+
 Int::Int(Argument<Int> argument)
 {
 	store(argument.rvalue());
@@ -4101,6 +4174,163 @@ RValue<UInt> Extract(RValue<UInt8> x, int i)
 	return RValue<UInt>(Nucleus::createExtractElement(x.value(), UInt::type(), i));
 }
 
+Int16::Int16()
+{
+}
+
+Int16::Int16(RValue<Float16> cast)
+{
+	Value *t = Nucleus::createFPToSI(cast.value(), Int16::type());
+
+	storeValue(t);
+}
+
+Int16::Int16(int x)
+{
+	constant(x);
+}
+
+void Int16::constant(int x)
+{
+	int64_t constantVector[16] = { x, x, x, x, x, x, x, x, x, x, x, x, x, x, x, x };
+	storeValue(Nucleus::createConstantVector(constantVector, type()));
+}
+
+Int16::Int16(RValue<Int16> rhs)
+{
+	store(rhs);
+}
+
+Int16::Int16(const Int16 &rhs)
+{
+	store(rhs.load());
+}
+
+Int16::Int16(const Reference<Int16> &rhs)
+{
+	store(rhs.load());
+}
+
+Int16::Int16(RValue<Int8> lo, RValue<Int8> hi)
+{
+	int shuffle[16] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 };
+	Value *packed = Nucleus::createShuffleVector(lo.value(), hi.value(), shuffle);
+
+	storeValue(packed);
+}
+
+Int16::Int16(const Int &rhs)
+{
+	*this = RValue<Int>(rhs.loadValue());
+}
+
+Int16::Int16(const Reference<Int> &rhs)
+{
+	*this = RValue<Int>(rhs.loadValue());
+}
+
+RValue<Int16> Int16::operator=(RValue<Int16> rhs)
+{
+	return store(rhs);
+}
+
+RValue<Int16> Int16::operator=(const Int16 &rhs)
+{
+	return store(rhs.load());
+}
+
+RValue<Int16> Int16::operator=(const Reference<Int16> &rhs)
+{
+	return store(rhs.load());
+}
+
+RValue<Int16> operator+(RValue<Int16> lhs, RValue<Int16> rhs)
+{
+	return RValue<Int16>(Nucleus::createAdd(lhs.value(), rhs.value()));
+}
+
+RValue<Int16> operator-(RValue<Int16> lhs, RValue<Int16> rhs)
+{
+	return RValue<Int16>(Nucleus::createSub(lhs.value(), rhs.value()));
+}
+
+RValue<Int16> operator*(RValue<Int16> lhs, RValue<Int16> rhs)
+{
+	return RValue<Int16>(Nucleus::createMul(lhs.value(), rhs.value()));
+}
+
+RValue<Int16> operator/(RValue<Int16> lhs, RValue<Int16> rhs)
+{
+	return RValue<Int16>(Nucleus::createSDiv(lhs.value(), rhs.value()));
+}
+
+RValue<Int16> operator%(RValue<Int16> lhs, RValue<Int16> rhs)
+{
+	return RValue<Int16>(Nucleus::createSRem(lhs.value(), rhs.value()));
+}
+
+RValue<Int16> operator&(RValue<Int16> lhs, RValue<Int16> rhs)
+{
+	return RValue<Int16>(Nucleus::createAnd(lhs.value(), rhs.value()));
+}
+
+RValue<Int16> operator|(RValue<Int16> lhs, RValue<Int16> rhs)
+{
+	return RValue<Int16>(Nucleus::createOr(lhs.value(), rhs.value()));
+}
+
+RValue<Int16> operator^(RValue<Int16> lhs, RValue<Int16> rhs)
+{
+	return RValue<Int16>(Nucleus::createXor(lhs.value(), rhs.value()));
+}
+
+RValue<Int16> operator<<(RValue<Int16> lhs, RValue<Int16> rhs)
+{
+	return RValue<Int16>(Nucleus::createShl(lhs.value(), rhs.value()));
+}
+
+RValue<Int16> operator>>(RValue<Int16> lhs, RValue<Int16> rhs)
+{
+	return RValue<Int16>(Nucleus::createAShr(lhs.value(), rhs.value()));
+}
+
+RValue<Int16> operator+(RValue<Int16> val)
+{
+	return val;
+}
+
+RValue<Int16> operator-(RValue<Int16> val)
+{
+	return RValue<Int16>(Nucleus::createNeg(val.value()));
+}
+
+RValue<Int16> operator~(RValue<Int16> val)
+{
+	return RValue<Int16>(Nucleus::createNot(val.value()));
+}
+
+RValue<Int16> Abs(RValue<Int16> x)
+{
+	// TODO: Optimize.
+	auto negative = x >> 31;
+	return (x ^ negative) - negative;
+}
+
+RValue<Int16> Insert(RValue<Int16> x, RValue<Int> element, int i)
+{
+	return RValue<Int16>(Nucleus::createInsertElement(x.value(), element.value(), i));
+}
+
+RValue<Int> Extract(RValue<Int16> x, int i)
+{
+	return RValue<Int>(Nucleus::createExtractElement(x.value(), Int::type(), i));
+}
+
+RValue<Int16> Swizzle(RValue<Int16> x, uint64_t select)
+{
+	return RValue<Int16>(createSwizzle16(x.value(), select));
+}
+
 
 Half::Half(RValue<Float> cast)
 {
@@ -4898,6 +5128,178 @@ RValue<Float8> Swizzle(RValue<Float8> x, uint32_t select)
 	return RValue<Float8>(createSwizzle8(x.value(), select));
 }
 
+Float16::Float16(RValue<Byte16> cast)
+{
+	Value *a = Int16(cast).loadValue();
+
+	storeValue(Nucleus::createSIToFP(a, Float16::type()));
+}
+
+Float16::Float16(RValue<UShort16> cast)
+{
+	Value *a = Int16(cast).loadValue();
+
+	storeValue(Nucleus::createSIToFP(a, Float16::type()));
+}
+
+Float16::Float16(RValue<Int16> cast)
+{
+	Value *x = Nucleus::createSIToFP(cast.value(), Float16::type());
+
+	storeValue(x);
+}
+
+Float16::Float16()
+{
+}
+
+Float16::Float16(float x)
+{
+	constant(x);
+}
+
+void Float16::constant(float x)
+{
+	// See Float(float) constructor for the rationale behind this assert.
+	ASSERT(std::isfinite(x));
+
+	double constantVector[16] = { x, x, x, x, x, x, x, x, x, x, x, x, x, x, x, x };
+	storeValue(Nucleus::createConstantVector(constantVector, type()));
+}
+
+Float16::Float16(RValue<Float16> rhs)
+{
+	store(rhs);
+}
+
+Float16::Float16(const Float16 &rhs)
+{
+	store(rhs.load());
+}
+
+Float16::Float16(const Reference<Float16> &rhs)
+{
+	store(rhs.load());
+}
+
+Float16::Float16(const Float &rhs)
+{
+	*this = RValue<Float>(rhs.loadValue());
+}
+
+Float16::Float16(const Reference<Float> &rhs)
+{
+	*this = RValue<Float>(rhs.loadValue());
+}
+
+Float16::Float16(RValue<Float8> lo, RValue<Float8> hi)
+{
+	int shuffle[16] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 };
+	Value *packed = Nucleus::createShuffleVector(lo.value(), hi.value(), shuffle);
+
+	storeValue(packed);
+}
+
+Float16::Float16(Argument<Float16> argument)
+{
+	store(argument.rvalue());
+}
+
+RValue<Float16> Float16::operator=(float x)
+{
+	return *this = Float16(x);
+}
+
+RValue<Float16> Float16::operator=(RValue<Float16> rhs)
+{
+	return store(rhs);
+}
+
+RValue<Float16> Float16::operator=(const Float16 &rhs)
+{
+	return store(rhs.load());
+}
+
+RValue<Float16> Float16::operator=(const Reference<Float16> &rhs)
+{
+	return store(rhs.load());
+}
+
+RValue<Float16> Float16::operator=(RValue<Float> rhs)
+{
+	return *this = Float16(rhs);
+}
+
+RValue<Float16> Float16::operator=(const Float &rhs)
+{
+	return *this = Float16(rhs);
+}
+
+RValue<Float16> Float16::operator=(const Reference<Float> &rhs)
+{
+	return *this = Float16(rhs);
+}
+
+RValue<Float16> operator+(RValue<Float16> lhs, RValue<Float16> rhs)
+{
+	return RValue<Float16>(Nucleus::createFAdd(lhs.value(), rhs.value()));
+}
+
+RValue<Float16> operator-(RValue<Float16> lhs, RValue<Float16> rhs)
+{
+	return RValue<Float16>(Nucleus::createFSub(lhs.value(), rhs.value()));
+}
+
+RValue<Float16> operator*(RValue<Float16> lhs, RValue<Float16> rhs)
+{
+	return RValue<Float16>(Nucleus::createFMul(lhs.value(), rhs.value()));
+}
+
+RValue<Float16> operator/(RValue<Float16> lhs, RValue<Float16> rhs)
+{
+	return RValue<Float16>(Nucleus::createFDiv(lhs.value(), rhs.value()));
+}
+
+RValue<Float16> operator+(RValue<Float16> val)
+{
+	return val;
+}
+
+RValue<Float16> operator-(RValue<Float16> val)
+{
+	return RValue<Float16>(Nucleus::createFNeg(val.value()));
+}
+
+RValue<Float16> Abs(RValue<Float16> x)
+{
+	return As<Float16>(As<Int16>(x) & Int16(0x7FFFFFFF));
+}
+
+RValue<Int16> IsInf(RValue<Float16> x)
+{
+	return CmpEQ(As<Int16>(x) & Int16(0x7FFFFFFF), Int16(0x7F800000));
+}
+
+RValue<Int16> IsNan(RValue<Float16> x)
+{
+	return ~CmpEQ(x, x);
+}
+
+RValue<Float16> Insert(RValue<Float16> x, RValue<Float> element, int i)
+{
+	return RValue<Float16>(Nucleus::createInsertElement(x.value(), element.value(), i));
+}
+
+RValue<Float> Extract(RValue<Float16> x, int i)
+{
+	return RValue<Float>(Nucleus::createExtractElement(x.value(), Float::type(), i));
+}
+
+RValue<Float16> Swizzle(RValue<Float16> x, uint64_t select)
+{
+	return RValue<Float16>(createSwizzle16(x.value(), select));
+}
+
 
 RValue<Pointer<Byte>> operator+(RValue<Pointer<Byte>> lhs, int offset)
 {
@@ -102,6 +102,7 @@ class Short4;
 class UShort4;
 class Short8;
 class UShort8;
+class UShort16;
 class Int;
 class UInt;
 class Int2;
@@ -110,12 +111,14 @@ class Int4;
 class UInt4;
 class Int8;
 class UInt8;
+class Int16;
 class Long;
 class Half;
 class Float;
 class Float2;
 class Float4;
 class Float8;
+class Float16;
 
 // Returns whether a value is constant after constant folding. Internal use only.
 RValue<Bool> isConstant(Value *);
@@ -784,6 +787,8 @@ RValue<Byte8> CmpEQ(RValue<SByte8> x, RValue<SByte8> y);
 class Byte16 : public LValue<Byte16>
 {
 public:
+	explicit Byte16(RValue<UShort16> cast);
+
 	Byte16() = default;
 	Byte16(RValue<Byte16> rhs);
 	Byte16(const Byte16 &rhs);
@@ -1146,6 +1151,30 @@ RValue<UShort8> operator~(RValue<UShort8> val);
 RValue<UShort8> Swizzle(RValue<UShort8> x, uint32_t select);
 RValue<UShort8> MulHigh(RValue<UShort8> x, RValue<UShort8> y);
 
+class UShort16 : public LValue<UShort16>
+{
+public:
+	explicit UShort16(RValue<Int16> cast);
+
+	UShort16() = default;
+	UShort16(unsigned short c);
+	UShort16(RValue<UShort16> rhs);
+	UShort16(const UShort16 &rhs);
+	UShort16(const Reference<UShort16> &rhs);
+	UShort16(RValue<UShort8> lo, RValue<UShort8> hi);
+
+	RValue<UShort16> operator=(RValue<UShort16> rhs);
+	RValue<UShort16> operator=(const UShort16 &rhs);
+	RValue<UShort16> operator=(const Reference<UShort16> &rhs);
+
+	static Type *type();
+	static int element_count() { return 16; }
+};
+
+// Each hex digit of the 64-bit select value is a lane index, lane 0 being
+// the most significant one (see createSwizzle8).
+RValue<UShort16> Swizzle(RValue<UShort16> x, uint64_t select);
+
 class Int : public LValue<Int>
 {
 public:
@@ -2318,6 +2347,77 @@ RValue<UInt> Extract(RValue<UInt8> val, int i);
 RValue<UInt8> Insert(RValue<UInt8> val, RValue<UInt> element, int i);
 //	RValue<UInt8> RoundInt(RValue<Float4> cast);
 //RValue<UInt8> Swizzle(RValue<UInt8> x, uint16_t select);
+
+class Int16 : public LValue<Int16>
+{
+public:
+	explicit Int16(RValue<Byte16> cast);
+	explicit Int16(RValue<UShort16> cast);
+	explicit Int16(RValue<Float16> cast);
+
+	Int16();
+	Int16(int c);
+
+	Int16(const Int &rhs);
+	Int16(const Int16 &rhs);
+	Int16(RValue<Int>);
+	Int16(RValue<Int16>);
+	Int16(const Reference<Int> &rhs);
+	Int16(const Reference<Int16> &rhs);
+
+	Int16(RValue<Int8> lo, RValue<Int8> hi);
+
+	RValue<Int16> operator=(RValue<Int16> rhs);
+	RValue<Int16> operator=(const Int16 &rhs);
+	RValue<Int16> operator=(const Reference<Int16> &rhs);
+
+	static Type *type();
+	static int element_count() { return 16; }
+
+private:
+	void constant(int x);
+};
+
+RValue<Int16> operator+(RValue<Int16> lhs, RValue<Int16> rhs);
+RValue<Int16> operator-(RValue<Int16> lhs, RValue<Int16> rhs);
+RValue<Int16> operator*(RValue<Int16> lhs, RValue<Int16> rhs);
+RValue<Int16> operator/(RValue<Int16> lhs, RValue<Int16> rhs);
+RValue<Int16> operator%(RValue<Int16> lhs, RValue<Int16> rhs);
+RValue<Int16> operator&(RValue<Int16> lhs, RValue<Int16> rhs);
+RValue<Int16> operator|(RValue<Int16> lhs, RValue<Int16> rhs);
+RValue<Int16> operator^(RValue<Int16> lhs, RValue<Int16> rhs);
+RValue<Int16> operator<<(RValue<Int16> lhs, unsigned char rhs);
+RValue<Int16> operator>>(RValue<Int16> lhs, unsigned char rhs);
+RValue<Int16> operator<<(RValue<Int16> lhs, RValue<Int16> rhs);
+RValue<Int16> operator>>(RValue<Int16> lhs, RValue<Int16> rhs);
+RValue<Int16> operator+(RValue<Int16> val);
+RValue<Int16> operator-(RValue<Int16> val);
+RValue<Int16> operator~(RValue<Int16> val);
+
+RValue<Int16> CmpEQ(RValue<Int16> x, RValue<Int16> y);
+RValue<Int16> CmpLT(RValue<Int16> x, RValue<Int16> y);
+RValue<Int16> CmpLE(RValue<Int16> x, RValue<Int16> y);
+RValue<Int16> CmpNEQ(RValue<Int16> x, RValue<Int16> y);
+RValue<Int16> CmpNLT(RValue<Int16> x, RValue<Int16> y);
+RValue<Int16> CmpNLE(RValue<Int16> x, RValue<Int16> y);
+inline RValue<Int16> CmpGT(RValue<Int16> x, RValue<Int16> y)
+{
+	return CmpNLE(x, y);
+}
+inline RValue<Int16> CmpGE(RValue<Int16> x, RValue<Int16> y)
+{
+	return CmpNLT(x, y);
+}
+
+RValue<Int> Extract(RValue<Int16> val, int i);
+RValue<Int16> Insert(RValue<Int16> val, RValue<Int> element, int i);
+
+RValue<Int16> Max(RValue<Int16> x, RValue<Int16> y);
+RValue<Int16> Min(RValue<Int16> x, RValue<Int16> y);
+RValue<Int16> RoundInt(RValue<Float16> cast);
+RValue<Int16> Abs(RValue<Int16> x);
+
+RValue<Int16> Swizzle(RValue<Int16> x, uint64_t select);
 //RValue<UInt8> Shuffle(RValue<UInt8> x, RValue<UInt8> y, uint16_t select);
 
 class Half : public LValue<Half>
@@ -2801,6 +2901,91 @@ static inline RValue<Float8> Log(RValue<Float8> x) { return Log<Float8>(x); }
 static inline RValue<Float8> Exp2(RValue<Float8> x) { return Exp2<Float8>(x); }
 static inline RValue<Float8> Log2(RValue<Float8> x) { return Log2<Float8>(x); }
 
+class Float16 : public LValue<Float16>
+{
+public:
+	explicit Float16(RValue<Byte16> cast);
+	explicit Float16(RValue<UShort16> cast);
+	explicit Float16(RValue<Int16> cast);
+
+	Float16();
+	Float16(float x);
+	Float16(RValue<Float16> rhs);
+	Float16(const Float16 &rhs);
+	Float16(const Reference<Float16> &rhs);
+	Float16(RValue<Float> rhs);
+	Float16(const Float &rhs);
+	Float16(const Reference<Float> &rhs);
+	Float16(Argument<Float16> argument);
+	Float16(RValue<Float8> lo, RValue<Float8> hi);
+
+	RValue<Float16> operator=(float replicate);
+	RValue<Float16> operator=(RValue<Float16> rhs);
+	RValue<Float16> operator=(const Float16 &rhs);
+	RValue<Float16> operator=(const Reference<Float16> &rhs);
+	RValue<Float16> operator=(RValue<Float> rhs);
+	RValue<Float16> operator=(const Float &rhs);
+	RValue<Float16> operator=(const Reference<Float> &rhs);
+
+	static Type *type();
+	static int element_count() { return 16; }
+
+private:
+	void constant(float x);
+};
+
+RValue<Float16> operator+(RValue<Float16> lhs, RValue<Float16> rhs);
+RValue<Float16> operator-(RValue<Float16> lhs, RValue<Float16> rhs);
+RValue<Float16> operator*(RValue<Float16> lhs, RValue<Float16> rhs);
+RValue<Float16> operator/(RValue<Float16> lhs, RValue<Float16> rhs);
+RValue<Float16> operator%(RValue<Float16> lhs, RValue<Float16> rhs);
+RValue<Float16> operator+(RValue<Float16> val);
+RValue<Float16> operator-(RValue<Float16> val);
+
+RValue<Float16> Abs(RValue<Float16> x);
+RValue<Float16> Max(RValue<Float16> x, RValue<Float16> y);
+RValue<Float16> Min(RValue<Float16> x, RValue<Float16> y);
+static inline RValue<Float16> FMA(RValue<Float16> a, RValue<Float16> b, RValue<Float16> c) { return FMA<Float16>(a, b, c); }
+
+RValue<Float16> TryFP16To32(RValue<UShort16>, bool &ok);
+RValue<UShort16> TryFP32To16(RValue<Float16>, bool &ok);
+
+RValue<Float16> Sqrt(RValue<Float16> x);
+RValue<Float16> Insert(RValue<Float16> val, RValue<Float> element, int i);
+RValue<Float> Extract(RValue<Float16> x, int i);
+RValue<Float16> Swizzle(RValue<Float16> x, uint64_t select);
+
+// Ordered comparison functions
+RValue<Int16> CmpEQ(RValue<Float16> x, RValue<Float16> y);
+RValue<Int16> CmpLT(RValue<Float16> x, RValue<Float16> y);
+RValue<Int16> CmpLE(RValue<Float16> x, RValue<Float16> y);
+RValue<Int16> CmpNEQ(RValue<Float16> x, RValue<Float16> y);
+RValue<Int16> CmpNLT(RValue<Float16> x, RValue<Float16> y);
+RValue<Int16> CmpNLE(RValue<Float16> x, RValue<Float16> y);
+inline RValue<Int16> CmpGT(RValue<Float16> x, RValue<Float16> y)
+{
+	return CmpNLE(x, y);
+}
+inline RValue<Int16> CmpGE(RValue<Float16> x, RValue<Float16> y)
+{
+	return CmpNLT(x, y);
+}
+
+RValue<Int16> IsInf(RValue<Float16> x);
+RValue<Int16> IsNan(RValue<Float16> x);
+RValue<Float16> Round(RValue<Float16> x);
+RValue<Float16> Trunc(RValue<Float16> x);
+RValue<Float16> Floor(RValue<Float16> x);
+
+static inline RValue<Float16> Sin(RValue<Float16> x) { return Sin<Float16>(x); }
+static inline RValue<Float16> Cos(RValue<Float16> x) { return Cos<Float16>(x); }
+static inline RValue<Float16> BuiltinPow(RValue<Float16> x, RValue<Float16> y) { return BuiltinPow<Float16>(x, y); }
+static inline RValue<Float16> Pow(RValue<Float16> x, RValue<Float16> y) { return Pow<Float16>(x, y); }
+static inline RValue<Float16> Exp(RValue<Float16> x) { return Exp<Float16>(x); }
+static inline RValue<Float16> Log(RValue<Float16> x) { return Log<Float16>(x); }
+static inline RValue<Float16> Exp2(RValue<Float16> x) { return Exp2<Float16>(x); }
+static inline RValue<Float16> Log2(RValue<Float16> x) { return Log2<Float16>(x); }
+
 // Call a unary C function on each element of a vector type.
 template<typename Func, typename T>
 inline RValue<T> ScalarizeCall(Func func, const RValue<T> &x)
@@ -2953,6 +3138,10 @@ RValue<UShort4> Gather(RValue<Pointer<UShort>> base, RValue<Int4> offsets, RValu
 RValue<UShort8> Gather(RValue<Pointer<UShort>> base, RValue<Int8> offsets, RValue<Int8> mask, unsigned int alignment, bool zeroMaskedLanes = false);
 RValue<Int4> Gather(RValue<Pointer<Int>> base, RValue<Int4> offsets, RValue<Int4> mask, unsigned int alignment, bool zeroMaskedLanes = false);
 RValue<Int8> Gather(RValue<Pointer<Int>> base, RValue<Int8> offsets, RValue<Int8> mask, unsigned int alignment, bool zeroMaskedLanes = false);
+RValue<Float16> Gather(RValue<Pointer<Float>> base, RValue<Int16> offsets, RValue<Int16> mask, unsigned int alignment, bool zeroMaskedLanes = false);
+RValue<Byte16> Gather(RValue<Pointer<Byte>> base, RValue<Int16> offsets, RValue<Int16> mask, unsigned int alignment, bool zeroMaskedLanes = false);
+RValue<UShort16> Gather(RValue<Pointer<UShort>> base, RValue<Int16> offsets, RValue<Int16> mask, unsigned int alignment, bool zeroMaskedLanes = false);
+RValue<Int16> Gather(RValue<Pointer<Int>> base, RValue<Int16> offsets, RValue<Int16> mask, unsigned int alignment, bool zeroMaskedLanes = false);
 void Scatter(RValue<Pointer<Float>> base, RValue<Float4> val, RValue<Int4> offsets, RValue<Int4> mask, unsigned int alignment);
 void Scatter(RValue<Pointer<Int>> base, RValue<Int4> val, RValue<Int4> offsets, RValue<Int4> mask, unsigned int alignment);
 
@@ -40,6 +40,8 @@ VS_EXTERNAL_API(void) VapourSynthPluginInit2(VSPlugin *plugin, const VSPLUGINAPI
         "version:data;"
         "expr_backend:data;"
         "expr_features:data[];"
+        "expr_disk_cache_hits:int;"
+        "expr_disk_cache_misses:int;"
         "select_features:data[];"
         "text_features:data[];"
         "tmpl_features:data[];",
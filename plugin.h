@@ -5,4 +5,10 @@
 
 void registerVersionFunc(VSPublicFunction f);
 
+// How a filter reads an input clip, as determined when it is created.
+// Frames are only requested from clips that are read. Reading only the frame
+// properties still needs the whole frame, but is told apart so that it can
+// be requested on its own once VapourSynth allows it.
+enum class ClipAccess { None, Props, Frame };
+
 #endif
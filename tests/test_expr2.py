@@ -1,3 +1,10 @@
+import json
+import math
+import os
+import pathlib
+import subprocess
+import sys
+
 import pytest
 import vapoursynth as vs
 
@@ -56,4 +63,355 @@ def test_gh_11() -> None:
 
     clip = core.std.BlankClip(format=vs.GRAY16, color=0)
     result = core.akarin.Expr(clip, "x 32768 / 0.86 pow 65535 *")
-    assert result.get_frame(0)[0][0, 0] == pytest.approx(1.5734745330615421e-28)
\ No newline at end of file
+    assert result.get_frame(0)[0][0, 0] == pytest.approx(1.5734745330615421e-28)
+
+
+# Evaluates each expression given as argument on a 67x9 gradient, which is
+# itself generated by an Expr, in a fresh process.
+ISOLATED_SCRIPT = """
+import json
+import sys
+import vapoursynth as vs
+core = vs.core
+clip = core.std.BlankClip(format=vs.GRAY8, width=67, height=9)
+clip = core.akarin.Expr(clip, "X 7 * Y 13 * + 255 %")
+frames = [[list(row) for row in core.akarin.Expr(clip, expr, vs.GRAYS).get_frame(0)[0]] for expr in sys.argv[1:]]
+version = core.akarin.Version()
+print(json.dumps(dict(frames=frames, hits=version["expr_disk_cache_hits"], misses=version["expr_disk_cache_misses"])))
+"""
+
+
+def run_isolated(exprs: list[str], **env: str) -> dict:
+    # The AKARIN_EXPR_* settings are read once per process.
+    result = subprocess.run([sys.executable, "-c", ISOLATED_SCRIPT, *exprs],
+                            env={**os.environ, **env}, capture_output=True, text=True)
+    assert result.returncode == 0, result.stderr
+    return dict(json.loads(result.stdout), log=result.stderr)
+
+
+def compile_log(result: dict) -> dict[str, str]:
+    # Maps each compiled expression to its AKARIN_EXPR_COMPILE_LOG entries.
+    logs: dict[str, str] = {}
+    lines = result["log"].splitlines()
+    for header, details in zip(lines, lines[1:]):
+        if header.startswith("akarin.Expr: "):
+            expr = header[len("akarin.Expr: "):]
+            logs[expr] = logs.get(expr, "") + details + "\n"
+    return logs
+
+
+def test_disk_cache(tmp_path: pathlib.Path) -> None:
+    exprs = ["x 0.1 * sin X +", "x x[1,0] + 2 / Y *"]
+    # One entry per expression, plus the generator of the input.
+    entries = len(exprs) + 1
+    first = run_isolated(exprs, AKARIN_EXPR_CACHE_DIR=str(tmp_path))
+    assert (first["hits"], first["misses"]) == (0, entries)
+    second = run_isolated(exprs, AKARIN_EXPR_CACHE_DIR=str(tmp_path))
+    assert (second["hits"], second["misses"]) == (entries, 0)
+    assert second["frames"] == first["frames"]
+
+    # Damaged entries are compiled again and replaced.
+    files = sorted(tmp_path.iterdir())
+    assert len(files) == entries
+    files[0].write_bytes(files[0].read_bytes()[:len(files[0].read_bytes()) // 2])
+    for f in files[1:]:
+        f.write_bytes(b"garbage")
+    damaged = run_isolated(exprs, AKARIN_EXPR_CACHE_DIR=str(tmp_path))
+    assert (damaged["hits"], damaged["misses"]) == (0, entries)
+    assert damaged["frames"] == first["frames"]
+    repaired = run_isolated(exprs, AKARIN_EXPR_CACHE_DIR=str(tmp_path))
+    assert (repaired["hits"], repaired["misses"]) == (entries, 0)
+
+
+def test_cache_spelling(tmp_path: pathlib.Path) -> None:
+    # Only the generator and the first spelling go to the disk cache, the
+    # second spelling is found in memory.
+    result = run_isolated(["x a! a@ 2 * X +", "src0 b!  b@ 2.0 * X +"], AKARIN_EXPR_CACHE_DIR=str(tmp_path))
+    assert (result["hits"], result["misses"]) == (0, 2)
+    assert result["frames"][0] == result["frames"][1]
+
+
+@pytest.mark.parametrize("entries, hits", [(1, 1), (1024, 0)])
+def test_cache_eviction(tmp_path: pathlib.Path, entries: int, hits: int) -> None:
+    # The first expression is evicted from memory once its filter is freed
+    # only if the bound is exceeded, and is then loaded from disk.
+    exprs = ["x 3 * X +", "x 5 * Y +", "x 3 * X +"]
+    result = run_isolated(exprs, AKARIN_EXPR_CACHE_DIR=str(tmp_path), AKARIN_EXPR_CACHE_ENTRIES=str(entries))
+    assert (result["hits"], result["misses"]) == (hits, 3)
+    assert result["frames"][0] == result["frames"][2]
+
+
+# Expressions calling the math helpers, with relative accesses and
+# convolutions, for comparing code generation settings.
+SETTINGS_EXPRS = [
+    "x 0.05 * sin x 0.03 * cos * X +",
+    "x 1 + log 2 pow x 0.01 * exp + Y +",
+    "x 0.5 pow x[1,0] 0.02 * sin + x[-1,1]:m 3 pow 1e-6 * +",
+    "x[conv:1,2,3,2,1/1,2,1] 27 / X - 0.01 * exp",
+]
+
+
+@pytest.fixture(scope="module")
+def default_settings() -> dict:
+    return run_isolated(SETTINGS_EXPRS, AKARIN_EXPR_COMPILE_LOG="1")
+
+
+def pixels(result: dict) -> list[float]:
+    return [v for frame in result["frames"] for row in frame for v in row]
+
+
+def test_compile_threads(default_settings: dict) -> None:
+    synchronous = run_isolated(SETTINGS_EXPRS, AKARIN_EXPR_COMPILE_THREADS="0")
+    assert synchronous["frames"] == default_settings["frames"]
+
+
+@pytest.mark.parametrize("setting, value, entry", [
+    ("AKARIN_EXPR_INLINE_MATH", "1", ", math inlined"),
+    # The baseline kernels are always compiled, the optimized ones may still
+    # be queued when the process exits.
+    ("AKARIN_EXPR_TIERED", "1", " instructions, baseline,"),
+    ("AKARIN_EXPR_STANDARD_PIPELINE", "1", ", optimized (standard pipeline)"),
+    # Every kernel is more than four times over a budget of one instruction.
+    ("AKARIN_EXPR_IR_BUDGET", "1", ", baseline (over 4x budget)"),
+])
+def test_compile_settings(default_settings: dict, setting: str, value: str, entry: str) -> None:
+    result = run_isolated(SETTINGS_EXPRS, AKARIN_EXPR_COMPILE_LOG="1", **{setting: value})
+    logs, default_logs = compile_log(result), compile_log(default_settings)
+    for expr in SETTINGS_EXPRS:
+        assert entry in logs[expr]
+        assert entry not in default_logs[expr]
+    # The settings may change the rounding, and with tiered compilation the
+    # frames come from either kernel.
+    assert pixels(result) == pytest.approx(pixels(default_settings), rel=1e-5, abs=1e-5)
+
+
+@pytest.mark.parametrize("input_format", [vs.GRAY8, vs.GRAY16, vs.GRAYH, vs.GRAYS])
+def test_lanes(input_format: vs.VideoFormat) -> None:
+    clip = core.std.BlankClip(format=vs.GRAY8, width=37, height=5, color=0)
+    clip = core.akarin.Expr(clip, "X Y 7 * +", input_format)
+    expr = "x[-3,0] x[5,1] + 2 / x[-2,0]:m max"
+    narrow = core.akarin.Expr(clip, expr, lanes=8).get_frame(0)[0]
+    wide = core.akarin.Expr(clip, expr, lanes=16).get_frame(0)[0]
+    assert [list(row) for row in narrow] == [list(row) for row in wide]
+
+
+def test_threads() -> None:
+    clip = core.std.BlankClip(format=vs.GRAY8, width=64, height=200, color=0)
+    clip = core.akarin.Expr(clip, "X Y 3 * + 255 %")
+    expr = "x[0,-2] x[1,3] + 2 / x[0,-5]:m max"
+    single = core.akarin.Expr(clip, expr).get_frame(0)[0]
+    striped = core.akarin.Expr(clip, expr, threads=4).get_frame(0)[0]
+    assert [list(row) for row in single] == [list(row) for row in striped]
+
+
+def test_fused_planes() -> None:
+    a = core.std.BlankClip(format=vs.RGB24, color=[10, 20, 30])
+    b = core.std.BlankClip(format=vs.RGB24, color=[1, 2, 3])
+    frame = core.akarin.Expr([a, b], ["x 2 *", "x y - 3 *", "x y + x.PlaneStatsAverage 0 ? +"]).get_frame(0)
+    assert [frame[p][0, 0] for p in range(3)] == [20, 54, 33]
+
+
+@pytest.mark.parametrize("input_format", [vs.GRAY8, vs.GRAYS])
+@pytest.mark.parametrize("opt", [0, 1])
+def test_optimizer(input_format: vs.VideoFormat, opt: int) -> None:
+    clip = core.std.BlankClip(format=input_format, color=[3])
+    expr = "x 2 pow x * x 2 * + x x 3 / - 2 * x 1 > x 5 ? + +"
+    frame = core.akarin.Expr(clip, expr, opt=opt).get_frame(0)
+    assert frame[0][0, 0] == pytest.approx(3**3 + 3*2 + (3 - 1) * 2 + 3)
+
+
+def test_hoisting() -> None:
+    clip = core.std.BlankClip(format=vs.GRAYS, width=16, height=8, color=[3])
+    clip = core.std.SetFrameProps(clip, Gain=2.0)
+    frame = core.akarin.Expr(clip, "x x.Gain 2 pow * Y height / 0.5 - dup * + X +").get_frame(0)
+    for y in range(8):
+        for x in range(16):
+            assert frame[0][y, x] == pytest.approx(3 * 4 + (y / 8 - 0.5) ** 2 + x)
+
+
+def test_specialize() -> None:
+    clip = core.std.BlankClip(format=vs.GRAY8, length=2, color=[10])
+    clip = core.std.SetFrameProps(clip, Mode=0) + core.std.SetFrameProps(clip, Mode=1) + core.std.SetFrameProps(clip, Mode=2)
+    expr = "x.Mode 1 = x 2 * x 3 * ? x.Mode * x +"
+    generic = core.akarin.Expr(clip, expr)
+    specialized = core.akarin.Expr(clip, expr, specialize=2)
+    for _ in range(2):
+        for n in range(clip.num_frames):
+            assert specialized.get_frame(n)[0][0, 0] == generic.get_frame(n)[0][0, 0]
+
+
+@pytest.mark.parametrize("unroll", [1, 2, 4])
+def test_unroll(unroll: int) -> None:
+    clip = core.std.BlankClip(format=vs.GRAY8, width=101, height=4, color=0)
+    clip = core.akarin.Expr(clip, "X 3 * Y + 255 %")
+    expr = "x x[1,0] + x[-1,0]:m + 3 /"
+    auto = core.akarin.Expr(clip, expr).get_frame(0)[0]
+    pinned = core.akarin.Expr(clip, expr, unroll=unroll).get_frame(0)[0]
+    assert [list(row) for row in auto] == [list(row) for row in pinned]
+
+
+@pytest.mark.parametrize("input_format", [vs.GRAY8, vs.GRAYS])
+@pytest.mark.parametrize("opt", [0, 1])
+@pytest.mark.parametrize("boundary", [0, 1])
+def test_convolution(input_format: vs.VideoFormat, opt: int, boundary: int) -> None:
+    clip = core.std.BlankClip(format=vs.GRAY8, width=67, height=6, color=0)
+    clip = core.akarin.Expr(clip, "X 7 * Y 13 * + 255 %", input_format)
+    taps = [(dx, dy, (dx + 3) * (2 - abs(dy))) for dy in range(-1, 2) for dx in range(-2, 3)]
+    explicit = "0 " + " ".join(f"x[{dx},{dy}] {w} * +" for dx, dy, w in taps) + " 60 /"
+    full = "x[conv:" + ",".join(["0"] * 5 + [str(w) for _, _, w in taps] + ["0"] * 5) + "] 60 /"
+    separable = "x[conv:1,2,3,4,5/1,2,1] 60 /"
+    reference = core.akarin.Expr(clip, explicit, opt=opt, boundary=boundary).get_frame(0)[0]
+    for expr in [full, separable]:
+        frame = core.akarin.Expr(clip, expr, opt=opt, boundary=boundary).get_frame(0)[0]
+        assert [list(row) for row in frame] == [list(row) for row in reference]
+
+
+@pytest.mark.parametrize("rows", [2, 3, 4])
+def test_rows(rows: int) -> None:
+    clip = core.std.BlankClip(format=vs.GRAY8, width=45, height=23, color=0)
+    clip = core.akarin.Expr(clip, "X 5 * Y 11 * + 255 %")
+    expr = "x[0,-2] x[0,-1] + x + x[0,1]:m + x[1,2] + 5 / Y +"
+    single = core.akarin.Expr(clip, expr).get_frame(0)[0]
+    blocked = core.akarin.Expr(clip, expr, rows=rows).get_frame(0)[0]
+    assert [list(row) for row in single] == [list(row) for row in blocked]
+
+
+@pytest.mark.parametrize("input_format", [vs.GRAY8, vs.GRAY10, vs.GRAYS])
+def test_lookup_table(input_format: vs.VideoFormat) -> None:
+    clip = core.std.BlankClip(format=vs.GRAY16, width=640, height=64, length=2, color=0)
+    clip = core.akarin.Expr(clip, "X 131 * Y 7 * + 1023 %", vs.GRAY10)
+    clip = core.std.SetFrameProps(clip[0], Gain=2.0) + core.std.SetFrameProps(clip[1], Gain=3.0)
+    expr = "x 1023 / 0.45 pow x.Gain * 100 *"
+    # X makes the expression depend on the position, which disables the table.
+    lookup = core.akarin.Expr(clip, expr, input_format)
+    generic = core.akarin.Expr(clip, expr + " X 0 * +", input_format)
+    for n in range(2):
+        assert [list(row) for row in lookup.get_frame(n)[0]] == [list(row) for row in generic.get_frame(n)[0]]
+
+
+def test_lookup_table_changing() -> None:
+    # Gain cycles through more values than tables are kept, then takes a new
+    # value on every frame, which gives up the tables for the generic kernel.
+    clip = core.std.BlankClip(format=vs.GRAY8, width=64, height=8, length=80)
+    clip = core.akarin.Expr(clip, "X 4 * Y +")
+    clip = core.akarin.PropExpr(clip, lambda: dict(Gain="N 40 < N 20 % N ? 0.1 * 1 +"))
+    expr = "x 255 / 0.45 pow x.Gain * 100 *"
+    lookup = core.akarin.Expr(clip, expr, vs.GRAYS)
+    generic = core.akarin.Expr(clip, expr + " X 0 * +", vs.GRAYS)
+    for n in range(80):
+        assert [list(row) for row in lookup.get_frame(n)[0]] == [list(row) for row in generic.get_frame(n)[0]]
+
+
+def test_integer_range() -> None:
+    clip = core.std.BlankClip(format=vs.GRAY16, width=8, height=1, color=[65535])
+    # The square overflows int32, so this must not be evaluated in integer lanes.
+    frame = core.akarin.Expr(clip, "x x * 65536 /", vs.GRAYS).get_frame(0)
+    assert frame[0][0, 0] == pytest.approx(65535 * 65535 / 65536)
+    # Constants beyond int32 are floats, and sort0 before anything is on the stack is a no-op.
+    frame = core.akarin.Expr(clip, "sort0 x 3e9 +", vs.GRAYS).get_frame(0)
+    assert frame[0][0, 0] == pytest.approx(3e9 + 65535)
+    clip = core.akarin.Expr(core.std.BlankClip(format=vs.GRAY8, width=33, height=3), "X 7 * Y 3 * + 255 %")
+    expr = "x 3 * x[1,0] 2 * + 5 - x[-1,0] max"
+    auto = core.akarin.Expr(clip, expr, vs.GRAY16).get_frame(0)[0]
+    integer = core.akarin.Expr(clip, expr, vs.GRAY16, opt=1).get_frame(0)[0]
+    assert [list(row) for row in auto] == [list(row) for row in integer]
+
+
+def test_integer_range_size() -> None:
+    # The product fits in 24 bits on the narrow clip only, so the integer
+    # kernel compiled for it must not be reused for the wide one.
+    expr = "x X * X *"
+    narrow = core.std.BlankClip(format=vs.GRAY16, width=16, height=1, color=[65535])
+    wide = core.std.BlankClip(format=vs.GRAY16, width=2000, height=1, color=[65535])
+    assert core.akarin.Expr(narrow, expr, vs.GRAYS).get_frame(0)[0][0, 15] == 65535 * 15 * 15
+    assert core.akarin.Expr(wide, expr, vs.GRAYS).get_frame(0)[0][0, 1999] == pytest.approx(65535 * 1999 * 1999)
+
+
+@pytest.mark.parametrize("input_format", [vs.GRAY8, vs.GRAY16, vs.GRAYS])
+def test_expr_stats(input_format: vs.VideoFormat) -> None:
+    clip = core.std.BlankClip(format=vs.GRAY8, width=61, height=7, color=0)
+    clip = core.akarin.Expr(clip, "X 5 * Y 9 * + 255 %", input_format)
+    expr = "x 2 * x[1,0] - 3 /"
+    plane = core.std.PlaneStats(core.akarin.Expr(clip, expr)).get_frame(0).props
+    props = core.akarin.ExprStats(clip, expr, bins=4).get_frame(0).props
+    assert props["ExprStatsMin"] == plane["PlaneStatsMin"]
+    assert props["ExprStatsMax"] == plane["PlaneStatsMax"]
+    assert props["ExprStatsAverage"] == pytest.approx(plane["PlaneStatsAverage"])
+    frame = core.akarin.Expr(clip, expr).get_frame(0)[0]
+    values = [v for row in frame for v in row]
+    assert props["ExprStatsNonZero"] == sum(v != 0 for v in values)
+    assert sum(props["ExprStatsHistogram"]) == len(values)
+
+
+def test_prop_expr() -> None:
+    clip = core.std.BlankClip(format=vs.GRAY8, length=3)
+    clip = core.akarin.PropExpr(clip, lambda: dict(A="N 2 * 1 +", B=[1, 2]))
+    clip = core.akarin.PropExpr(clip, lambda: dict(C="x.A x.B - abs width +", D="x.A x.B argmin2", E="x.B x.A sort2 -"))
+    for n in range(3):
+        props = clip.get_frame(n).props
+        a, b = 2 * n + 1, [1, 2][n % 2]
+        assert (props["A"], props["B"], props["C"]) == (a, b, abs(a - b) + 640)
+        assert props["D"] == (0 if a <= b else 1)
+        assert props["E"] == max(a, b) - min(a, b)
+
+
+def test_prop_expr_delete() -> None:
+    clip = core.std.SetFrameProps(core.std.BlankClip(format=vs.GRAY8, length=2), A=1, B=2)
+    clip = core.akarin.PropExpr(clip, lambda: dict(A="", C=["", "x.B"]))
+    props = clip.get_frame(0).props
+    assert "A" not in props and "C" not in props and props["B"] == 2
+    assert clip.get_frame(1).props["C"] == 2
+    with pytest.raises(vs.Error, match="at least one value"):
+        core.akarin.PropExpr(clip, lambda: dict(A="x.B argmin0 drop1"))
+
+
+def test_prop_expr_float() -> None:
+    # Evaluated in float: neither wraps around in int32 nor uses the Expr approximations.
+    clip = core.std.BlankClip(format=vs.GRAY8, length=3000)
+    clip = core.akarin.PropExpr(clip, lambda: dict(A="N 1000000 *", B="N 0.001 * sin"))
+    props = clip.get_frame(2999).props
+    assert props["A"] == pytest.approx(2999 * 1000000)
+    assert props["B"] == pytest.approx(math.sin(2.999), abs=1e-6)
+    ones = core.std.BlankClip(clip, color=[1])
+    select = core.akarin.Select([clip, ones], clip, "N 1000000 * 2000000000 >")
+    assert select.get_frame(2999)[0][0, 0] == 1
+
+
+def test_prop_expr_shared() -> None:
+    # The type of A changes between frames and A is used by several keys.
+    clip = core.std.BlankClip(format=vs.GRAY8, length=1)
+    clip = core.std.SetFrameProps(clip, A=3) + core.std.SetFrameProps(clip, A=2.25) + core.std.SetFrameProps(clip, A="a")
+    clip = core.akarin.PropExpr(clip, lambda: dict(B="x.A 2 *", C="x.A x.Missing +", D="x.A 1 + round"))
+    for n, (a, d) in enumerate([(3, 4), (2.25, 3), (ord("a"), ord("a") + 1)]):
+        props = clip.get_frame(n).props
+        assert (props["B"], props["C"], props["D"]) == (a * 2, a, d)
+
+
+def test_prop_expr_bytecode() -> None:
+    clip = core.std.BlankClip(format=vs.GRAY8, length=3)
+    clip = core.akarin.PropExpr(clip, lambda: dict(A="N 2 +"))
+    # a is reassigned while its old value is on the stack.
+    clip = core.akarin.PropExpr(clip, lambda: dict(
+        B="x.A a! a@ a@ * b! a@ 3 a! a@ b@ + swap1 - round",
+        C="x.A 1 x.A dup2 sort4 swap3 drop2 argsort2 swap1 - round"))
+    for n in range(3):
+        props = clip.get_frame(n).props
+        a = n + 2
+        assert props["B"] == 3 + a * a - a
+        assert props["C"] == -1
+
+
+def test_unused_clips() -> None:
+    clip = core.std.BlankClip(format=vs.GRAY8, length=2)
+
+    def fail(n: int, f: vs.VideoFrame) -> vs.VideoFrame:
+        raise RuntimeError("frame requested")
+    bad = core.std.ModifyFrame(clip, clip, fail)
+
+    # Frames of clips that are not referred to are not requested.
+    core.akarin.Expr([clip, bad], "x 1 +").get_frame(0)
+    core.akarin.Select([clip, clip], [clip, bad], "x._Duration 0 >").get_frame(0)
+    core.akarin.PropExpr([clip, bad], lambda: dict(A="x._Duration", B=["y._Duration", 1])).get_frame(1)
+    core.akarin.Text([clip, bad], "{x._Duration}", prop="T").get_frame(0)
+    with pytest.raises(vs.Error):
+        core.akarin.Expr([clip, bad], "x y.A +").get_frame(0)
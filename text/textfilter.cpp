@@ -21,6 +21,7 @@
 #include <cstdint>
 #include <cstdlib>
 
+#include <algorithm>
 #include <functional>
 #include <iterator>
 #include <regex>
@@ -306,6 +307,9 @@ struct PropAccess {
 
 typedef struct {
     std::vector<VSNode *> nodes;
+    // Text is drawn on the first clip, the others are only read for the
+    // properties in pa.
+    std::vector<ClipAccess> access;
     const VSVideoInfo *vi;
 
     std::string text;
@@ -527,16 +531,20 @@ static const VSFrame *VS_CC textGetFrame(int n, int activationReason, void *inst
     TextData *d = static_cast<TextData *>(instanceData);
 
     if (activationReason == arInitial) {
-        for (auto node: d->nodes)
-            vsapi->requestFrameFilter(n, node, frameCtx);
+        for (size_t i = 0; i < d->nodes.size(); i++) {
+            if (d->access[i] != ClipAccess::None)
+                vsapi->requestFrameFilter(n, d->nodes[i], frameCtx);
+        }
     } else if (activationReason == arAllFramesReady) {
-        std::vector<const VSFrame *> srcs;
+        std::vector<const VSFrame *> srcs(d->nodes.size(), nullptr);
         const VSFrame *src = nullptr;
         auto out = fmt::memory_buffer();
         try {
-            for (auto node: d->nodes) {
-                auto f = vsapi->getFrameFilter(n, node, frameCtx);
-                srcs.push_back(f);
+            for (size_t i = 0; i < d->nodes.size(); i++) {
+                if (d->access[i] == ClipAccess::None)
+                    continue;
+                auto f = vsapi->getFrameFilter(n, d->nodes[i], frameCtx);
+                srcs[i] = f;
                 const VSVideoFormat *frame_format = vsapi->getVideoFrameFormat(f);
                 if ((frame_format->sampleType == stInteger && frame_format->bitsPerSample > 16) ||
                         (frame_format->sampleType == stFloat && frame_format->bitsPerSample != 32)) {
@@ -639,9 +647,12 @@ static void VS_CC textCreate(const VSMap *in, VSMap *out, void *userData, VSCore
         d->text = vsapi->mapGetData(in, "text", 0, nullptr);
         d->pa = checkFormatString(d->text);
 
+        d->access.assign(d->nodes.size(), ClipAccess::None);
+        d->access[0] = ClipAccess::Frame;
         for (const auto &pa: d->pa) {
             if (pa.index < 0 || pa.index >= d->nodes.size())
                 throw std::runtime_error(fmt::format("Text: {} references to out of bound clip (only {} clips)", pa.id, d->nodes.size()));
+            d->access[pa.index] = std::max(d->access[pa.index], ClipAccess::Props);
         }
 
         auto propName = vsapi->mapGetData(in, "prop", 0, &err);
@@ -657,13 +668,10 @@ static void VS_CC textCreate(const VSMap *in, VSMap *out, void *userData, VSCore
     }
 
     std::vector<VSFilterDependency> deps;
-    deps.reserve(d->nodes.size());
-    std::transform(
-        d->nodes.begin(),
-        d->nodes.end(),
-        std::back_inserter(deps),
-        [&](auto *node) { return VSFilterDependency{node, rpStrictSpatial}; }
-    );
+    for (size_t i = 0; i < d->nodes.size(); i++) {
+        if (d->access[i] != ClipAccess::None)
+            deps.push_back({ d->nodes[i], rpStrictSpatial });
+    }
 
     const VSVideoInfo *vi = d->vi;
     vsapi->createVideoFilter(out, "Text", vi, textGetFrame, textFree, fmParallel, deps.data(), deps.size(), d.release(), core);
@@ -1,10 +1,12 @@
 #include <cstdint>
 #include <cstdlib>
 
+#include <algorithm>
 #include <functional>
 #include <iterator>
 #include <map>
 #include <regex>
+#include <set>
 #include <string>
 #include <vector>
 
@@ -41,6 +43,9 @@ public:
 
 typedef struct {
     std::vector<VSNode *> nodes;
+    // Properties are written to the frames of the first clip, the others are
+    // only read for the properties the templates refer to.
+    std::vector<ClipAccess> access;
     const VSVideoInfo *vi;
 
     std::vector<std::string> text;
@@ -50,20 +55,82 @@ typedef struct {
     std::vector<inja::Template> tmpl;
 } TmplData;
 
+// Collects the clips whose properties a template refers to. Names that
+// are only known when rendering, as with exists(), may refer to any clip.
+class ClipVisitor : public inja::NodeVisitor {
+    void visit(const inja::BlockNode &node) override {
+        for (auto &n : node.nodes)
+            n->accept(*this);
+    }
+    void visit(const inja::TextNode &) override {}
+    void visit(const inja::ExpressionNode &) override {}
+    void visit(const inja::LiteralNode &) override {}
+    void visit(const inja::DataNode &node) override {
+        static const std::regex clipRe { "^([a-z]|" + clipNamePrefix + "[0-9]+)$" };
+        const auto &tokens = node.ptr.reference_tokens;
+        if (tokens.empty() || !std::regex_match(tokens[0], clipRe))
+            return;
+        const std::string &name = tokens[0];
+        if (name.size() == 1)
+            clips.insert(name[0] >= 'x' ? name[0] - 'x' : name[0] - 'a' + 3);
+        else
+            clips.insert(std::atoi(name.c_str() + clipNamePrefix.size()));
+    }
+    void visit(const inja::FunctionNode &node) override {
+        if (node.operation == inja::FunctionStorage::Operation::Exists)
+            all = true;
+        for (auto &n : node.arguments)
+            n->accept(*this);
+    }
+    void visit(const inja::ExpressionListNode &node) override {
+        if (node.root)
+            node.root->accept(*this);
+    }
+    void visit(const inja::StatementNode &) override {}
+    void visit(const inja::ForStatementNode &) override {}
+    void visit(const inja::ForArrayStatementNode &node) override {
+        node.condition.accept(*this);
+        node.body.accept(*this);
+    }
+    void visit(const inja::ForObjectStatementNode &node) override {
+        node.condition.accept(*this);
+        node.body.accept(*this);
+    }
+    void visit(const inja::IfStatementNode &node) override {
+        node.condition.accept(*this);
+        node.true_statement.accept(*this);
+        node.false_statement.accept(*this);
+    }
+    void visit(const inja::IncludeStatementNode &) override { all = true; }
+    void visit(const inja::ExtendsStatementNode &) override { all = true; }
+    void visit(const inja::BlockStatementNode &node) override {
+        node.block.accept(*this);
+    }
+    void visit(const inja::SetStatementNode &node) override {
+        node.expression.accept(*this);
+    }
+
+public:
+    std::set<int> clips;
+    bool all = false;
+};
+
 static const VSFrame *VS_CC tmplGetFrame(int n, int activationReason, void *instanceData, void **frameData, VSFrameContext *frameCtx, VSCore *core, const VSAPI *vsapi) {
     TmplData *d = static_cast<TmplData *>(instanceData);
 
     if (activationReason == arInitial) {
-        for (auto node: d->nodes)
-            vsapi->requestFrameFilter(n, node, frameCtx);
+        for (size_t i = 0; i < d->nodes.size(); i++) {
+            if (d->access[i] != ClipAccess::None)
+                vsapi->requestFrameFilter(n, d->nodes[i], frameCtx);
+        }
     } else if (activationReason == arAllFramesReady) {
-        std::vector<const VSFrame *> srcs;
+        std::vector<const VSFrame *> srcs(d->nodes.size(), nullptr);
         const VSFrame *src = nullptr;
         std::vector<std::string> out(d->tmpl.size());
         try {
-            for (auto node: d->nodes) {
-                auto f = vsapi->getFrameFilter(n, node, frameCtx);
-                srcs.push_back(f);
+            for (size_t i = 0; i < d->nodes.size(); i++) {
+                if (d->access[i] != ClipAccess::None)
+                    srcs[i] = vsapi->getFrameFilter(n, d->nodes[i], frameCtx);
             }
 
             src = srcs[0];
@@ -247,6 +314,16 @@ static void VS_CC tmplCreate(const VSMap *in, VSMap *out, void *userData, VSCore
                 throw e2;
             }
         }
+
+        ClipVisitor visitor;
+        for (const auto &t: d->tmpl)
+            t.root.accept(visitor);
+        d->access.assign(d->nodes.size(), visitor.all ? ClipAccess::Props : ClipAccess::None);
+        d->access[0] = ClipAccess::Frame;
+        for (int clip: visitor.clips) {
+            if (static_cast<size_t>(clip) < d->nodes.size())
+                d->access[clip] = std::max(d->access[clip], ClipAccess::Props);
+        }
     } catch (std::runtime_error &e) {
         for (auto p: d->nodes)
             vsapi->freeNode(p);
@@ -255,15 +332,10 @@ static void VS_CC tmplCreate(const VSMap *in, VSMap *out, void *userData, VSCore
     }
 
     std::vector<VSFilterDependency> deps;
-    deps.reserve(d->nodes.size());
-    std::transform(
-        d->nodes.begin(),
-        d->nodes.end(),
-        std::back_inserter(deps),
-        [&](auto *node) {
-            return VSFilterDependency{node, rpStrictSpatial};
-        }
-    );
+    for (size_t i = 0; i < d->nodes.size(); i++) {
+        if (d->access[i] != ClipAccess::None)
+            deps.push_back({ d->nodes[i], rpStrictSpatial });
+    }
 
     const VSVideoInfo *vi = d->vi;
     vsapi->createVideoFilter(out, "Tmpl", vi, tmplGetFrame, tmplFree, fmParallel, deps.data(), deps.size(), d.release(), core);